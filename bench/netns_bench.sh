@@ -0,0 +1,143 @@
+#!/bin/bash
+# netns_bench.sh
+#
+#  end to end benchmark of udp2raw. client and server run in two network namespaces joined by a veth pair,
+#  udp_load drives echo traffic through the tunnel. needs root,iproute2,and tc for NETEM.
+#
+#  usage: sudo bench/netns_bench.sh [udp2raw binary] [udp_load binary]
+#         (or 'make bench' / 'cmake --build <dir> --target bench')
+#
+#  every combination of the lists below is run. one json line per run goes to $OUT,a table to stdout.
+#    RAW_MODES     default: faketcp udp icmp
+#    CIPHER_MODES  default: aes128cbc aes128cfb xor none
+#    AUTH_MODES    default: md5 crc32 simple hmac_sha1 none
+#    SIZES         udp payload sizes,default: 64 512 1200 1700
+#                  (1700 is about the largest that fits max_data_len=1800 after tunnel overhead)
+#    DURATION      seconds per run,default 3
+#    WINDOW        datagrams in flight,default 64
+#    NETEM         tc netem arguments applied on both ends of the veth,ie "delay 1ms loss 0.1%",default none
+#    EXTRA_ARGS    extra udp2raw options for both sides,ie "--seq-mode 1"
+#    OUT           default bench_results.jsonl
+#
+#  fields: pps/gbps are echoed datagrams (or bits of payload) per second,rtt is measured by udp_load through
+#  the tunnel and back,cpu_ns_per_pkt is cpu time of client+server udp2raw divided by echoed datagrams
+
+U2R=${1:-./udp2raw}
+LOAD=${2:-./udp_load}
+RAW_MODES=${RAW_MODES:-"faketcp udp icmp"}
+CIPHER_MODES=${CIPHER_MODES:-"aes128cbc aes128cfb xor none"}
+AUTH_MODES=${AUTH_MODES:-"md5 crc32 simple hmac_sha1 none"}
+SIZES=${SIZES:-"64 512 1200 1700"}
+DURATION=${DURATION:-3}
+WINDOW=${WINDOW:-64}
+NETEM=${NETEM:-}
+EXTRA_ARGS=${EXTRA_ARGS:-}
+OUT=${OUT:-bench_results.jsonl}
+
+NS_C=u2r_bench_c
+NS_S=u2r_bench_s
+IP_C=10.231.0.1
+IP_S=10.231.0.2
+LOG_DIR=$(mktemp -d /tmp/u2r_bench.XXXXXX)
+
+if [ "$(id -u)" != 0 ]; then
+    echo "needs root for network namespaces" >&2
+    exit 1
+fi
+for f in "$U2R" "$LOAD"; do
+    if [ ! -x "$f" ]; then
+        echo "$f not found,build it first or pass the path" >&2
+        exit 1
+    fi
+done
+U2R=$(readlink -f "$U2R")
+LOAD=$(readlink -f "$LOAD")
+
+PIDS=()
+stop_all() {
+    for p in "${PIDS[@]}"; do kill "$p" 2>/dev/null; done
+    wait 2>/dev/null
+    PIDS=()
+}
+cleanup() {
+    stop_all
+    ip netns del $NS_C 2>/dev/null
+    ip netns del $NS_S 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+cleanup
+ip netns add $NS_C
+ip netns add $NS_S
+ip link add u2r_c0 netns $NS_C type veth peer name u2r_s0 netns $NS_S
+ip -n $NS_C addr add $IP_C/24 dev u2r_c0
+ip -n $NS_S addr add $IP_S/24 dev u2r_s0
+for ns in $NS_C $NS_S; do
+    dev=u2r_${ns: -1}0
+    ip -n $ns link set lo up
+    ip -n $ns link set $dev mtu 9000 up  # so that max_data_len sized packets dont need fragmentation
+    if [ -n "$NETEM" ]; then
+        ip netns exec $ns tc qdisc add dev $dev root netem $NETEM || exit 1
+    fi
+done
+
+AUTO_RULE=""
+if command -v iptables >/dev/null; then
+    AUTO_RULE="-a"  # keep the kernel from answering the raw traffic with rst/icmp unreachable
+else
+    echo "iptables not found,running without -a,the kernel may answer raw packets with rst/unreachable" >&2
+fi
+
+cpu_ticks() {  # utime+stime of a pid
+    awk '{print $14+$15}' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+ip netns exec $NS_S "$LOAD" echo 127.0.0.1 7777 &
+PIDS+=($!)
+ECHO_PID=$!
+HZ=$(getconf CLK_TCK)
+
+printf "%-8s %-10s %-10s %6s %10s %8s %10s %10s %10s %6s\n" raw_mode cipher auth size pps gbit/s p50_us p99_us cpu_ns/pkt lost
+: >"$OUT"
+for raw in $RAW_MODES; do
+    for cipher in $CIPHER_MODES; do
+        for auth in $AUTH_MODES; do
+            for size in $SIZES; do
+                args="--raw-mode $raw --cipher-mode $cipher --auth-mode $auth -k bench --log-level 2 --mtu-warn 9000 $AUTO_RULE $EXTRA_ARGS"
+                ip netns exec $NS_S "$U2R" -s -l$IP_S:4096 -r127.0.0.1:7777 $args >"$LOG_DIR/s.log" 2>&1 &
+                S_PID=$!
+                sleep 0.3
+                ip netns exec $NS_C "$U2R" -c -l127.0.0.1:3333 -r$IP_S:4096 $args >"$LOG_DIR/c.log" 2>&1 &
+                C_PID=$!
+                PIDS=($ECHO_PID $S_PID $C_PID)
+                sleep 1.5  # handshake
+
+                t0=$(($(cpu_ticks $S_PID) + $(cpu_ticks $C_PID)))
+                res=$(ip netns exec $NS_C "$LOAD" send 127.0.0.1 3333 $size $DURATION $WINDOW)
+                t1=$(($(cpu_ticks $S_PID) + $(cpu_ticks $C_PID)))
+                kill $S_PID $C_PID 2>/dev/null
+                wait $S_PID $C_PID 2>/dev/null
+
+                if [ -z "$res" ]; then
+                    echo "$raw $cipher $auth $size: udp_load failed,logs in $LOG_DIR" >&2
+                    continue
+                fi
+                line=$(echo "$res" | awk -v raw=$raw -v cipher=$cipher -v auth=$auth -v size=$size -v dt=$((t1 - t0)) -v hz=$HZ -v netem="$NETEM" '{
+                    match($0, /"received":[0-9]+/); recv = substr($0, RSTART + 11, RLENGTH - 11) + 0;
+                    cpu = recv > 0 ? dt * 1e9 / hz / recv : 0;
+                    sub(/^\{/, "");
+                    printf "{\"raw_mode\":\"%s\",\"cipher_mode\":\"%s\",\"auth_mode\":\"%s\",\"size\":%d,\"netem\":\"%s\",\"cpu_ns_per_pkt\":%.0f,%s\n", raw, cipher, auth, size, netem, cpu, $0
+                }')
+                echo "$line" >>"$OUT"
+                echo "$line" | awk -F'[:,}]' '{
+                    for (i = 1; i < NF; i++) { gsub(/[{"]/, "", $i); v[$i] = $(i + 1) }
+                    gsub(/"/, "", v["raw_mode"]); gsub(/"/, "", v["cipher_mode"]); gsub(/"/, "", v["auth_mode"]);
+                    printf "%-8s %-10s %-10s %6d %10d %8.3f %10.1f %10.1f %10d %6d\n", v["raw_mode"], v["cipher_mode"], v["auth_mode"], v["size"],
+                        v["pps"], v["gbps"], v["rtt_p50_us"], v["rtt_p99_us"], v["cpu_ns_per_pkt"], v["sent"] - v["received"]
+                }'
+            done
+        done
+    done
+done
+echo "results written to $OUT" >&2
@@ -0,0 +1,133 @@
+/*
+ * udp_load.cpp
+ *
+ *  udp load generator for bench/netns_bench.sh
+ *
+ *  udp_load echo <ip> <port>
+ *      reflect every datagram back to its sender
+ *  udp_load send <ip> <port> <size> <seconds> [window]
+ *      keep at most <window> datagrams of <size> bytes in flight towards an echo server,
+ *      print one line of json: packets,throughput and round trip percentiles
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+typedef unsigned long long u64_t;
+
+static u64_t now_ns() {
+    timespec tmp_time;
+    clock_gettime(CLOCK_MONOTONIC, &tmp_time);
+    return ((u64_t)tmp_time.tv_sec) * 1000000000llu + tmp_time.tv_nsec;
+}
+
+static int make_addr(const char *ip, const char *port, sockaddr_in &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    return inet_pton(AF_INET, ip, &addr.sin_addr) == 1 ? 0 : -1;
+}
+
+static int run_echo(sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int buf_size = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "bind failed,%s\n", strerror(errno));
+        return 1;
+    }
+    char buf[65536];
+    for (;;) {
+        sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &from_len);
+        if (len < 0) continue;
+        sendto(fd, buf, len, 0, (sockaddr *)&from, from_len);
+    }
+    return 0;
+}
+
+static int run_send(sockaddr_in &addr, int size, double seconds, int window) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int buf_size = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "connect failed,%s\n", strerror(errno));
+        return 1;
+    }
+
+    vector<char> buf(max(size, 65536));
+    vector<u64_t> rtts;
+    rtts.reserve(1 << 20);
+    u64_t sent = 0, received = 0, given_up = 0;  // given_up: in flight when the path stalled,counted as lost
+    u64_t begin = now_ns();
+    u64_t end = begin + (u64_t)(seconds * 1e9);
+    u64_t last_recv = begin;
+    u64_t drain_end = 0;
+
+    for (;;) {
+        u64_t now = now_ns();
+        if (drain_end == 0 && now >= end) drain_end = now + 500 * 1000000llu;
+        if (drain_end != 0 && (now >= drain_end || sent == received + given_up)) break;
+
+        while (drain_end == 0 && sent - received - given_up < (u64_t)window) {
+            u64_t header[2] = {sent, now_ns()};  // seq,timestamp
+            memcpy(&buf[0], header, sizeof(header));
+            if (send(fd, &buf[0], size, MSG_DONTWAIT) < 0) break;
+            sent++;
+        }
+
+        pollfd pfd = {fd, POLLIN, 0};
+        poll(&pfd, 1, 10);
+        for (;;) {
+            int len = recv(fd, &buf[0], buf.size(), MSG_DONTWAIT);
+            if (len < (int)(2 * sizeof(u64_t))) break;
+            u64_t header[2];
+            memcpy(header, &buf[0], sizeof(header));
+            last_recv = now_ns();
+            rtts.push_back(last_recv - header[1]);
+            received++;
+            if (received + given_up > sent) given_up = sent - received;  // a late one
+        }
+        if (now_ns() - last_recv > 100 * 1000000llu) {  // nothing came back for a while,dont wait for the lost ones
+            given_up = sent - received;
+            last_recv = now_ns();
+        }
+    }
+    double elapsed = seconds;
+    sort(rtts.begin(), rtts.end());
+    double p50 = rtts.empty() ? 0 : rtts[rtts.size() / 2] / 1000.0;
+    double p99 = rtts.empty() ? 0 : rtts[min(rtts.size() - 1, rtts.size() * 99 / 100)] / 1000.0;
+    printf("{\"sent\":%llu,\"received\":%llu,\"pps\":%.0f,\"gbps\":%.4f,\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f}\n", sent, received,
+           received / elapsed, received * (double)size * 8 / elapsed / 1e9, p50, p99);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    sockaddr_in addr;
+    if (argc >= 4 && strcmp(argv[1], "echo") == 0 && make_addr(argv[2], argv[3], addr) == 0) return run_echo(addr);
+    if (argc >= 6 && strcmp(argv[1], "send") == 0 && make_addr(argv[2], argv[3], addr) == 0) {
+        int size = atoi(argv[4]);
+        int window = argc >= 7 ? atoi(argv[6]) : 64;
+        if (size < (int)(2 * sizeof(u64_t)) || size > 65000 || window < 1) {
+            fprintf(stderr, "size must be >=16 and <=65000,window >=1\n");
+            return 1;
+        }
+        return run_send(addr, size, atof(argv[5]), window);
+    }
+    fprintf(stderr, "usage:\n  %s echo <ip> <port>\n  %s send <ip> <port> <size> <seconds> [window]\n", argv[0], argv[0]);
+    return 1;
+}
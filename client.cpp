@@ -7,6 +7,10 @@
 #include "encrypt.h"
 #include "fd_manager.h"
 
+#ifdef UDP2RAW_LINUX
+#include <netinet/udp.h>
+#endif
+
 #ifdef UDP2RAW_MP
 u32_t detect_interval = 1500;
 u64_t laste_detect_time = 0;
@@ -19,6 +23,42 @@ extern pcap_t *pcap_handle;
 extern int pcap_captured_full_len;
 #endif
 
+static u32_t retry_base = 0;      // ms,backoff of the resends in the current handshake state
+static u32_t retry_interval = 0;  // ms,retry_base with jitter,so that clients cut off together dont come back together
+
+static char client_handshake_flags(conn_info_t &conn_info)  // what we ask for in handshake1,what the server agreed to in handshake2
+{
+    char resume = resume_offer ? handshake_flag_resume : 0;
+    if (conn_info.state.client_current_state == client_handshake2)
+        return (conn_info.frame_v2 ? handshake_flag_frame_v2 : 0) | (conn_info.adaptive_hb ? handshake_flag_adaptive_hb : 0) | resume;
+    return (frame_v2_offer ? handshake_flag_frame_v2 : 0) | (hb_mode == 2 ? handshake_flag_adaptive_hb : 0) | resume;
+}
+static int client_retry_due(conn_info_t &conn_info)  // a state sends right away when entered,then backs off
+{
+    return conn_info.last_hb_sent_time == 0 || get_current_time() - conn_info.last_hb_sent_time >= retry_interval;
+}
+static void client_retry_sent(conn_info_t &conn_info) {
+    if (conn_info.last_hb_sent_time == 0)
+        retry_base = client_retry_min;
+    else
+        retry_base = min(retry_base * 2, client_retry_interval);
+    retry_interval = retry_base * 3 / 4 + get_true_random_number() % (retry_base / 2 + 1);  // 0.75x to 1.25x
+    conn_info.last_hb_sent_time = get_current_time();
+}
+static u64_t client_retry_time(conn_info_t &conn_info)  // when client_on_timer() wants to run next for a resend,0 if the periodic timer is enough
+{
+    int state = conn_info.state.client_current_state;
+    if (state != client_tcp_handshake && state != client_handshake1 && state != client_handshake2) return 0;
+    if (conn_info.last_hb_sent_time == 0) return 0;
+    return conn_info.last_hb_sent_time + retry_interval;
+}
+static void client_send_handshake1(conn_info_t &conn_info)  // asks for a cookie,or shows the ticket together with the ids of the last session
+{
+    if (conn_info.resuming)
+        send_handshake(conn_info.raw_info, conn_info.my_id, conn_info.oppsite_id, const_id, client_handshake_flags(conn_info) | handshake_flag_resume, conn_info.resume_ticket);
+    else
+        send_handshake(conn_info.raw_info, conn_info.my_id, 0, const_id, client_handshake_flags(conn_info));
+}
 int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer is ready in epoll
 {
     packet_info_t &send_info = conn_info.raw_info.send_info;
@@ -107,6 +147,14 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
 
         conn_info.blob->anti_replay.re_init();
         conn_info.my_id = get_true_random_number_nz();  /// todo no need to do this everytime
+        conn_info.resuming = conn_info.resume_ticket != 0;  // try the ticket of the last session once
+        if (!conn_info.resuming) {  // a resumed session keeps what was agreed
+            conn_info.frame_v2 = 0;
+            conn_info.adaptive_hb = 0;
+        }
+        conn_info.blob->pmtu = pmtu_t();
+        pacing_clear(conn_info);
+        raw_info.ooo = tcp_ooo_t();
 
         address_t tmp_addr;
         // u32_t new_ip=0;
@@ -176,9 +224,9 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
         if (get_current_time() - conn_info.last_state_time > client_handshake_timeout) {
             conn_info.state.client_current_state = client_idle;
             mylog(log_info, "state back to client_idle from client_tcp_handshake\n");
-            return 0;
+            return client_on_timer(conn_info);  // start over right away
 
-        } else if (get_current_time() - conn_info.last_hb_sent_time > client_retry_interval) {
+        } else if (client_retry_due(conn_info)) {
             if (raw_mode == mode_faketcp) {
                 if (conn_info.last_hb_sent_time == 0) {
                     send_info.psh = 0;
@@ -192,7 +240,7 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
 
             send_raw0(raw_info, 0, 0);
 
-            conn_info.last_hb_sent_time = get_current_time();
+            client_retry_sent(conn_info);
             mylog(log_info, "(re)sent tcp syn\n");
             return 0;
         } else {
@@ -204,16 +252,24 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
         if (get_current_time() - conn_info.last_state_time > client_handshake_timeout) {
             conn_info.state.client_current_state = client_idle;
             mylog(log_info, "state back to client_idle from client_tcp_handshake_dummy\n");
-            return 0;
+            return client_on_timer(conn_info);
         }
     } else if (conn_info.state.client_current_state == client_handshake1)  // send and resend handshake1
     {
+        if (conn_info.resuming && get_current_time() - conn_info.last_state_time > client_resume_timeout) {
+            mylog(log_info, "no answer to session resumption,falling back to a full handshake\n");
+            conn_info.resuming = 0;
+            conn_info.resume_ticket = 0;
+            conn_info.frame_v2 = 0;
+            conn_info.adaptive_hb = 0;
+            retry_interval = 0;  // handshake1 goes out now
+        }
         if (get_current_time() - conn_info.last_state_time > client_handshake_timeout) {
             conn_info.state.client_current_state = client_idle;
             mylog(log_info, "state back to client_idle from client_handshake1\n");
-            return 0;
+            return client_on_timer(conn_info);
 
-        } else if (get_current_time() - conn_info.last_hb_sent_time > client_retry_interval) {
+        } else if (client_retry_due(conn_info)) {
             if (raw_mode == mode_faketcp) {
                 if (conn_info.last_hb_sent_time == 0) {
                     send_info.seq++;
@@ -229,17 +285,17 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
                 if (!use_tcp_dummy_socket)
                     send_raw0(raw_info, 0, 0);
 
-                send_handshake(raw_info, conn_info.my_id, 0, const_id);
+                client_send_handshake1(conn_info);
 
                 send_info.seq += raw_info.send_info.data_len;
             } else {
-                send_handshake(raw_info, conn_info.my_id, 0, const_id);
+                client_send_handshake1(conn_info);
                 if (raw_mode == mode_icmp)
                     send_info.my_icmp_seq++;
             }
 
-            conn_info.last_hb_sent_time = get_current_time();
-            mylog(log_info, "(re)sent handshake1\n");
+            client_retry_sent(conn_info);
+            mylog(log_info, "(re)sent handshake1%s\n", conn_info.resuming ? " with resumption ticket" : "");
             return 0;
         } else {
             return 0;
@@ -249,8 +305,8 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
         if (get_current_time() - conn_info.last_state_time > client_handshake_timeout) {
             conn_info.state.client_current_state = client_idle;
             mylog(log_info, "state back to client_idle from client_handshake2\n");
-            return 0;
-        } else if (get_current_time() - conn_info.last_hb_sent_time > client_retry_interval) {
+            return client_on_timer(conn_info);
+        } else if (client_retry_due(conn_info)) {
             if (raw_mode == mode_faketcp) {
                 if (conn_info.last_hb_sent_time == 0) {
                     send_info.ack_seq = recv_info.seq + raw_info.recv_info.data_len;
@@ -258,15 +314,15 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
                     raw_info.reserved_send_seq = send_info.seq;
                 }
                 send_info.seq = raw_info.reserved_send_seq;
-                send_handshake(raw_info, conn_info.my_id, conn_info.oppsite_id, const_id);
+                send_handshake(raw_info, conn_info.my_id, conn_info.oppsite_id, const_id, client_handshake_flags(conn_info));
                 send_info.seq += raw_info.send_info.data_len;
 
             } else {
-                send_handshake(raw_info, conn_info.my_id, conn_info.oppsite_id, const_id);
+                send_handshake(raw_info, conn_info.my_id, conn_info.oppsite_id, const_id, client_handshake_flags(conn_info));
                 if (raw_mode == mode_icmp)
                     send_info.my_icmp_seq++;
             }
-            conn_info.last_hb_sent_time = get_current_time();
+            client_retry_sent(conn_info);
             mylog(log_info, "(re)sent handshake2\n");
             return 0;
 
@@ -282,25 +338,25 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
             conn_info.state.client_current_state = client_idle;
             conn_info.my_id = get_true_random_number_nz();
             mylog(log_info, "state back to client_idle from  client_ready bc of server-->client direction timeout\n");
-            return 0;
+            return client_on_timer(conn_info);
         }
 
         if (get_current_time() - conn_info.last_oppsite_roller_time > client_conn_uplink_timeout) {
             conn_info.state.client_current_state = client_idle;
             conn_info.my_id = get_true_random_number_nz();
             mylog(log_info, "state back to client_idle from  client_ready bc of client-->server direction timeout\n");
+            return client_on_timer(conn_info);
         }
 
-        if (get_current_time() - conn_info.last_hb_sent_time < heartbeat_interval) {
+        pmtu_on_timer(conn_info);
+
+        if (get_current_time() < next_heartbeat_time(conn_info)) {
             return 0;
         }
 
         mylog(log_debug, "heartbeat sent <%x,%x>\n", conn_info.oppsite_id, conn_info.my_id);
 
-        if (hb_mode == 0)
-            send_safer(conn_info, 'h', hb_buf, 0);  /////////////send
-        else
-            send_safer(conn_info, 'h', hb_buf, hb_len);
+        send_heartbeat(conn_info);  /////////////send
         conn_info.last_hb_sent_time = get_current_time();
         return 0;
     } else {
@@ -309,6 +365,119 @@ int client_on_timer(conn_info_t &conn_info)  // for client. called when a timer
     }
     return 0;
 }
+#ifdef UDP2RAW_LINUX
+struct udp_send_batch_t  // replies to local apps queued within one raw_recv_cb,written with one sendmmsg
+{
+    static const int max_num = 32;
+    int active;
+    int cnt;
+    char bufs[max_num][buf_len];
+    int lens[max_num];
+    address_t addrs[max_num];
+    udp_send_batch_t() {
+        active = 0;
+        cnt = 0;
+    }
+} udp_send_batch;
+
+static void udp_send_batch_send() {
+    udp_send_batch_t &b = udp_send_batch;
+    struct mmsghdr msgs[udp_send_batch_t::max_num];
+    struct iovec iovs[udp_send_batch_t::max_num];
+    char ctrls[udp_send_batch_t::max_num][CMSG_SPACE(sizeof(uint16_t))];
+    int seg_nums[udp_send_batch_t::max_num];
+    int total_lens[udp_send_batch_t::max_num];
+    int msg_num = 0;
+    for (int i = 0; i < b.cnt;) {
+        int seg_num = 1;
+        int total_len = b.lens[i];
+        if (udp_offload) {  // same destination and same size can go out as one UDP_SEGMENT super packet,only the last one may be shorter
+            while (i + seg_num < b.cnt && seg_num < 64 && b.addrs[i + seg_num] == b.addrs[i] && b.lens[i + seg_num - 1] == b.lens[i] && b.lens[i + seg_num] <= b.lens[i] && total_len + b.lens[i + seg_num] <= 65000) {
+                total_len += b.lens[i + seg_num];
+                seg_num++;
+            }
+        }
+        struct msghdr &hdr = msgs[msg_num].msg_hdr;
+        memset(&msgs[msg_num], 0, sizeof(msgs[msg_num]));
+        for (int k = 0; k < seg_num; k++) {
+            iovs[i + k].iov_base = b.bufs[i + k];
+            iovs[i + k].iov_len = b.lens[i + k];
+        }
+        hdr.msg_name = &b.addrs[i].inner;
+        hdr.msg_namelen = b.addrs[i].get_len();
+        hdr.msg_iov = &iovs[i];
+        hdr.msg_iovlen = seg_num;
+        if (seg_num > 1) {
+            hdr.msg_control = ctrls[msg_num];
+            hdr.msg_controllen = sizeof(ctrls[msg_num]);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t seg_size = b.lens[i];
+            memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+        }
+        seg_nums[msg_num] = seg_num;
+        total_lens[msg_num] = total_len;
+        msg_num++;
+        i += seg_num;
+    }
+    int sent = 0;
+    u64_t lat = lat_begin(lat_udp_send);
+    while (sent < msg_num) {
+        int ret = sendmmsg(udp_fd, msgs + sent, msg_num - sent, 0);
+        if (ret <= 0) {
+            mylog(log_warn, "sendmmsg returned %d,%s,%d of %d sent\n", ret, get_sock_error(), sent, msg_num);
+            break;
+        }
+        sent += ret;
+    }
+    lat_record(lat_udp_send, lat);
+    for (int i = 0; i < msg_num; i++) {
+        if (i < sent) {
+            stat_add(stat_udp_pkts_out, seg_nums[i]);
+            stat_add(stat_udp_bytes_out, total_lens[i]);
+        } else {
+            stat_add(stat_udp_send_error, seg_nums[i]);
+        }
+    }
+    b.cnt = 0;
+}
+static void udp_send_batch_begin() {
+    assert(udp_send_batch.cnt == 0);
+    udp_send_batch.active = 1;
+}
+static void udp_send_batch_flush() {
+    if (udp_send_batch.cnt != 0) udp_send_batch_send();
+    udp_send_batch.active = 0;
+}
+#endif
+static void client_udp_send(address_t &addr, const char *data, int len)  // send to a local app,queued if a batch is open
+{
+#ifdef UDP2RAW_LINUX
+    if (udp_send_batch.active && len <= buf_len) {
+        udp_send_batch_t &b = udp_send_batch;
+        memcpy(b.bufs[b.cnt], data, len);
+        b.lens[b.cnt] = len;
+        b.addrs[b.cnt] = addr;
+        b.cnt++;
+        if (b.cnt == udp_send_batch_t::max_num) udp_send_batch_send();
+        return;
+    }
+#endif
+    u64_t lat = lat_begin(lat_udp_send);
+    int ret = sendto(udp_fd, data, len, 0, (struct sockaddr *)&addr.inner, addr.get_len());
+    lat_record(lat_udp_send, lat);
+
+    if (ret < 0) {
+        mylog(log_warn, "sento returned %d,%s,%02x,%s\n", ret, get_sock_error(), int(addr.get_type()), addr.get_str());
+        stat_add(stat_udp_send_error);
+        // perror("ret<0");
+    } else {
+        stat_add(stat_udp_pkts_out);
+        stat_add(stat_udp_bytes_out, len);
+    }
+}
 int client_on_raw_recv_hs2_or_ready(conn_info_t &conn_info, char type, char *data, int data_len) {
     packet_info_t &send_info = conn_info.raw_info.send_info;
     packet_info_t &recv_info = conn_info.raw_info.recv_info;
@@ -318,8 +487,19 @@ int client_on_raw_recv_hs2_or_ready(conn_info_t &conn_info, char type, char *dat
         return -1;
     }
 
+    int resumed = 0;
+    if (conn_info.state.client_current_state == client_handshake1) {  // only while resuming,the server answers with safer packets right away
+        mylog(log_info, "session resumed,changed state from client_handshake1 to client_ready\n");
+        stat_add(stat_handshake_resumed);
+        conn_info.resuming = 0;
+        conn_info.state.client_current_state = client_handshake2;  // and on to ready below
+        resumed = 1;
+    }
     if (conn_info.state.client_current_state == client_handshake2) {
-        mylog(log_info, "changed state from to client_handshake2 to client_ready\n");
+        if (!resumed) {
+            mylog(log_info, "changed state from to client_handshake2 to client_ready\n");
+            stat_add(stat_handshake_ok);
+        }
         conn_info.state.client_current_state = client_ready;
         conn_info.last_hb_sent_time = 0;
         conn_info.last_hb_recv_time = get_current_time();
@@ -329,11 +509,13 @@ int client_on_raw_recv_hs2_or_ready(conn_info_t &conn_info, char type, char *dat
     if (data_len >= 0 && type == 'h') {
         mylog(log_debug, "[hb]heart beat received,oppsite_roller=%d\n", int(conn_info.oppsite_roller));
         conn_info.last_hb_recv_time = get_current_time();
+        if (conn_info.state.client_current_state == client_ready) pmtu_on_hb(conn_info, data, data_len);
+        if (resume_offer && data_len >= 1 + int(sizeof(u64_t)) && data[0] == resume_ticket_tag) conn_info.resume_ticket = read_u64(data + 1);
         return 0;
     } else if (data_len >= int(sizeof(u32_t)) && type == 'd') {
         mylog(log_trace, "received a data from fake tcp,len:%d\n", data_len);
 
-        if (hb_mode == 0)
+        if (conn_hb_mode(conn_info) != 1)
             conn_info.last_hb_recv_time = get_current_time();
 
         u32_t tmp_conv_id;
@@ -342,13 +524,16 @@ int client_on_raw_recv_hs2_or_ready(conn_info_t &conn_info, char type, char *dat
 
         if (!conn_info.blob->conv_manager.c.is_conv_used(tmp_conv_id)) {
             mylog(log_info, "unknow conv %d,ignore\n", tmp_conv_id);
+            stat_add(stat_drop_unknown_conv);
             return 0;
         }
 
         conn_info.blob->conv_manager.c.update_active_time(tmp_conv_id);
 
         // u64_t u64=conn_info.blob->conv_manager.c.find_data_by_conv(tmp_conv_id);
-        address_t tmp_addr = conn_info.blob->conv_manager.c.find_data_by_conv(tmp_conv_id);
+        traffic_stats_t *traffic;
+        address_t tmp_addr = conn_info.blob->conv_manager.c.find_data_by_conv(tmp_conv_id, &traffic);
+        traffic->add_out(data_len - sizeof(u32_t));
 
         // sockaddr_in tmp_sockaddr={0};
 
@@ -357,12 +542,7 @@ int client_on_raw_recv_hs2_or_ready(conn_info_t &conn_info, char type, char *dat
 
         // tmp_sockaddr.sin_port= htons(uint16_t((u64<<32u)>>32u));
 
-        int ret = sendto(udp_fd, data + sizeof(u32_t), data_len - (sizeof(u32_t)), 0, (struct sockaddr *)&tmp_addr.inner, tmp_addr.get_len());
-
-        if (ret < 0) {
-            mylog(log_warn, "sento returned %d,%s,%02x,%s\n", ret, get_sock_error(), int(tmp_addr.get_type()), tmp_addr.get_str());
-            // perror("ret<0");
-        }
+        client_udp_send(tmp_addr, data + sizeof(u32_t), data_len - (sizeof(u32_t)));
     } else {
         mylog(log_warn, "unknown packet,this shouldnt happen.\n");
         return -1;
@@ -423,7 +603,7 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
             mylog(log_debug, "unexpected packet type,expected:syn ack\n");
             return -1;
         }
-    } else if (conn_info.state.client_current_state == client_handshake1)  // recevied respond of handshake1
+    } else if (conn_info.state.client_current_state == client_handshake1 && !conn_info.resuming)  // recevied respond of handshake1
     {
         if (recv_bare(raw_info, data, data_len) != 0) {
             mylog(log_debug, "recv_bare failed!\n");
@@ -435,6 +615,7 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
         }
         if (data_len < int(3 * sizeof(my_id_t))) {
             mylog(log_debug, "too short to be a handshake\n");
+            stat_add(stat_handshake_invalid);
             return -1;
         }
         my_id_t tmp_oppsite_id;
@@ -451,6 +632,7 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
 
         if (tmp_my_id != conn_info.my_id) {
             mylog(log_debug, "tmp_my_id doesnt match\n");
+            stat_add(stat_handshake_invalid);
             return -1;
         }
 
@@ -465,8 +647,11 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
             }
         }
         conn_info.oppsite_id = tmp_oppsite_id;
+        conn_info.frame_v2 = frame_v2_offer && (handshake_flags(data, data_len) & handshake_flag_frame_v2);  // an older server doesnt echo it
+        conn_info.adaptive_hb = hb_mode == 2 && (handshake_flags(data, data_len) & handshake_flag_adaptive_hb);
 
-        mylog(log_info, "changed state from to client_handshake1 to client_handshake2,my_id is %x,oppsite id is %x\n", conn_info.my_id, conn_info.oppsite_id);
+        mylog(log_info, "changed state from to client_handshake1 to client_handshake2,my_id is %x,oppsite id is %x%s%s\n", conn_info.my_id, conn_info.oppsite_id,
+              conn_info.frame_v2 ? ",frame v2" : "", conn_info.adaptive_hb ? ",adaptive heartbeat" : "");
 
         conn_info.state.client_current_state = client_handshake2;
         conn_info.last_state_time = get_current_time();
@@ -474,7 +659,8 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
         client_on_timer(conn_info);
 
         return 0;
-    } else if (conn_info.state.client_current_state == client_handshake2 || conn_info.state.client_current_state == client_ready)  // received heartbeat or data
+    } else if (conn_info.state.client_current_state == client_handshake1 || conn_info.state.client_current_state == client_handshake2 ||
+               conn_info.state.client_current_state == client_ready)  // received heartbeat or data,handshake1 is here only while resuming
     {
         vector<char> type_vec;
         vector<string> data_vec;
@@ -488,7 +674,9 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
             char type = type_vec[i];
             char *data = (char *)data_vec[i].c_str();  // be careful, do not append data to it
             int data_len = data_vec[i].length();
+            u64_t lat = lat_begin(lat_dispatch);
             client_on_raw_recv_hs2_or_ready(conn_info, type, data, data_len);
+            lat_record(lat_dispatch, lat);
         }
 
         return 0;
@@ -498,50 +686,165 @@ int client_on_raw_recv(conn_info_t &conn_info)  // called when raw fd received a
     }
     return 0;
 }
-int client_on_udp_recv(conn_info_t &conn_info) {
-    int recv_len;
-    char buf[buf_len];
-    address_t::storage_t udp_new_addr_in = {{0}};
-    socklen_t udp_new_addr_len = sizeof(address_t::storage_t);
-    if ((recv_len = recvfrom(udp_fd, buf, max_data_len + 1, 0,
-                             (struct sockaddr *)&udp_new_addr_in, &udp_new_addr_len)) == -1) {
-        mylog(log_debug, "recv_from error,%s\n", get_sock_error());
-        return -1;
-        // myexit(1);
-    };
-
+static int client_on_udp_packet(conn_info_t &conn_info, address_t &tmp_addr, char *buf, int recv_len)  // one datagram from a local app
+{
     if (recv_len == max_data_len + 1) {
         mylog(log_warn, "huge packet, data_len > %d,dropped\n", max_data_len);
+        stat_add(stat_drop_huge_packet);
         return -1;
     }
+    stat_add(stat_udp_pkts_in);
+    stat_add(stat_udp_bytes_in, recv_len);
 
     if (recv_len >= mtu_warn) {
         mylog(log_warn, "huge packet,data len=%d (>=%d).strongly suggested to set a smaller mtu at upper level,to get rid of this warn\n ", recv_len, mtu_warn);
     }
 
-    address_t tmp_addr;
-    tmp_addr.from_sockaddr((sockaddr *)&udp_new_addr_in, udp_new_addr_len);
     u32_t conv;
+    traffic_stats_t *traffic;
 
     if (!conn_info.blob->conv_manager.c.is_data_used(tmp_addr)) {
         if (conn_info.blob->conv_manager.c.get_size() >= max_conv_num) {
             mylog(log_warn, "ignored new udp connect bc max_conv_num exceed\n");
+            stat_add(stat_drop_max_conv);
             return -1;
         }
-        conv = conn_info.blob->conv_manager.c.get_new_conv();
+        conv = conn_info.frame_v2 ? conn_info.blob->conv_manager.c.get_new_small_conv() : conn_info.blob->conv_manager.c.get_new_conv();
         conn_info.blob->conv_manager.c.insert_conv(conv, tmp_addr);
         mylog(log_info, "new packet from %s,conv_id=%x\n", tmp_addr.get_str(), conv);
-    } else {
-        conv = conn_info.blob->conv_manager.c.find_conv_by_data(tmp_addr);
     }
+    conv = conn_info.blob->conv_manager.c.find_conv_by_data(tmp_addr, &traffic);
+    traffic->add_in(recv_len);
 
     conn_info.blob->conv_manager.c.update_active_time(conv);
 
-    if (conn_info.state.client_current_state == client_ready) {
+    if (conn_info.state.client_current_state == client_ready ||
+        (conn_info.state.client_current_state == client_handshake1 && conn_info.resuming && conn_info.last_hb_sent_time != 0)) {  // right behind the ticket
         send_data_safer(conn_info, buf, recv_len, conv);
     }
     return 0;
 }
+#ifdef UDP2RAW_LINUX
+int client_on_udp_recv(conn_info_t &conn_info)  // drain udp_fd with recvmmsg,the encrypted packets go out with one sendmmsg on raw_send_fd
+{
+    const int batch = 32;
+    static vector<char> bufs;
+    static struct mmsghdr msgs[batch];
+    static struct iovec iovs[batch];
+    static address_t::storage_t addrs[batch];
+    static char ctrls[batch][CMSG_SPACE(sizeof(int))];
+
+    int slot_len = udp_offload ? 65536 : max_data_len + 1;  // a GRO packet carries many datagrams
+    if ((int)bufs.size() != batch * slot_len) bufs.resize(batch * slot_len);
+
+    for (int i = 0; i < batch; i++) {
+        iovs[i].iov_base = &bufs[i * slot_len];
+        iovs[i].iov_len = slot_len;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        if (udp_offload) {
+            msgs[i].msg_hdr.msg_control = ctrls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+        }
+    }
+    u64_t lat = lat_begin(lat_udp_recv);
+    int n = recvmmsg(udp_fd, msgs, batch, MSG_DONTWAIT, 0);
+    lat_record(lat_udp_recv, lat);
+    if (n <= 0) {
+        mylog(log_debug, "recv_from error,%s\n", get_sock_error());
+        return -1;
+    }
+    mylog(log_trace, "received %d packets from udp_fd\n", n);
+
+    raw_send_batch_begin();
+    for (int i = 0; i < n; i++) {
+        char *buf = (char *)iovs[i].iov_base;
+        int len = msgs[i].msg_len;
+        int seg_size = len;
+        if (udp_offload) {
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != 0; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int tmp;
+                    memcpy(&tmp, CMSG_DATA(cm), sizeof(tmp));
+                    if (tmp > 0) seg_size = tmp;
+                }
+            }
+        }
+        if (seg_size > max_data_len) {
+            mylog(log_warn, "huge packet, data_len > %d,dropped\n", max_data_len);
+            stat_add(stat_drop_huge_packet);
+            continue;
+        }
+        address_t tmp_addr;
+        tmp_addr.from_sockaddr((sockaddr *)&addrs[i], msgs[i].msg_hdr.msg_namelen);
+        if (len == 0) {  // an empty datagram is forwarded too,the loop below would skip it
+            client_on_udp_packet(conn_info, tmp_addr, buf, 0);
+            continue;
+        }
+        for (int off = 0; off < len; off += seg_size) {
+            client_on_udp_packet(conn_info, tmp_addr, buf + off, min(seg_size, len - off));
+        }
+    }
+    raw_send_batch_flush();
+    return 0;
+}
+#else
+int client_on_udp_recv(conn_info_t &conn_info) {
+    int recv_len;
+    char buf[buf_len];
+    address_t::storage_t udp_new_addr_in = {{0}};
+    socklen_t udp_new_addr_len = sizeof(address_t::storage_t);
+    u64_t lat = lat_begin(lat_udp_recv);
+    recv_len = recvfrom(udp_fd, buf, max_data_len + 1, 0, (struct sockaddr *)&udp_new_addr_in, &udp_new_addr_len);
+    lat_record(lat_udp_recv, lat);
+    if (recv_len == -1) {
+        mylog(log_debug, "recv_from error,%s\n", get_sock_error());
+        return -1;
+        // myexit(1);
+    };
+
+    address_t tmp_addr;
+    tmp_addr.from_sockaddr((sockaddr *)&udp_new_addr_in, udp_new_addr_len);
+    return client_on_udp_packet(conn_info, tmp_addr, buf, recv_len);
+}
+#endif
+static struct ev_timer send_timer;  // --coalesce,--fec and --pacing-rate,fires when waiting datagrams,a fec group or paced packets are due
+static void send_timer_rearm(struct ev_loop *loop) {
+    u64_t deadline = send_next_deadline();
+    if (deadline == 0) return;
+    u64_t current_time = get_current_time_us();
+    double after = deadline > current_time ? (deadline - current_time) / 1000000.0 : 0;
+    if (ev_is_active(&send_timer)) {
+        if (ev_timer_remaining(loop, &send_timer) <= after) return;
+        ev_timer_stop(loop, &send_timer);  // something earlier came in
+    }
+    ev_timer_set(&send_timer, after, 0);
+    ev_timer_start(loop, &send_timer);
+}
+void send_timer_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+    update_current_time();  // timers always see fresh time
+    send_flush_due();
+}
+static struct ev_timer retry_timer;  // handshake resends,they back off from client_retry_min which is finer than timer_interval
+static void retry_timer_rearm(struct ev_loop *loop, conn_info_t &conn_info) {
+    u64_t deadline = client_retry_time(conn_info);
+    if (deadline == 0) return;
+    u64_t current_time = get_current_time();
+    double after = deadline > current_time ? (deadline - current_time) / 1000.0 : 0;
+    if (ev_is_active(&retry_timer)) {
+        if (ev_timer_remaining(loop, &retry_timer) <= after) return;
+        ev_timer_stop(loop, &retry_timer);
+    }
+    ev_timer_set(&retry_timer, after, 0);
+    ev_timer_start(loop, &retry_timer);
+}
+void send_prepare_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+    send_timer_rearm(loop);  // whatever the callbacks of this iteration queued
+    retry_timer_rearm(loop, *(conn_info_t *)watcher->data);
+}
 void udp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     conn_info_t &conn_info = *((conn_info_t *)watcher->data);
     client_on_udp_recv(conn_info);
@@ -549,71 +852,69 @@ void udp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 void raw_recv_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     if (is_udp2raw_mp) assert(0 == 1);
     conn_info_t &conn_info = *((conn_info_t *)watcher->data);
+#ifdef UDP2RAW_LINUX
+    udp_send_batch_begin();
     client_on_raw_recv(conn_info);
+    udp_send_batch_flush();
+#else
+    client_on_raw_recv(conn_info);
+#endif
 }
 #ifdef UDP2RAW_MP
 void async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
     conn_info_t &conn_info = *((conn_info_t *)watcher->data);
 
-    if (send_with_pcap && !pcap_header_captured) {
-        int empty = 0;
-        char *p;
-        int len;
-        pthread_mutex_lock(&queue_mutex);
-        empty = my_queue.empty();
-        if (!empty) {
-            my_queue.peek_front(p, len);
-            my_queue.pop_front();
-        }
-        pthread_mutex_unlock(&queue_mutex);
-        if (empty) return;
-
-        pcap_header_captured = 1;
-        assert(pcap_link_header_len != -1);
-        memcpy(pcap_header_buf, p, max_data_len);
-
-        log_bare(log_info, "link level header captured:\n");
-        unsigned char *tmp = (unsigned char *)pcap_header_buf;
-        pcap_captured_full_len = len;
-        for (int i = 0; i < pcap_link_header_len; i++)
-            log_bare(log_info, "<%x>", (u32_t)tmp[i]);
-
-        log_bare(log_info, "\n");
-        return;
-    }
-
     // mylog(log_info,"async_cb called\n");
-    while (1) {
-        int empty = 0;
+    for (;;) {  // drain the whole ring,the pcap thread only signals again after park()
         char *p;
         int len;
-        pthread_mutex_lock(&queue_mutex);
-        empty = my_queue.empty();
-        if (!empty) {
-            my_queue.peek_front(p, len);
-            my_queue.pop_front();
+        if (!pcap_ring.peek(p, len)) {
+            if (pcap_ring.park()) break;
+            continue;
+        }
+
+        if (send_with_pcap && !pcap_header_captured) {
+            pcap_header_captured = 1;
+            assert(pcap_link_header_len != -1);
+            memcpy(pcap_header_buf, p, min(len, max_data_len));
+
+            log_bare(log_info, "link level header captured:\n");
+            unsigned char *tmp = (unsigned char *)pcap_header_buf;
+            pcap_captured_full_len = len;
+            for (int i = 0; i < pcap_link_header_len; i++)
+                log_bare(log_info, "<%x>", (u32_t)tmp[i]);
+
+            log_bare(log_info, "\n");
+            pcap_ring.pop();
+            continue;
         }
-        pthread_mutex_unlock(&queue_mutex);
 
-        if (empty) break;
         if (g_fix_gro == 0 && len > max_data_len) {
             mylog(log_warn, "huge packet %d > %d, dropped. maybe you need to turn down mtu at upper level, or maybe you need the --fix-gro option\n", len, max_data_len);
-            break;
+            stat_add(stat_drop_huge_packet);
+            pcap_ring.pop();
+            continue;
         }
 
-        int new_len = len - pcap_link_header_len;
-        memcpy(g_packet_buf, p + pcap_link_header_len, new_len);
-        g_packet_buf_len = new_len;
+        g_packet_ptr = p + pcap_link_header_len;
+        g_packet_buf_len = len - pcap_link_header_len;
+        stat_add(stat_raw_pkts_in);
+        stat_add(stat_raw_bytes_in, g_packet_buf_len);
         assert(g_packet_buf_cnt == 0);
         g_packet_buf_cnt++;
         client_on_raw_recv(conn_info);
+        pcap_ring.pop();
     }
 }
 #endif
 void clear_timer_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
     conn_info_t &conn_info = *((conn_info_t *)watcher->data);
+    update_current_time();  // timers always see fresh time
     client_on_timer(conn_info);
 }
+void clock_check_cb(struct ev_loop *loop, struct ev_check *watcher, int revents) {
+    update_current_time();  // one clock read per iteration,other callbacks use the cached value
+}
 void fifo_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     conn_info_t &conn_info = *((conn_info_t *)watcher->data);
 
@@ -633,10 +934,37 @@ void fifo_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
         mylog(log_info, "received command: reconnect\n");
         conn_info.state.client_current_state = client_idle;
         conn_info.my_id = get_true_random_number_nz();
+        client_on_timer(conn_info);
+    } else if (strcmp(buf, "stats") == 0) {
+        stats_dump(0);
+    } else if (strcmp(buf, "stats conv") == 0) {
+        stats_dump(1);
+    } else if (strcmp(buf, "latency") == 0) {
+        latency_dump();
+    } else if (strcmp(buf, "latency reset") == 0) {
+        latency_reset();
     } else {
         mylog(log_info, "unknown command\n");
     }
 }
+static struct ev_io metrics_client_watcher;  // client of --metrics-sock
+static void metrics_client_watch(struct ev_loop *loop) {
+    int want_write;
+    int fd = stats_client_fd(&want_write);
+    if (fd < 0) return;
+    ev_io_set(&metrics_client_watcher, fd, want_write ? EV_WRITE : EV_READ);
+    ev_io_start(loop, &metrics_client_watcher);
+}
+void metrics_client_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    ev_io_stop(loop, watcher);  // stats_client_io() may close the fd
+    stats_client_io();
+    metrics_client_watch(loop);
+}
+void metrics_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    ev_io_stop(loop, &metrics_client_watcher);  // an unfinished client is dropped by stats_serve()
+    stats_serve(watcher->fd);
+    metrics_client_watch(loop);
+}
 int client_event_loop() {
     char buf[buf_len];
 
@@ -814,6 +1142,15 @@ int client_event_loop() {
         myexit(1);
     }
     setnonblocking(udp_fd);
+#ifdef UDP2RAW_LINUX
+    if (udp_offload) {
+        int one = 1;
+        if (setsockopt(udp_fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) != 0) {
+            mylog(log_warn, "UDP_GRO not supported by kernel,--udp-offload disabled,%s\n", get_sock_error());
+            udp_offload = 0;
+        }
+    }
+#endif
 
     // epollfd = epoll_create1(0);
 
@@ -835,6 +1172,18 @@ int client_event_loop() {
     //	myexit(-1);
     // }
 
+    struct ev_check clock_watcher;  // runs before other callbacks of an iteration
+
+    ev_check_init(&clock_watcher, clock_check_cb);
+    ev_set_priority(&clock_watcher, EV_MAXPRI);
+    ev_check_start(loop, &clock_watcher);
+
+    struct ev_prepare send_watcher;  // runs before the loop blocks
+
+    send_watcher.data = &conn_info;
+    ev_prepare_init(&send_watcher, send_prepare_cb);
+    ev_prepare_start(loop, &send_watcher);
+
     struct ev_io udp_accept_watcher;
 
     udp_accept_watcher.data = &conn_info;
@@ -873,6 +1222,9 @@ int client_event_loop() {
     clear_timer.data = &conn_info;
     ev_timer_init(&clear_timer, clear_timer_cb, 0, timer_interval / 1000.0);
     ev_timer_start(loop, &clear_timer);
+    ev_init(&send_timer, send_timer_cb);
+    retry_timer.data = &conn_info;
+    ev_init(&retry_timer, clear_timer_cb);
 
     mylog(log_debug, "send_raw : from %s %d  to %s %d\n", send_info.new_src_ip.get_str1(), send_info.src_port, send_info.new_dst_ip.get_str2(), send_info.dst_port);
 
@@ -890,6 +1242,14 @@ int client_event_loop() {
         mylog(log_info, "fifo_file=%s\n", fifo_file);
     }
 
+    struct ev_io metrics_watcher;
+    if (metrics_sock[0] != 0) {
+        ev_io_init(&metrics_watcher, metrics_cb, stats_listen(metrics_sock), EV_READ);
+        ev_io_start(loop, &metrics_watcher);
+        ev_init(&metrics_client_watcher, metrics_client_cb);
+    }
+    stats_client_conn = &conn_info;
+
     ev_run(loop, 0);
     return 0;
 }
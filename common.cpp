@@ -10,11 +10,16 @@
 #include "misc.h"
 
 #include <random>
+#if !defined(__MINGW32__)
+#include <sys/syscall.h>
+#endif
 #include <cmath>
 
 // static int random_number_fd=-1;
 int force_socket_buf = 0;
 
+int use_coarse_clock = 0;  // use CLOCK_MONOTONIC_COARSE for the cached clock
+
 int address_t::from_str(char *str) {
     clear();
 
@@ -404,28 +409,41 @@ int get_sock_errno() {
 }
 #endif
 
-u64_t get_current_time_us() {
-    static u64_t value_fix = 0;
-    static u64_t largest_value = 0;
-
-    u64_t raw_value = (u64_t)(ev_time() * 1000 * 1000);
+u64_t read_clock_us()  // always monotonic, so wall-clock jumps dont affect any timeout. reads no shared state,safe from any thread
+{
+    timespec tmp_time;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(use_coarse_clock ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &tmp_time);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &tmp_time);
+#endif
+    return ((u64_t)tmp_time.tv_sec) * 1000000llu + ((u64_t)tmp_time.tv_nsec) / 1000llu;
+}
 
-    u64_t fixed_value = raw_value + value_fix;
+static u64_t cached_time_us = 0;
 
-    if (fixed_value < largest_value) {
-        value_fix += largest_value - fixed_value;
-    } else {
-        largest_value = fixed_value;
-    }
+u64_t update_current_time()  // called once per event loop iteration and by timers, everything else reads the cached value
+{
+    u64_t value = read_clock_us() + 1;  // +1 so that 0 always means not inited
+    if (value > cached_time_us)         // never go back
+        cached_time_us = value;
+    return cached_time_us;
+}
 
-    // printf("<%lld,%lld,%lld>\n",raw_value,value_fix,raw_value + value_fix);
-    return raw_value + value_fix;  // new fixed value
+u64_t get_current_time_us() {
+    if (cached_time_us == 0) return update_current_time();
+    return cached_time_us;
 }
 
 u64_t get_current_time() {
     return get_current_time_us() / 1000;
 }
 
+u64_t get_current_time_fresh()  // bypass the cache,for measuring time inside an iteration
+{
+    return update_current_time() / 1000;
+}
+
 u64_t pack_u64(u32_t a, u32_t b) {
     u64_t ret = a;
     ret <<= 32u;
@@ -462,18 +480,143 @@ void init_random_number_fd()
 struct random_fd_t {
     int random_number_fd;
     random_fd_t() {
-        random_number_fd = open("/dev/urandom", O_RDONLY);
-
-        if (random_number_fd == -1) {
-            mylog(log_fatal, "error open /dev/urandom\n");
-            myexit(-1);
-        }
-        setnonblocking(random_number_fd);
+        random_number_fd = -1;
     }
     int get_fd() {
+        if (random_number_fd == -1) {  // opened on first use, only needed when getrandom() is unavailable
+            random_number_fd = open("/dev/urandom", O_RDONLY);
+
+            if (random_number_fd == -1) {
+                mylog(log_fatal, "error open /dev/urandom\n");
+                myexit(-1);
+            }
+        }
         return random_number_fd;
     }
 } random_fd;
+
+static void get_os_random_bytes(void *buf, int len)  // blocking read from kernel, only used for seeding
+{
+    char *p = (char *)buf;
+    while (len > 0) {
+        int ret;
+#if defined(SYS_getrandom)
+        ret = syscall(SYS_getrandom, p, len, 0);
+        if (ret < 0 && errno == ENOSYS)
+#endif
+            ret = read(random_fd.get_fd(), p, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            mylog(log_fatal, "get random number failed %d\n", ret);
+            myexit(-1);
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+// userspace chacha20 keystream generator, seeded from the kernel.
+// keystream is generated chacha_batch_blocks at a time, the first 32 bytes of each batch
+// become the next key (fast key erasure), so previous outputs cant be recovered from current state.
+// fresh kernel entropy is mixed into the key every chacha_reseed_bytes or chacha_reseed_interval.
+struct chacha_random_t {
+    static const int chacha_batch_blocks = 8;
+    static const int key_len = 32;
+    static const int stream_len = chacha_batch_blocks * 64;
+    static const u64_t chacha_reseed_bytes = 1024 * 1024;
+    static const u64_t chacha_reseed_interval = 60 * 1000;  // ms
+
+    u32_t key[8];
+    u64_t counter;
+    unsigned char buf[stream_len];
+    int pos;
+    u64_t bytes_since_reseed;
+    u64_t last_reseed_time;
+    int inited;
+
+    static u32_t rotl(u32_t v, int n) {
+        return (v << n) | (v >> (32 - n));
+    }
+    static u32_t load32(const unsigned char *p) {
+        return (u32_t)p[0] | ((u32_t)p[1] << 8) | ((u32_t)p[2] << 16) | ((u32_t)p[3] << 24);
+    }
+    static void store32(unsigned char *p, u32_t v) {
+        p[0] = (unsigned char)v;
+        p[1] = (unsigned char)(v >> 8);
+        p[2] = (unsigned char)(v >> 16);
+        p[3] = (unsigned char)(v >> 24);
+    }
+    static u64_t now_ms() {
+        timespec tmp_time;
+        clock_gettime(CLOCK_MONOTONIC, &tmp_time);
+        return ((u64_t)tmp_time.tv_sec) * 1000llu + ((u64_t)tmp_time.tv_nsec) / 1000000llu;
+    }
+    void block(u64_t ctr, unsigned char *out) {
+        u32_t x[16], in[16];
+        in[0] = 0x61707865;  // "expand 32-byte k"
+        in[1] = 0x3320646e;
+        in[2] = 0x79622d32;
+        in[3] = 0x6b206574;
+        for (int i = 0; i < 8; i++) in[4 + i] = key[i];
+        in[12] = (u32_t)ctr;
+        in[13] = (u32_t)(ctr >> 32);
+        in[14] = 0;
+        in[15] = 0;
+        memcpy(x, in, sizeof(x));
+#define CHACHA_QR(a, b, c, d)              \
+    x[a] += x[b], x[d] = rotl(x[d] ^ x[a], 16); \
+    x[c] += x[d], x[b] = rotl(x[b] ^ x[c], 12); \
+    x[a] += x[b], x[d] = rotl(x[d] ^ x[a], 8);  \
+    x[c] += x[d], x[b] = rotl(x[b] ^ x[c], 7);
+        for (int i = 0; i < 10; i++) {
+            CHACHA_QR(0, 4, 8, 12)
+            CHACHA_QR(1, 5, 9, 13)
+            CHACHA_QR(2, 6, 10, 14)
+            CHACHA_QR(3, 7, 11, 15)
+            CHACHA_QR(0, 5, 10, 15)
+            CHACHA_QR(1, 6, 11, 12)
+            CHACHA_QR(2, 7, 8, 13)
+            CHACHA_QR(3, 4, 9, 14)
+        }
+#undef CHACHA_QR
+        for (int i = 0; i < 16; i++) store32(out + 4 * i, x[i] + in[i]);
+    }
+    void reseed() {
+        unsigned char seed[key_len];
+        get_os_random_bytes(seed, key_len);
+        for (int i = 0; i < 8; i++) key[i] ^= load32(seed + 4 * i);
+        memset(seed, 0, sizeof(seed));
+        bytes_since_reseed = 0;
+        last_reseed_time = now_ms();
+    }
+    void refill() {
+        if (!inited) {
+            memset(key, 0, sizeof(key));
+            counter = 0;
+            inited = 1;
+            reseed();
+        } else if (bytes_since_reseed >= chacha_reseed_bytes || now_ms() - last_reseed_time >= chacha_reseed_interval) {
+            reseed();
+        }
+        for (int i = 0; i < chacha_batch_blocks; i++) {
+            block(counter++, buf + 64 * i);
+        }
+        for (int i = 0; i < 8; i++) key[i] = load32(buf + 4 * i);
+        memset(buf, 0, key_len);
+        pos = key_len;
+        bytes_since_reseed += stream_len;
+    }
+    void get_bytes(void *out, int len) {
+        if (pos + len > stream_len) refill();
+        memcpy(out, buf + pos, len);
+        memset(buf + pos, 0, len);  // dont keep handed out bytes around
+        pos += len;
+    }
+    chacha_random_t() {
+        inited = 0;
+        pos = stream_len;  // first call triggers seeding
+    }
+} chacha_random;
 #else
 struct my_random_t {
     std::random_device rd;
@@ -523,11 +666,7 @@ struct my_random_t {
 u64_t get_true_random_number_64() {
 #if !defined(__MINGW32__)
     u64_t ret;
-    int size = read(random_fd.get_fd(), &ret, sizeof(ret));
-    if (size != sizeof(ret)) {
-        mylog(log_fatal, "get random number failed %d\n", size);
-        myexit(-1);
-    }
+    chacha_random.get_bytes(&ret, sizeof(ret));
     return ret;
 #else
     return my_random.gen64();  // fake random number
@@ -536,11 +675,7 @@ u64_t get_true_random_number_64() {
 u32_t get_true_random_number() {
 #if !defined(__MINGW32__)
     u32_t ret;
-    int size = read(random_fd.get_fd(), &ret, sizeof(ret));
-    if (size != sizeof(ret)) {
-        mylog(log_fatal, "get random number failed %d\n", size);
-        myexit(-1);
-    }
+    chacha_random.get_bytes(&ret, sizeof(ret));
     return ret;
 #else
     return my_random.gen32();  // fake random number
@@ -600,11 +735,11 @@ u32_t read_u32(char *p) {
 }
 
 void write_u64(char *s, u64_t a) {
-    assert(0 == 1);
+    write_u32(s, u32_t(a >> 32u));
+    write_u32(s + 4, u32_t(a));
 }
 u64_t read_u64(char *s) {
-    assert(0 == 1);
-    return 0;
+    return (u64_t(read_u32(s)) << 32u) | read_u32(s + 4);
 }
 
 void setnonblocking(int sock) {
@@ -847,6 +982,7 @@ void myexit(int a) {
     }
     clear_iptables_rule();
 #endif
+    log_flush();
     exit(a);
 }
 
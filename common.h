@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <pthread.h>
+#include <atomic>
 
 #ifndef USE_LIBNET
 #define NO_LIBNET
@@ -83,9 +84,11 @@ typedef int socklen_t;
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <list>
+#include <new>
 using namespace std;
 
 #if defined(__BYTE_ORDER) && __BYTE_ORDER == __BIG_ENDIAN ||             \
@@ -160,6 +163,7 @@ typedef u64_t my_time_t;
 const int max_addr_len = 100;
 
 extern int force_socket_buf;
+extern int use_coarse_clock;
 
 extern int g_fix_gro;
 
@@ -287,6 +291,20 @@ struct address_t  // TODO scope id
     char *get_ip();
 };
 
+struct addr_str_t  // "ip:port" of an address,formatted on first c_str(). pass c_str() to mylog so disabled levels never format it
+{
+    address_t addr;
+    char buf[max_addr_len];
+    addr_str_t(const address_t &addr0) {
+        addr = addr0;
+        buf[0] = 0;
+    }
+    char *c_str() {
+        if (buf[0] == 0) addr.to_str(buf);
+        return buf;
+    }
+};
+
 namespace std {
 template <>
 struct hash<address_t> {
@@ -331,52 +349,152 @@ const int buf_len = max_data_len + 400;
 
 // const int max_address_len=512;
 
-#ifdef UDP2RAW_MP
-const int queue_len = 200;
-
-struct queue_t {
-    char data[queue_len][huge_buf_len];
-    int data_len[queue_len];
-
-    int head = 0;
-    int tail = 0;
-    void clear() {
-        head = tail = 0;
+struct spsc_ring_t : not_copy_able_t  // lock-free ring between one producer thread and one consumer thread,records have variable length
+{
+    static const u32_t hdr_len = 8;         // u32_t len,padded so data stays 8-byte aligned
+    static const u32_t wrap_mark = u32_t(-1);  // rest of the ring is unused,continue from offset 0
+
+    char *buf;
+    u32_t cap;                  // power of 2,positions below are free-running and taken modulo cap
+    std::atomic<u32_t> head;    // written by consumer only
+    std::atomic<u32_t> tail;    // written by producer only
+    std::atomic<int> parked;    // consumer saw the ring empty and needs a wake up for the next push
+    u32_t dropped;              // producer only
+
+    spsc_ring_t() {
+        buf = 0;
+        cap = 0;
+        head = 0;
+        tail = 0;
+        parked = 1;
+        dropped = 0;
     }
-    int empty() {
-        if (head == tail)
-            return 1;
-        else
-            return 0;
+    static u32_t record_len(u32_t len) {
+        return (hdr_len + len + 7) & ~u32_t(7);
     }
-    int full() {
-        if ((tail + 1) % queue_len == head)
+    void init(int max_len, int min_num)  // room for at least min_num records of max_len
+    {
+        u32_t need = record_len(max_len) * min_num;
+        cap = 4096;
+        while (cap < need) cap <<= 1;
+        buf = new char[cap];
+    }
+    int push(const char *p, int len)  // producer,returns 1 if the consumer should be woken up,-1 if full
+    {
+        u32_t t = tail.load(std::memory_order_relaxed);
+        u32_t h = head.load(std::memory_order_acquire);
+        u32_t pos = t & (cap - 1);
+        u32_t need = record_len(len);
+        u32_t skip = (cap - pos < need) ? cap - pos : 0;  // a record never wraps around the end
+        if (cap - (t - h) < skip + need) {
+            dropped++;
+            return -1;
+        }
+        if (skip) {
+            u32_t mark = wrap_mark;
+            memcpy(buf + pos, &mark, sizeof(mark));
+            pos = 0;
+        }
+        u32_t len32 = len;
+        memcpy(buf + pos, &len32, sizeof(len32));
+        memcpy(buf + pos + hdr_len, p, len);
+        tail.store(t + skip + need);  // seq_cst,pairs with the parked check of consumer
+        return parked.exchange(0) ? 1 : 0;
+    }
+    int peek(char *&p, int &len)  // consumer,returns 0 if empty
+    {
+        u32_t h = head.load(std::memory_order_relaxed);
+        for (;;) {
+            if (h == tail.load()) return 0;
+            u32_t pos = h & (cap - 1);
+            u32_t len32;
+            memcpy(&len32, buf + pos, sizeof(len32));
+            if (len32 == wrap_mark) {
+                h += cap - pos;
+                head.store(h, std::memory_order_release);
+                continue;
+            }
+            p = buf + pos + hdr_len;
+            len = len32;
             return 1;
-        else
-            return 0;
-    }
-    void peek_front(char *&p, int &len) {
-        assert(!empty());
-        p = data[head];
-        len = data_len[head];
-    }
-    void pop_front() {
-        assert(!empty());
-        head++;
-        head %= queue_len;
-    }
-    void push_back(char *p, int len) {
-        assert(!full());
-        memcpy(data[tail], p, len);
-        data_len[tail] = len;
-        tail++;
-        tail %= queue_len;
+        }
+    }
+    void pop()  // consumer,releases the record returned by peek()
+    {
+        u32_t h = head.load(std::memory_order_relaxed);
+        u32_t len32;
+        memcpy(&len32, buf + (h & (cap - 1)), sizeof(len32));
+        head.store(h + record_len(len32), std::memory_order_release);
+    }
+    int park()  // consumer,call when drained. returns 0 if something arrived meanwhile and draining should go on
+    {
+        parked.store(1);
+        if (head.load(std::memory_order_relaxed) == tail.load()) return 1;
+        parked.store(0);
+        return 0;
+    }
+};
+
+struct slab_pool_t : not_copy_able_t  // fixed size objects carved from chunks,freed ones are kept in a free list for reuse.
+// chunks are never given back,so the footprint follows the peak number of objects and the heap is not fragmented by churn
+{
+    struct free_node_t {
+        free_node_t *next;
+    };
+    u32_t obj_size;
+    u32_t objs_per_chunk;
+    vector<char *> chunks;
+    free_node_t *free_list;
+    u32_t used_num;
+
+    slab_pool_t(u32_t size, u32_t per_chunk) {
+        obj_size = (max(size, (u32_t)sizeof(free_node_t)) + 15) & ~15u;  // keep the alignment of new
+        objs_per_chunk = per_chunk;
+        free_list = 0;
+        used_num = 0;
+    }
+    ~slab_pool_t() {
+        for (int i = 0; i < (int)chunks.size(); i++) free(chunks[i]);
+    }
+    void *alloc() {
+        if (free_list == 0) {
+            char *chunk = (char *)malloc((size_t)obj_size * objs_per_chunk);
+            if (chunk == 0) throw std::bad_alloc();
+            chunks.push_back(chunk);
+            for (int i = objs_per_chunk - 1; i >= 0; i--) {  // so that the lowest address is handed out first
+                free_node_t *node = (free_node_t *)(chunk + (size_t)i * obj_size);
+                node->next = free_list;
+                free_list = node;
+            }
+        }
+        free_node_t *node = free_list;
+        free_list = node->next;
+        used_num++;
+        return node;
+    }
+    void release(void *p) {
+        if (p == 0) return;
+        free_node_t *node = (free_node_t *)p;
+        node->next = free_list;
+        free_list = node;
+        used_num--;
+    }
+    u32_t capacity() {
+        return chunks.size() * objs_per_chunk;
+    }
+    u64_t bytes() {
+        return (u64_t)capacity() * obj_size;
     }
 };
 
+#ifdef UDP2RAW_MP
 int init_ws();
 #endif
 u64_t get_current_time();
+u64_t get_current_time_us();
+u64_t get_current_time_fresh();
+u64_t update_current_time();
+u64_t read_clock_us();  // uncached,for threads other than the event loop
 u64_t pack_u64(u32_t a, u32_t b);
 
 u32_t get_u64_h(u64_t a);
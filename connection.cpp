@@ -10,9 +10,25 @@
 #include "fd_manager.h"
 
 int disable_anti_replay = 0;  // if anti_replay windows is diabled
+u32_t anti_replay_window_size = 4000;  // --anti-replay-window,in packets,rounded up to a power of 2
+int coalesce_us = 0;
+int coalesce_size = 1200;
+int frame_v2_offer = 0;
+int resume_offer = 1;
+int pmtu_probe_interval = 600;
+double pacing_rate = 0;
+int pacing_burst = 6000;
+
+static timer_heap_t coalesce_heap;  // coalesce_timer of every connection with something in blob->coalesce
+static timer_heap_t fec_heap;       // fec_timer,a fec group that is not full
+static timer_heap_t pacing_heap;    // pacing_timer,raw packets in blob->pacer
+static int last_raw_len;                        // of the last send_safer(),after encryption
 
 const int disable_conn_clear = 0;  // a raw connection is called conn.
 
+slab_pool_t conn_info_pool(sizeof(conn_info_t), 64);  // defined before conn_manager,so they outlive it
+slab_pool_t blob_pool(sizeof(blob_t), 16);
+
 conn_manager_t conn_manager;
 
 anti_replay_seq_t anti_replay_t::get_new_seq_for_send() {
@@ -20,39 +36,48 @@ anti_replay_seq_t anti_replay_t::get_new_seq_for_send() {
 }
 anti_replay_t::anti_replay_t() {
     max_packet_received = 0;
+    word_num = 2;
+    while (word_num * 64 < anti_replay_window_size) word_num *= 2;
+    window = new u64_t[word_num]();
     anti_replay_seq = get_true_random_number_64() / 10;  // random first seq
-    // memset(window,0,sizeof(window)); //not necessary
+}
+anti_replay_t::~anti_replay_t() {
+    delete[] window;
 }
 void anti_replay_t::re_init() {
     max_packet_received = 0;
-    // memset(window,0,sizeof(window));
+    // memset(window,0,sizeof(window));  //not necessary,the first seq jumps over the whole window
 }
 
 int anti_replay_t::is_vaild(u64_t seq) {
     if (disable_anti_replay) return 1;
     // if(disabled) return 0;
 
+    const u64_t mask = word_num - 1;
+    const u64_t bit = 1llu << (seq & 63);
     if (seq == max_packet_received)
         return 0;
     else if (seq > max_packet_received) {
-        if (seq - max_packet_received >= anti_replay_window_size) {
-            memset(window, 0, sizeof(window));
-            window[seq % anti_replay_window_size] = 1;
+        u64_t cur_word = max_packet_received >> 6;
+        u64_t diff = (seq >> 6) - cur_word;
+        if (diff >= word_num) {
+            memset(window, 0, word_num * sizeof(u64_t));
         } else {
-            for (u64_t i = max_packet_received + 1; i < seq; i++)
-                window[i % anti_replay_window_size] = 0;
-            window[seq % anti_replay_window_size] = 1;
+            for (u64_t i = 1; i <= diff; i++)
+                window[(cur_word + i) & mask] = 0;
         }
+        window[(seq >> 6) & mask] |= bit;
         max_packet_received = seq;
         return 1;
     } else if (seq < max_packet_received) {
-        if (max_packet_received - seq >= anti_replay_window_size)
+        if (max_packet_received - seq >= mask * 64)
             return 0;
         else {
-            if (window[seq % anti_replay_window_size] == 1)
+            u64_t &word = window[(seq >> 6) & mask];
+            if (word & bit)
                 return 0;
             else {
-                window[seq % anti_replay_window_size] = 1;
+                word |= bit;
                 return 1;
             }
         }
@@ -60,6 +85,16 @@ int anti_replay_t::is_vaild(u64_t seq) {
 
     return 0;  // for complier check
 }
+u64_t anti_replay_t::expand_seq(u32_t low) {
+    if (max_packet_received == 0) return low;
+    const u64_t span = 1llu << 32;
+    u64_t seq = (max_packet_received & ~(span - 1)) | low;
+    if (seq > max_packet_received && seq - max_packet_received > span / 2 && seq >= span)
+        seq -= span;
+    else if (seq < max_packet_received && max_packet_received - seq > span / 2)
+        seq += span;
+    return seq;
+}
 
 void conn_info_t::recover(const conn_info_t &conn_info) {
     raw_info = conn_info.raw_info;
@@ -72,7 +107,13 @@ void conn_info_t::recover(const conn_info_t &conn_info) {
     last_hb_sent_time = conn_info.last_hb_sent_time;
     my_id = conn_info.my_id;
     oppsite_id = conn_info.oppsite_id;
+    frame_v2 = conn_info.frame_v2;
+    adaptive_hb = conn_info.adaptive_hb;
+    last_data_sent_time = conn_info.last_data_sent_time;
+    resume_ticket = conn_info.resume_ticket;
     blob->anti_replay.re_init();
+    blob->pmtu = pmtu_t();  // maybe a new path
+    pacing_clear(*this);
 
     my_roller = 0;       // no need to set,but for easier debug,set it to zero
     oppsite_roller = 0;  // same as above
@@ -87,8 +128,15 @@ void conn_info_t::re_init() {
         state.client_current_state = client_idle;
     last_state_time = 0;
     oppsite_const_id = 0;
+    frame_v2 = 0;
+    adaptive_hb = 0;
+    last_data_sent_time = 0;
+    resume_ticket = 0;
+    resuming = 0;
 
-    timer_fd64 = 0;
+    timer_wheel.del(&hb_timer);
+    timer_wheel.del(&conv_timer);
+    timer_wheel.del(&expire_timer);
 
     my_roller = 0;
     oppsite_roller = 0;
@@ -96,6 +144,7 @@ void conn_info_t::re_init() {
 }
 conn_info_t::conn_info_t() {
     blob = 0;
+    coalesce_timer.data = fec_timer.data = pacing_timer.data = this;
     re_init();
 }
 void conn_info_t::prepare() {
@@ -108,6 +157,21 @@ void conn_info_t::prepare() {
     }
 }
 
+void *conn_info_t::operator new(size_t size) {
+    assert(size == sizeof(conn_info_t));
+    return conn_info_pool.alloc();
+}
+void conn_info_t::operator delete(void *p) {
+    conn_info_pool.release(p);
+}
+void *blob_t::operator new(size_t size) {
+    assert(size == sizeof(blob_t));
+    return blob_pool.alloc();
+}
+void blob_t::operator delete(void *p) {
+    blob_pool.release(p);
+}
+
 conn_info_t::conn_info_t(const conn_info_t &b) {
     assert(0 == 1);
     // mylog(log_error,"called!!!!!!!!!!!!!\n");
@@ -129,9 +193,12 @@ conn_info_t::~conn_info_t() {
             assert(oppsite_const_id == 0);
         }
     }
-    assert(timer_fd64 == 0);
+    assert(!hb_timer.is_pending() && !conv_timer.is_pending() && !expire_timer.is_pending());
     // if(oppsite_const_id!=0)     //do this at conn_manager 's deconstuction function
     // conn_manager.const_id_mp.erase(oppsite_const_id);
+    coalesce_heap.del(&coalesce_timer);
+    fec_heap.del(&fec_timer);
+    pacing_heap.del(&pacing_timer);
     if (blob != 0)
         delete blob;
 
@@ -145,7 +212,6 @@ conn_manager_t::conn_manager_t() {
     // timer_fd_mp.reserve(10007);
     const_id_mp.reserve(10007);
     // udp_fd_mp.reserve(100007);
-    last_clear_time = 0;
     // current_ready_ip=0;
     // current_ready_port=0;
 }
@@ -169,6 +235,40 @@ int insert(uint32_t ip,uint16_t port)
         mp[u64];
         return 0;
 }*/
+static void conn_expire_timer_cb(wheel_timer_t *timer)  // fires at the deadline of a conn,re-check since deadline may have moved later
+{
+    conn_info_t &conn_info = *(conn_info_t *)timer->data;
+    u64_t current_time = get_current_time();
+    u64_t expire_time = conn_manager.get_expire_time(conn_info);
+
+    if (disable_conn_clear) return;
+
+    if (expire_time > current_time) {
+        timer_wheel.add(timer, expire_time);
+    } else if (conn_info.blob != 0 && conn_info.blob->conv_manager.s.get_size() > 0) {  // wait for convs to be cleared gradually
+        assert(conn_info.state.server_current_state == server_ready);
+        timer_wheel.add(timer, conn_info.blob->conv_manager.s.next_clear_time());
+    } else {
+        unordered_map<address_t, conn_info_t *>::iterator it = conn_manager.mp.find(conn_info.addr);
+        assert(it != conn_manager.mp.end() && it->second == &conn_info);
+        mylog(log_info, "[%s]inactive conn cleared \n", conn_info.addr.get_str());
+        conn_manager.erase(it);
+    }
+}
+static conn_info_t *new_conn(address_t addr) {
+    conn_info_t *p = new conn_info_t;
+    p->addr = addr;
+    p->expire_timer.cb = conn_expire_timer_cb;
+    p->expire_timer.data = p;
+    timer_wheel.add(&p->expire_timer, get_current_time() + server_handshake_timeout);  // caller sets last_state_time to now
+    return p;
+}
+u64_t conn_manager_t::get_expire_time(conn_info_t &conn_info) {
+    if (conn_info.state.server_current_state == server_ready)
+        return conn_info.last_hb_recv_time + server_conn_timeout;
+    else
+        return conn_info.last_state_time + server_handshake_timeout;
+}
 conn_info_t *&conn_manager_t::find_insert_p(address_t addr)  // be aware,the adress may change after rehash
 {
     // u64_t u64=0;
@@ -177,7 +277,7 @@ conn_info_t *&conn_manager_t::find_insert_p(address_t addr)  // be aware,the adr
     // u64|=port;
     unordered_map<address_t, conn_info_t *>::iterator it = mp.find(addr);
     if (it == mp.end()) {
-        mp[addr] = new conn_info_t;
+        mp[addr] = new_conn(addr);
         // lru.new_key(addr);
     } else {
         // lru.update(addr);
@@ -192,7 +292,7 @@ conn_info_t &conn_manager_t::find_insert(address_t addr)  // be aware,the adress
     // u64|=port;
     unordered_map<address_t, conn_info_t *>::iterator it = mp.find(addr);
     if (it == mp.end()) {
-        mp[addr] = new conn_info_t;
+        mp[addr] = new_conn(addr);
         // lru.new_key(addr);
     } else {
         // lru.update(addr);
@@ -205,9 +305,7 @@ int conn_manager_t::erase(unordered_map<address_t, conn_info_t *>::iterator eras
         assert(i32_t(ready_num) != -1);
         assert(erase_it->second != 0);
 
-        assert(erase_it->second->timer_fd64 != 0);
-
-        assert(fd_manager.exist(erase_it->second->timer_fd64));
+        assert(erase_it->second->hb_timer.is_pending());
 
         assert(erase_it->second->oppsite_const_id != 0);
         assert(const_id_mp.find(erase_it->second->oppsite_const_id) != const_id_mp.end());
@@ -216,75 +314,24 @@ int conn_manager_t::erase(unordered_map<address_t, conn_info_t *>::iterator eras
 
         const_id_mp.erase(erase_it->second->oppsite_const_id);
 
-        fd_manager.fd64_close(erase_it->second->timer_fd64);
-
-        erase_it->second->timer_fd64 = 0;
+        timer_wheel.del(&erase_it->second->hb_timer);
+        timer_wheel.del(&erase_it->second->conv_timer);
+        timer_wheel.del(&erase_it->second->expire_timer);
         // timer_fd_mp.erase(erase_it->second->timer_fd);
         // close(erase_it->second->timer_fd);// close will auto delte it from epoll
         delete (erase_it->second);
         mp.erase(erase_it->first);
     } else {
         assert(erase_it->second->blob == 0);
-        assert(erase_it->second->timer_fd64 == 0);
+        assert(!erase_it->second->hb_timer.is_pending());
 
         assert(erase_it->second->oppsite_const_id == 0);
+        timer_wheel.del(&erase_it->second->expire_timer);
         delete (erase_it->second);
         mp.erase(erase_it->first);
     }
     return 0;
 }
-int conn_manager_t::clear_inactive() {
-    if (get_current_time() - last_clear_time > conn_clear_interval) {
-        last_clear_time = get_current_time();
-        return clear_inactive0();
-    }
-    return 0;
-}
-int conn_manager_t::clear_inactive0() {
-    unordered_map<address_t, conn_info_t *>::iterator it;
-    unordered_map<address_t, conn_info_t *>::iterator old_it;
-
-    if (disable_conn_clear) return 0;
-
-    // map<uint32_t,uint64_t>::iterator it;
-    int cnt = 0;
-    it = clear_it;
-    int size = mp.size();
-    int num_to_clean = size / conn_clear_ratio + conn_clear_min;  // clear 1/10 each time,to avoid latency glitch
-
-    mylog(log_trace, "mp.size() %d\n", size);
-
-    num_to_clean = min(num_to_clean, (int)mp.size());
-    u64_t current_time = get_current_time();
-
-    for (;;) {
-        if (cnt >= num_to_clean) break;
-        if (mp.begin() == mp.end()) break;
-
-        if (it == mp.end()) {
-            it = mp.begin();
-        }
-
-        if (it->second->state.server_current_state == server_ready && current_time - it->second->last_hb_recv_time <= server_conn_timeout) {
-            it++;
-        } else if (it->second->state.server_current_state != server_ready && current_time - it->second->last_state_time <= server_handshake_timeout) {
-            it++;
-        } else if (it->second->blob != 0 && it->second->blob->conv_manager.s.get_size() > 0) {
-            assert(it->second->state.server_current_state == server_ready);
-            it++;
-        } else {
-            mylog(log_info, "[%s:%d]inactive conn cleared \n", it->second->raw_info.recv_info.new_src_ip.get_str1(), it->second->raw_info.recv_info.src_port);
-            old_it = it;
-            it++;
-            erase(old_it);
-        }
-        cnt++;
-    }
-    clear_it = it;
-
-    return 0;
-}
-
 int send_bare(raw_info_t &raw_info, const char *data, int len)  // send function with encryption but no anti replay,this is used when client and server verifys each other
 // you have to design the protocol carefully, so that you wont be affect by relay attack
 {
@@ -325,6 +372,7 @@ int reserved_parse_bare(const char *input, int input_len, char *&data, int &len)
     }
     if (my_decrypt(input, recv_data_buf, input_len) != 0) {
         mylog(log_debug, "decrypt_fail in recv bare\n");
+        stat_add(stat_decrypt_fail);
         return -1;
     }
     if (recv_data_buf[sizeof(iv_t) + sizeof(padding_t)] != 'b') {
@@ -364,7 +412,7 @@ int recv_bare(raw_info_t &raw_info, char *&data, int &len)  // recv function wit
     return reserved_parse_bare(data, len, data, len);
 }
 
-int send_handshake(raw_info_t &raw_info, my_id_t id1, my_id_t id2, my_id_t id3)  // a warp for send_bare for sending handshake(this is not tcp handshake) easily
+int send_handshake(raw_info_t &raw_info, my_id_t id1, my_id_t id2, my_id_t id3, char flags, u64_t ticket)  // a warp for send_bare for sending handshake(this is not tcp handshake) easily
 {
     packet_info_t &send_info = raw_info.send_info;
     packet_info_t &recv_info = raw_info.recv_info;
@@ -373,12 +421,47 @@ int send_handshake(raw_info_t &raw_info, my_id_t id1, my_id_t id2, my_id_t id3)
     int len;
     // len=sizeof(id_t)*3;
     if (numbers_to_char(id1, id2, id3, data, len) != 0) return -1;
+    if (flags != 0) data[len++] = flags;  // data is a static buf of numbers_to_char
+    if (ticket != 0) {
+        assert(flags & handshake_flag_resume);
+        write_u64(data + len, ticket);
+        len += sizeof(ticket);
+    }
     if (send_bare(raw_info, data, len) != 0) {
         mylog(log_warn, "send bare fail\n");
         return -1;
     }
     return 0;
 }
+char handshake_flags(const char *data, int len) {
+    return len > int(3 * sizeof(my_id_t)) ? data[3 * sizeof(my_id_t)] : 0;
+}
+u64_t handshake_ticket(const char *data, int len) {
+    if (!(handshake_flags(data, len) & handshake_flag_resume) || len < int(3 * sizeof(my_id_t) + 1 + sizeof(u64_t))) return 0;
+    return read_u64((char *)data + 3 * sizeof(my_id_t) + 1);
+}
+int conn_hb_mode(const conn_info_t &conn_info) {
+    if (conn_info.adaptive_hb) return 2;
+    return hb_mode == 2 ? 1 : hb_mode;  // the peer is older,it only counts padded heartbeats
+}
+int send_heartbeat(conn_info_t &conn_info) {
+    int len = conn_hb_mode(conn_info) == 1 ? hb_len : 0;
+    if (program_mode == server_mode && conn_info.resume_ticket != 0) {  // the client keeps the latest one,a lost heartbeat costs nothing
+        char buf[buf_len];
+        buf[0] = resume_ticket_tag;
+        write_u64(buf + 1, conn_info.resume_ticket);
+        int ticket_len = 1 + sizeof(u64_t);
+        if (len > ticket_len) memcpy(buf + ticket_len, hb_buf + ticket_len, len - ticket_len);
+        return send_safer(conn_info, 'h', buf, max(len, ticket_len));
+    }
+    return send_safer(conn_info, 'h', hb_buf, len);
+}
+u64_t next_heartbeat_time(const conn_info_t &conn_info) {
+    u64_t next = conn_info.last_hb_sent_time + heartbeat_interval;
+    if (conn_hb_mode(conn_info) == 2 && conn_info.last_data_sent_time + heartbeat_interval > next)  // the data carries our roller and keeps the peer's timeout away
+        next = conn_info.last_data_sent_time + heartbeat_interval;
+    return next;
+}
 /*
 int recv_handshake(packet_info_t &info,id_t &id1,id_t &id2,id_t &id3)
 {
@@ -390,37 +473,132 @@ int recv_handshake(packet_info_t &info,id_t &id1,id_t &id2,id_t &id3)
         return 0;
 }*/
 
-int send_safer(conn_info_t &conn_info, char type, const char *data, int len)  // safer transfer function with anti-replay,when mutually verification is done.
+static int is_conn_ready(conn_info_t &conn_info) {
+    return program_mode == client_mode ? conn_info.state.client_current_state == client_ready : conn_info.state.server_current_state == server_ready;
+}
+static int send_raw_safer(conn_info_t &conn_info, const char *data, int len)  // the part of send_safer after encryption
 {
-    packet_info_t &send_info = conn_info.raw_info.send_info;
-    packet_info_t &recv_info = conn_info.raw_info.recv_info;
+    if (send_raw0(conn_info.raw_info, data, len) != 0) return -1;
+    conn_info.traffic.add_out(len);
 
-    if (type != 'h' && type != 'd') {
-        mylog(log_warn, "first byte is not h or d  ,%x\n", type);
-        return -1;
-    }
+    if (after_send_raw0(conn_info.raw_info) != 0) return -1;
 
-    char send_data_buf[buf_len];  // buf for send data and send hb
-    char send_data_buf2[buf_len];
+    return 0;
+}
+static void pacing_refill(pacer_t &pacer) {
+    u64_t current_time = get_current_time_us();
+    pacer.tokens = min(pacer.tokens + (current_time - pacer.last_time) * pacing_rate, (double)pacing_burst);
+    pacer.last_time = current_time;
+}
+static u64_t pacing_deadline(pacer_t &pacer)  // in us,when the bucket is out of debt
+{
+    if (pacer.tokens >= 0) return pacer.last_time;
+    return pacer.last_time + u64_t(-pacer.tokens / pacing_rate) + 1;
+}
+static int pacing_send(conn_info_t &conn_info, const char *data, int len)  // --pacing-rate,send now if the bucket allows,otherwise queue
+{
+    if (pacing_rate == 0) return send_raw_safer(conn_info, data, len);
 
+    pacer_t &pacer = conn_info.blob->pacer;
+    pacing_refill(pacer);
+    if (pacer.queued_bytes == 0 && pacer.tokens >= 0) {
+        pacer.tokens -= len;
+        return send_raw_safer(conn_info, data, len);
+    }
+    int queue_max = max(pacing_queue_min, int(pacing_rate * pacing_queue_ms * 1000));
+    if (pacer.queued_bytes + len > queue_max) {
+        mylog(log_trace, "pacing queue full,%d bytes queued\n", pacer.queued_bytes);
+        stat_add(stat_drop_pacing);
+        return 0;
+    }
+    if (pacer.queued_bytes == 0) pacing_heap.set(&conn_info.pacing_timer, pacing_deadline(pacer));
+    int old_size = pacer.queue.size();
+    pacer.queue.resize(old_size + 2 + len);
+    write_u16(&pacer.queue[old_size], len);
+    memcpy(&pacer.queue[old_size + 2], data, len);
+    pacer.queued_bytes += len;
+    return 0;
+}
+int pacing_flush(conn_info_t &conn_info) {
+    pacer_t &pacer = conn_info.blob->pacer;
+    if (pacer.queued_bytes == 0) return 0;
+    if (!is_conn_ready(conn_info)) {
+        mylog(log_debug, "connection no longer ready,%d paced bytes dropped\n", pacer.queued_bytes);
+        pacing_clear(conn_info);
+        return 0;
+    }
+    pacing_refill(pacer);
+    int ret = 0;
+    while (pacer.queued_bytes != 0 && pacer.tokens >= 0) {
+        char *p = &pacer.queue[pacer.head];
+        int len = read_u16(p);
+        pacer.head += 2 + len;
+        pacer.queued_bytes -= len;
+        pacer.tokens -= len;
+        if (send_raw_safer(conn_info, p + 2, len) != 0) ret = -1;
+    }
+    if (pacer.queued_bytes == 0) {
+        pacing_clear(conn_info);
+    } else {
+        pacing_heap.set(&conn_info.pacing_timer, pacing_deadline(pacer));  // tokens were spent,deadline moved
+        if (pacer.head > (int)pacer.queue.size() / 2) {  // keep the queue from creeping forward
+            pacer.queue.erase(pacer.queue.begin(), pacer.queue.begin() + pacer.head);
+            pacer.head = 0;
+        }
+    }
+    return ret;
+}
+void pacing_clear(conn_info_t &conn_info) {
+    pacer_t &pacer = conn_info.blob->pacer;
+    pacing_heap.del(&conn_info.pacing_timer);
+    if (pacer.queue.capacity() > (size_t)pacing_queue_min)
+        vector<char>().swap(pacer.queue);  // a big burst is over,dont hold its memory
+    else
+        pacer.queue.clear();
+    pacer.head = 0;
+    pacer.queued_bytes = 0;
+}
+int write_safer_header(conn_info_t &conn_info, char *p) {
+    if (conn_info.frame_v2) {  // session id,low 32 bits of seq. the session id is the receiver's id,so that a frame reflected
+                               // back to its sender fails the check,the key is the same in both directions
+        write_u32(p, conn_info.oppsite_id);
+        write_u32(p + 4, (u32_t)conn_info.blob->anti_replay.get_new_seq_for_send());
+        return 8;
+    }
     my_id_t n_tmp_id = htonl(conn_info.my_id);
 
-    memcpy(send_data_buf, &n_tmp_id, sizeof(n_tmp_id));
+    memcpy(p, &n_tmp_id, sizeof(n_tmp_id));
 
     n_tmp_id = htonl(conn_info.oppsite_id);
 
-    memcpy(send_data_buf + sizeof(n_tmp_id), &n_tmp_id, sizeof(n_tmp_id));
+    memcpy(p + sizeof(n_tmp_id), &n_tmp_id, sizeof(n_tmp_id));
 
     anti_replay_seq_t n_seq = hton64(conn_info.blob->anti_replay.get_new_seq_for_send());
 
-    memcpy(send_data_buf + sizeof(n_tmp_id) * 2, &n_seq, sizeof(n_seq));
+    memcpy(p + sizeof(n_tmp_id) * 2, &n_seq, sizeof(n_seq));
+    return sizeof(n_tmp_id) * 2 + sizeof(n_seq);
+}
+int send_safer(conn_info_t &conn_info, char type, const char *data, int len)  // safer transfer function with anti-replay,when mutually verification is done.
+{
+    packet_info_t &send_info = conn_info.raw_info.send_info;
+    packet_info_t &recv_info = conn_info.raw_info.recv_info;
+
+    if (type != 'h' && type != 'd' && type != 'm' && type != 'f' && type != 'r') {
+        mylog(log_warn, "first byte is not h,d,m,f or r  ,%x\n", type);
+        return -1;
+    }
+
+    char send_data_buf[buf_len];  // buf for send data and send hb
+    char send_data_buf2[buf_len];
+
+    int header_len = write_safer_header(conn_info, send_data_buf);
 
-    send_data_buf[sizeof(n_tmp_id) * 2 + sizeof(n_seq)] = type;
-    send_data_buf[sizeof(n_tmp_id) * 2 + sizeof(n_seq) + 1] = conn_info.my_roller;
+    send_data_buf[header_len] = type;
+    send_data_buf[header_len + 1] = conn_info.my_roller;
 
-    memcpy(send_data_buf + 2 + sizeof(n_tmp_id) * 2 + sizeof(n_seq), data, len);  // data;
+    memcpy(send_data_buf + 2 + header_len, data, len);  // data;
 
-    int new_len = len + sizeof(n_seq) + sizeof(n_tmp_id) * 2 + 2;
+    int new_len = len + header_len + 2;
 
     if (g_fix_gro == 0) {
         if (my_encrypt(send_data_buf, send_data_buf2, new_len) != 0) {
@@ -440,11 +618,40 @@ int send_safer(conn_info_t &conn_info, char type, const char *data, int len)  //
         }
     }
 
-    if (send_raw0(conn_info.raw_info, send_data_buf2, new_len) != 0) return -1;
-
-    if (after_send_raw0(conn_info.raw_info) != 0) return -1;
+    last_raw_len = new_len;
+    if (type != 'h') conn_info.last_data_sent_time = get_current_time();
+    return pacing_send(conn_info, send_data_buf2, new_len);
+}
+static int send_safer_fec(conn_info_t &conn_info, char type, const char *data, int len)  // 'd' and 'm' frames go through here,--fec wraps them into 'f' frames
+// and sends 'r' frames when a group is full
+{
+    if (fec_data_num == 0) return send_safer(conn_info, type, data, len);
 
-    return 0;
+    fec_encoder_t &encoder = conn_info.blob->fec_encoder;
+    char send_data_buf[buf_len];
+    int full = encoder.add(type, data, len, send_data_buf);
+    send_data_buf[fec_header_len] = type;
+    memcpy(send_data_buf + fec_header_len + 1, data, len);
+    int ret = send_safer(conn_info, 'f', send_data_buf, fec_header_len + 1 + len);
+    if (encoder.data_cnt == 1) fec_heap.set(&conn_info.fec_timer, encoder.deadline);
+    if (full) fec_flush(conn_info);
+    return ret;
+}
+int fec_flush(conn_info_t &conn_info) {
+    fec_encoder_t &encoder = conn_info.blob->fec_encoder;
+    if (encoder.data_cnt == 0) return 0;
+    fec_heap.del(&conn_info.fec_timer);
+    int ret = 0;
+    if (is_conn_ready(conn_info)) {
+        char send_data_buf[buf_len];
+        for (int p = 0; p < fec_parity_num; p++) {
+            int len = encoder.repair_frame(p, send_data_buf);
+            if (send_safer(conn_info, 'r', send_data_buf, len) != 0) ret = -1;
+        }
+        stat_add(stat_fec_repair_out, fec_parity_num);
+    }
+    encoder.next_group();
+    return ret;
 }
 int send_data_safer(conn_info_t &conn_info, const char *data, int len, u32_t conv_num)  // a wrap for  send_safer for transfer data.
 {
@@ -453,14 +660,258 @@ int send_data_safer(conn_info_t &conn_info, const char *data, int len, u32_t con
 
     char send_data_buf[buf_len];
     // send_data_buf[0]='d';
-    u32_t n_conv_num = htonl(conv_num);
-    memcpy(send_data_buf, &n_conv_num, sizeof(n_conv_num));
+    int conv_len = write_conv(conn_info.frame_v2, send_data_buf, conv_num);
+
+    pmtu_t &pmtu = conn_info.blob->pmtu;
+    if (pmtu.max_datagram != 0 && len > pmtu.max_datagram) {
+        mylog(log_debug, "datagram of %d bytes is larger than %d,the path mtu allows\n", len, pmtu.max_datagram);
+        stat_add(stat_pmtu_oversize);
+    }
+
+    if (coalesce_us != 0) {
+        coalesce_t &coalesce = conn_info.blob->coalesce;
+        int sub_len = 2 + conv_len + len;
+        int cap = coalesce_size;
+        if (pmtu.frame_limit != 0 && pmtu.frame_limit < cap) cap = pmtu.frame_limit;  // an 'm' frame must fit the path too
+        if (sub_len <= cap) {
+            if ((int)coalesce.buf.size() + sub_len > cap) coalesce_flush(conn_info);
+            if (coalesce.buf.capacity() == 0) coalesce.buf.reserve(coalesce_size);
+            int old_size = coalesce.buf.size();
+            coalesce.buf.resize(old_size + sub_len);
+            char *p = &coalesce.buf[old_size];
+            write_u16(p, conv_len + len);
+            memcpy(p + 2, send_data_buf, conv_len);
+            memcpy(p + 2 + conv_len, data, len);
+            if (coalesce.cnt++ == 0) {
+                coalesce.deadline = get_current_time_us() + coalesce_us;
+                coalesce_heap.set(&conn_info.coalesce_timer, coalesce.deadline);
+            }
+            return 0;
+        }
+        coalesce_flush(conn_info);  // a big one,dont let it overtake the small ones
+    }
 
-    memcpy(send_data_buf + sizeof(n_conv_num), data, len);
-    int new_len = len + sizeof(n_conv_num);
-    send_safer(conn_info, 'd', send_data_buf, new_len);
+    memcpy(send_data_buf + conv_len, data, len);
+    int new_len = len + conv_len;
+    send_safer_fec(conn_info, 'd', send_data_buf, new_len);
     return 0;
 }
+int coalesce_flush(conn_info_t &conn_info)  // a single datagram goes out as a plain 'd' frame
+{
+    coalesce_t &coalesce = conn_info.blob->coalesce;
+    if (coalesce.cnt == 0) return 0;
+    coalesce_heap.del(&conn_info.coalesce_timer);
+    int ret = 0;
+    if (!is_conn_ready(conn_info)) {
+        mylog(log_debug, "connection no longer ready,%d coalesced datagrams dropped\n", coalesce.cnt);
+    } else if (coalesce.cnt == 1) {
+        ret = send_safer_fec(conn_info, 'd', &coalesce.buf[2], coalesce.buf.size() - 2);
+    } else {
+        ret = send_safer_fec(conn_info, 'm', &coalesce.buf[0], coalesce.buf.size());
+        stat_add(stat_coalesce_frames);
+        stat_add(stat_coalesce_datagrams, coalesce.cnt);
+    }
+    coalesce.buf.clear();
+    coalesce.cnt = 0;
+    return ret;
+}
+void send_flush_due() {
+    u64_t current_time = get_current_time_us();
+    heap_timer_t *timer;
+    while ((timer = coalesce_heap.top()) != 0 && timer->deadline <= current_time)
+        coalesce_flush(*(conn_info_t *)timer->data);  // takes it out of the heap
+    while ((timer = fec_heap.top()) != 0 && timer->deadline <= current_time)  // after coalesce,its frames may have started a group
+        fec_flush(*(conn_info_t *)timer->data);
+    while ((timer = pacing_heap.top()) != 0 && timer->deadline <= current_time)  // last,the frames above may have been queued
+        pacing_flush(*(conn_info_t *)timer->data);                                 // out of the heap,or moved to a later deadline
+}
+u64_t send_next_deadline() {
+    u64_t deadline = 0;
+    timer_heap_t *heaps[] = {&coalesce_heap, &fec_heap, &pacing_heap};
+    for (int i = 0; i < (int)(sizeof(heaps) / sizeof(heaps[0])); i++) {
+        heap_timer_t *timer = heaps[i]->top();
+        if (timer != 0 && (deadline == 0 || timer->deadline < deadline)) deadline = timer->deadline;
+    }
+    return deadline;
+}
+static int raw_header_len()  // ip and transport header in front of the raw payload
+{
+    int len = raw_ip_version == AF_INET6 ? 40 : 20;
+    if (raw_mode == mode_faketcp)
+        len += 32;  // with timestamp option,sack blocks add up to 28 more while the peer has holes,see raw_option_room()
+    else
+        len += 8;
+    return len;
+}
+static int raw_option_room()  // frame bytes to leave for options that come and go,probes may have been sent without them
+{
+    if (raw_mode != mode_faketcp || (seq_mode != 3 && seq_mode != 4)) return 0;
+    int room = 4 + 8 * tcp_sack_max;        // sack blocks
+    if (cipher_mode == cipher_aes128cbc) room += 15;  // padded to 16 bytes,a shorter frame may give back less than it lost
+    return room;
+}
+static void pmtu_send_probe(conn_info_t &conn_info, int len) {
+    pmtu_t &pmtu = conn_info.blob->pmtu;
+    char buf[buf_len];
+    memset(buf, 0, len);
+    buf[0] = pmtu_probe_tag;
+    write_u16(buf + 1, len);
+    send_safer(conn_info, 'h', buf, len);
+    pmtu.probe_raw_len = last_raw_len;
+    pmtu.probe_len = len;
+    pmtu.probe_time = get_current_time();
+    mylog(log_trace, "path mtu probe of %d bytes sent,raw len %d\n", len, pmtu.probe_raw_len);
+}
+static void pmtu_next(conn_info_t &conn_info)  // next probe of the search,or the result
+{
+    pmtu_t &pmtu = conn_info.blob->pmtu;
+    pmtu.tries = 0;
+    pmtu.probe_len = 0;
+    if (pmtu.lo == 0 && pmtu.hi > pmtu_min_payload) {  // smallest one first,it tells if the peer answers at all
+        pmtu_send_probe(conn_info, pmtu_min_payload);
+        return;
+    }
+    if (pmtu.lo != 0 && pmtu.hi - pmtu.lo > pmtu_step) {
+        pmtu_send_probe(conn_info, (pmtu.lo + pmtu.hi) / 2);
+        return;
+    }
+
+    pmtu.next_search_time = get_current_time() + pmtu_probe_interval * 1000llu;
+    address_t addr;
+    addr.from_ip_port_new(raw_ip_version, &conn_info.raw_info.send_info.new_dst_ip, conn_info.raw_info.send_info.dst_port);
+    if (pmtu.lo == 0) {
+        mylog(log_info, "[%s]path mtu probes not answered,the peer may be an older version\n", addr.get_str());
+        return;  // the result of an earlier search is kept
+    }
+    pmtu.mtu = pmtu.lo_raw_len + raw_header_len();
+    pmtu.frame_limit = pmtu.lo - raw_option_room() - (fec_data_num != 0 ? fec_header_len + 3 : 0);  // a repair frame is 2 bytes larger than the 'f' frame it covers
+    pmtu.max_datagram = pmtu.frame_limit - (conn_info.frame_v2 ? 5 : (int)sizeof(u32_t));
+    mylog(log_info, "[%s]path mtu is %d,largest udp datagram that fits is %d\n", addr.get_str(), pmtu.mtu, pmtu.max_datagram);
+}
+void pmtu_on_timer(conn_info_t &conn_info) {
+    if (pmtu_probe_interval == 0) return;
+    pmtu_t &pmtu = conn_info.blob->pmtu;
+    u64_t current_time = get_current_time();
+    if (pmtu.next_search_time != 0) {
+        if (current_time < pmtu.next_search_time) return;
+        pmtu.next_search_time = 0;
+        pmtu.lo = 0;
+        pmtu.hi = pmtu_max_payload + 1;
+        pmtu_next(conn_info);
+    } else if (pmtu.probe_len == 0) {  // first call on a new connection
+        pmtu_next(conn_info);
+    } else if (current_time - pmtu.probe_time >= pmtu_probe_timeout) {
+        if (++pmtu.tries < pmtu_probe_tries) {
+            pmtu_send_probe(conn_info, pmtu.probe_len);
+        } else {
+            pmtu.hi = pmtu.probe_len;
+            pmtu_next(conn_info);
+        }
+    }
+}
+void pmtu_on_hb(conn_info_t &conn_info, const char *data, int len) {
+    if (len < 3) return;
+    if (data[0] == pmtu_probe_tag) {
+        char buf[3];
+        buf[0] = pmtu_ack_tag;
+        memcpy(buf + 1, data + 1, 2);
+        send_safer(conn_info, 'h', buf, sizeof(buf));
+    } else if (data[0] == pmtu_ack_tag) {
+        pmtu_t &pmtu = conn_info.blob->pmtu;
+        int acked = read_u16((char *)data + 1);
+        if (pmtu.next_search_time != 0 || acked != pmtu.probe_len) return;  // late one
+        pmtu.lo = acked;
+        pmtu.lo_raw_len = pmtu.probe_raw_len;
+        pmtu_next(conn_info);  // right away,only a lost probe waits for the timer
+    }
+}
+int write_conv(int frame_v2, char *p, u32_t conv) {
+    if (!frame_v2) {
+        write_u32(p, conv);
+        return sizeof(u32_t);
+    }
+    int i = 0;
+    for (; conv >= 0x80; conv >>= 7) p[i++] = char(0x80 | (conv & 0x7f));  // leb128,low bits first
+    p[i++] = char(conv);
+    return i;
+}
+int push_data_payload(int frame_v2, const char *data, int len, vector<string> &data_arr) {
+    if (!frame_v2) {
+        data_arr.emplace_back(data, data + len);
+        return 0;
+    }
+    u32_t conv = 0;
+    int i = 0;
+    for (;; i++) {
+        if (i >= len || i >= 5) {
+            mylog(log_debug, "bad varint conv,len=%d\n", len);
+            return -1;
+        }
+        conv |= u32_t(data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0) break;
+    }
+    i++;
+    data_arr.push_back(string());
+    string &s = data_arr.back();
+    s.resize(sizeof(u32_t) + len - i);
+    write_u32(&s[0], conv);
+    memcpy(&s[sizeof(u32_t)], data + i, len - i);
+    return 0;
+}
+int coalesce_split(const char *data, int len, int frame_v2, vector<char> &type_arr, vector<string> &data_arr) {
+    while (len > 0) {
+        if (len < 2) {
+            mylog(log_debug, "truncated sub frame of an 'm' frame\n");
+            return -1;
+        }
+        int sub_len = read_u16((char *)data);
+        data += 2;
+        len -= 2;
+        if (sub_len < (frame_v2 ? 1 : (int)sizeof(u32_t)) || sub_len > len) {
+            mylog(log_debug, "illegal sub frame len %d,%d left\n", sub_len, len);
+            return -1;
+        }
+        if (push_data_payload(frame_v2, data, sub_len, data_arr) != 0) return -1;
+        type_arr.push_back('d');
+        data += sub_len;
+        len -= sub_len;
+    }
+    return 0;
+}
+static void push_safer_frame(conn_info_t &conn_info, char type, char *data, int len, vector<char> &type_arr, vector<string> &data_arr)  // 'm' frames are split,
+// 'f' and 'r' frames go through the fec decoder
+{
+    if (type == 'm') {
+        coalesce_split(data, len, conn_info.frame_v2, type_arr, data_arr);
+    } else if (type == 'f' || type == 'r') {
+        static vector<string> rebuilt;
+        rebuilt.clear();
+        int ret = conn_info.blob->fec_decoder.add(data, len, type == 'r', rebuilt);
+        if (ret == fec_duplicate) {  // ie the late original of a rebuilt frame
+            mylog(log_trace, "fec data frame was delivered already,dropped\n");
+            return;
+        }
+        if (ret < 0) {
+            mylog(log_debug, "malformed fec frame,len=%d\n", len);
+            return;
+        }
+        if (type == 'f') {
+            char inner_type = data[fec_header_len];
+            if (inner_type == 'd' || inner_type == 'm') push_safer_frame(conn_info, inner_type, data + fec_header_len + 1, len - fec_header_len - 1, type_arr, data_arr);
+        }
+        for (int i = 0; i < (int)rebuilt.size(); i++) {
+            char inner_type = rebuilt[i][0];
+            if (inner_type != 'd' && inner_type != 'm') continue;
+            push_safer_frame(conn_info, inner_type, &rebuilt[i][1], rebuilt[i].size() - 1, type_arr, data_arr);
+            stat_add(stat_fec_recovered);
+        }
+    } else if (type == 'd') {
+        if (push_data_payload(conn_info.frame_v2, data, len, data_arr) == 0) type_arr.push_back(type);
+    } else {
+        type_arr.push_back(type);
+        data_arr.emplace_back(data, data + len);
+    }
+}
 int reserved_parse_safer(conn_info_t &conn_info, const char *input, int input_len, char &type, char *&data, int &len)  // subfunction for recv_safer,allow overlap
 {
     static char recv_data_buf[buf_len];
@@ -468,41 +919,59 @@ int reserved_parse_safer(conn_info_t &conn_info, const char *input, int input_le
     // char *recv_data_buf=recv_data_buf0; //fix strict alias warning
     if (my_decrypt(input, recv_data_buf, input_len) != 0) {
         // printf("decrypt fail\n");
+        stat_add(stat_decrypt_fail);
         return -1;
     }
 
-    // char *a=recv_data_buf;
-    // id_t h_oppiste_id= ntohl (  *((id_t * )(recv_data_buf)) );
-    my_id_t h_oppsite_id;
-    memcpy(&h_oppsite_id, recv_data_buf, sizeof(h_oppsite_id));
-    h_oppsite_id = ntohl(h_oppsite_id);
-
-    // id_t h_my_id= ntohl (  *((id_t * )(recv_data_buf+sizeof(id_t)))    );
-    my_id_t h_my_id;
-    memcpy(&h_my_id, recv_data_buf + sizeof(my_id_t), sizeof(h_my_id));
-    h_my_id = ntohl(h_my_id);
-
-    // anti_replay_seq_t h_seq= ntoh64 (  *((anti_replay_seq_t * )(recv_data_buf  +sizeof(id_t) *2 ))   );
-    anti_replay_seq_t h_seq;
-    memcpy(&h_seq, recv_data_buf + sizeof(my_id_t) * 2, sizeof(h_seq));
-    h_seq = ntoh64(h_seq);
-
-    if (h_oppsite_id != conn_info.oppsite_id || h_my_id != conn_info.my_id) {
-        mylog(log_debug, "id and oppsite_id verification failed %x %x %x %x \n", h_oppsite_id, conn_info.oppsite_id, h_my_id, conn_info.my_id);
+    int header_len = sizeof(anti_replay_seq_t) + sizeof(my_id_t) * 2;
+    if (conn_info.frame_v2) header_len = 8;
+    if (input_len < header_len + 2) {  // my_decrypt gives back the plain len
+        mylog(log_debug, "too short for a safer frame,len=%d\n", input_len);
         return -1;
     }
+    anti_replay_seq_t h_seq;
+    if (conn_info.frame_v2) {
+        if (read_u32(recv_data_buf) != conn_info.my_id) {  // addressed to us,not one of our own frames reflected back
+            mylog(log_debug, "session id verification failed %x %x\n", read_u32(recv_data_buf), conn_info.my_id);
+            stat_add(stat_id_mismatch);
+            return -1;
+        }
+        h_seq = conn_info.blob->anti_replay.expand_seq(read_u32(recv_data_buf + 4));
+    } else {
+        // char *a=recv_data_buf;
+        // id_t h_oppiste_id= ntohl (  *((id_t * )(recv_data_buf)) );
+        my_id_t h_oppsite_id;
+        memcpy(&h_oppsite_id, recv_data_buf, sizeof(h_oppsite_id));
+        h_oppsite_id = ntohl(h_oppsite_id);
+
+        // id_t h_my_id= ntohl (  *((id_t * )(recv_data_buf+sizeof(id_t)))    );
+        my_id_t h_my_id;
+        memcpy(&h_my_id, recv_data_buf + sizeof(my_id_t), sizeof(h_my_id));
+        h_my_id = ntohl(h_my_id);
+
+        // anti_replay_seq_t h_seq= ntoh64 (  *((anti_replay_seq_t * )(recv_data_buf  +sizeof(id_t) *2 ))   );
+        memcpy(&h_seq, recv_data_buf + sizeof(my_id_t) * 2, sizeof(h_seq));
+        h_seq = ntoh64(h_seq);
+
+        if (h_oppsite_id != conn_info.oppsite_id || h_my_id != conn_info.my_id) {
+            mylog(log_debug, "id and oppsite_id verification failed %x %x %x %x \n", h_oppsite_id, conn_info.oppsite_id, h_my_id, conn_info.my_id);
+            stat_add(stat_id_mismatch);
+            return -1;
+        }
+    }
 
     if (conn_info.blob->anti_replay.is_vaild(h_seq) != 1) {
         mylog(log_debug, "dropped replay packet\n");
+        stat_add(stat_replay_reject);
         return -1;
     }
 
     // printf("recv _len %d\n ",recv_len);
-    data = recv_data_buf + sizeof(anti_replay_seq_t) + sizeof(my_id_t) * 2;
-    len = input_len - (sizeof(anti_replay_seq_t) + sizeof(my_id_t) * 2);
+    data = recv_data_buf + header_len;
+    len = input_len - header_len;
 
-    if (data[0] != 'h' && data[0] != 'd') {
-        mylog(log_debug, "first byte is not h or d  ,%x\n", data[0]);
+    if (data[0] != 'h' && data[0] != 'd' && data[0] != 'm' && data[0] != 'f' && data[0] != 'r') {
+        mylog(log_debug, "first byte is not h,d,m,f or r  ,%x\n", data[0]);
         return -1;
     }
 
@@ -521,9 +990,10 @@ int reserved_parse_safer(conn_info_t &conn_info, const char *input, int input_le
         conn_info.oppsite_roller = roller;
         conn_info.last_oppsite_roller_time = get_current_time();
     }
-    if (hb_mode == 0)
+    int mode = conn_hb_mode(conn_info);
+    if (mode == 0 || mode == 2)
         conn_info.my_roller++;  // increase on a successful recv
-    else if (hb_mode == 1) {
+    else if (mode == 1) {
         if (type == 'h')
             conn_info.my_roller++;
     } else {
@@ -533,6 +1003,7 @@ int reserved_parse_safer(conn_info_t &conn_info, const char *input, int input_le
 
     if (after_recv_raw0(conn_info.raw_info) != 0) return -1;  // TODO might need to move this function to somewhere else after --fix-gro is introduced
 
+    conn_info.traffic.add_in(input_len);
     return 0;
 }
 int recv_safer_notused(conn_info_t &conn_info, char &type, char *&data, int &len)  /// safer transfer function with anti-replay,when mutually verification is done.
@@ -568,8 +1039,7 @@ int recv_safer_multi(conn_info_t &conn_info, vector<char> &type_arr, vector<stri
     if (g_fix_gro == 0) {
         int ret = reserved_parse_safer(conn_info, recv_data, recv_len, type, data, len);
         if (ret == 0) {
-            type_arr.push_back(type);
-            data_arr.emplace_back(data, data + len);
+            push_safer_frame(conn_info, type, data, len, type_arr, data_arr);
             // std::copy(data,data+len,data_arr[0]);
         }
         return 0;
@@ -606,8 +1076,7 @@ int recv_safer_multi(conn_info_t &conn_info, vector<char> &type_arr, vector<stri
             if (ret != 0) {
                 mylog(log_debug, "parse failed, offset= %d,single_len=%d(%d)\n", (int)(recv_data - ori_recv_data), single_len, single_len_no_xor);
             } else {
-                type_arr.push_back(type);
-                data_arr.emplace_back(data, data + len);
+                push_safer_frame(conn_info, type, data, len, type_arr, data_arr);
                 // std::copy(data,data+len,data_arr[data_arr.size()-1]);
             }
             recv_data += single_len;
@@ -650,6 +1119,12 @@ void server_clear_function(u64_t u64)  // used in conv_manager in server mode.fo
     // mylog(log_fatal,"size:%d !!!!\n",conn_manager.udp_fd_mp.size());
     fd64_t fd64 = u64;
     assert(fd_manager.exist(fd64));
+#ifndef UDP2RAW_MP
+    if (upstream_pool_size > 0) {  // pooled socket goes back to the pool instead of being closed
+        upstream_pool_release(fd64);
+        return;
+    }
+#endif
     fd_manager.fd64_close(fd64);
 
     // assert(conn_manager.udp_fd_mp.find(fd)!=conn_manager.udp_fd_mp.end());
@@ -15,19 +15,40 @@ extern int disable_anti_replay;
 #include "log.h"
 #include "network.h"
 #include "misc.h"
+#include "timer_wheel.h"
+#include "stats.h"
+#include "fec.h"
 
 const int disable_conv_clear = 0;  // a udp connection in the multiplexer is called conversation in this program,conv for short.
 
-struct anti_replay_t  // its for anti replay attack,similar to openvpn/ipsec 's anti replay window
+extern u32_t anti_replay_window_size;
+extern int coalesce_us;    // --coalesce,latency budget of a small datagram in microseconds,0 disables
+extern int coalesce_size;  // --coalesce-size,cap of the payload of one 'm' frame
+extern int frame_v2_offer;  // --frame-v2,client asks for the compact frame format in handshake
+extern int pmtu_probe_interval;  // --pmtu-probe,seconds between path mtu searches,0 disables
+extern double pacing_rate;        // --pacing-rate,bytes per us of each connection,0 disables
+extern int pacing_burst;          // --pacing-burst,bytes that may go out back to back
+extern int resume_offer;          // client asks for a resumption ticket,--disable-resume clears it
+
+const char handshake_flag_frame_v2 = 0x01;  // in the optional 13th byte of a handshake,older versions ignore it
+const char handshake_flag_adaptive_hb = 0x02;  // hb_mode 2
+const char handshake_flag_resume = 0x04;        // client wants tickets,or a handshake that carries one after the flags
+const char handshake_flags_supported = handshake_flag_frame_v2 | handshake_flag_adaptive_hb | handshake_flag_resume;  // what a server echoes
+const char resume_ticket_tag = 'T';  // first byte of a heartbeat that carries a ticket,server to client
+
+struct anti_replay_t : not_copy_able_t  // its for anti replay attack,similar to openvpn/ipsec 's anti replay window
 {
     u64_t max_packet_received;
-    char window[anti_replay_window_size];
+    u64_t *window;   // bitmap as in rfc6479,a ring of word_num 64-bit words. a forward jump clears whole words
+    u32_t word_num;  // power of 2,the word of max_packet_received is partly used,so (word_num-1)*64 seqs below it are tracked
     anti_replay_seq_t anti_replay_seq;
     anti_replay_seq_t get_new_seq_for_send();
     anti_replay_t();
+    ~anti_replay_t();
     void re_init();
 
     int is_vaild(u64_t seq);
+    u64_t expand_seq(u32_t low);  // frame v2 carries the low 32 bits of seq,take the value nearest to max_packet_received
 };  // anti_replay;
 
 void server_clear_function(u64_t u64);
@@ -37,97 +58,169 @@ void server_clear_function(u64_t u64);
 template <class T>
 struct conv_manager_t  // manage the udp connections
 {
-    // typedef hash_map map;
-    unordered_map<T, u32_t> data_to_conv;  // conv and u64 are both supposed to be uniq
-    unordered_map<u32_t, T> conv_to_data;
-
-    lru_collector_t<u32_t> lru;
-    // unordered_map<u32_t,u64_t> conv_last_active_time;
-
-    // unordered_map<u32_t,u64_t>::iterator clear_it;
+    // every conv is a record in a pool,records are linked into an intrusive lru list (most recent at head)
+    // and indexed by two open-addressing tables (conv->record,data->record). no allocation on the per-packet path.
+    struct conv_record_t {
+        T data;
+        u32_t conv;
+        u32_t lru_prev;  // record index,nil_index for none. also used as free list link
+        u32_t lru_next;
+        my_time_t last_active_time;
+        traffic_stats_t traffic;  // udp side of this conv
+    };
+    static const u32_t nil_index = u32_t(-1);
+    static const u32_t slot_empty = 0;  // table slots store record index+1
+    static const u32_t slot_deleted = u32_t(-1);
+
+    vector<conv_record_t> records;
+    u32_t free_head;
+    u32_t lru_head;
+    u32_t lru_tail;
+    int live_num;
+
+    vector<u32_t> conv_table;
+    vector<u32_t> data_table;
+    u32_t table_mask;
+    int table_used;  // live + deleted slots,same for both tables
+    u64_t hash_seed;  // conv comes from network,keep probing sequences unpredictable
 
     void (*additional_clear_function)(T data) = 0;
 
     long long last_clear_time;
+    u32_t next_small_conv;
 
     conv_manager_t() {
-        // clear_it=conv_last_active_time.begin();
-        long long last_clear_time = 0;
+        last_clear_time = 0;
+        next_small_conv = get_true_random_number() % small_conv_max;
         additional_clear_function = 0;
+        hash_seed = get_true_random_number_64();
+        reset(0);  // tables are allocated by the first insert_conv()
     }
     ~conv_manager_t() {
         clear();
     }
     int get_size() {
-        return conv_to_data.size();
+        return live_num;
     }
     void reserve() {
-        data_to_conv.reserve(10007);
-        conv_to_data.reserve(10007);
-        // conv_last_active_time.reserve(10007);
-
-        lru.mp.reserve(10007);
+        records.reserve(10007);
+        rehash(10007);
     }
     void clear() {
         if (disable_conv_clear) return;
 
         if (additional_clear_function != 0) {
-            for (auto it = conv_to_data.begin(); it != conv_to_data.end(); it++) {
-                // int fd=int((it->second<<32u)>>32u);
-                additional_clear_function(it->second);
+            for (u32_t i = lru_head; i != nil_index; i = records[i].lru_next) {
+                additional_clear_function(records[i].data);
             }
         }
-        data_to_conv.clear();
-        conv_to_data.clear();
-
-        lru.clear();
-        // conv_last_active_time.clear();
-
-        // clear_it=conv_last_active_time.begin();
+        reset(0);
     }
     u32_t get_new_conv() {
         u32_t conv = get_true_random_number_nz();
-        while (conv_to_data.find(conv) != conv_to_data.end()) {
+        while (is_conv_used(conv)) {
             conv = get_true_random_number_nz();
         }
         return conv;
     }
+    static const u32_t small_conv_max = 0x3fff;
+    u32_t get_new_small_conv()  // for frame v2,ids up to small_conv_max take 1 or 2 bytes as varint. random ones if they are used up
+    {
+        if (live_num >= (int)small_conv_max) return get_new_conv();
+        do {
+            next_small_conv = next_small_conv % small_conv_max + 1;
+        } while (is_conv_used(next_small_conv));
+        return next_small_conv;
+    }
+    u64_t memory_bytes()  // heap held by records and tables
+    {
+        return records.capacity() * sizeof(conv_record_t) + (conv_table.capacity() + data_table.capacity()) * sizeof(u32_t);
+    }
     int is_conv_used(u32_t conv) {
-        return conv_to_data.find(conv) != conv_to_data.end();
+        return find_slot_by_conv(conv) != nil_index;
     }
     int is_data_used(T data) {
-        return data_to_conv.find(data) != data_to_conv.end();
+        return find_slot_by_data(data) != nil_index;
     }
-    u32_t find_conv_by_data(T data) {
-        return data_to_conv[data];
+    u32_t find_conv_by_data(T data, traffic_stats_t **traffic = 0)  // traffic,if given,receives the counters of the conv
+    {
+        u32_t pos = find_slot_by_data(data);
+        assert(pos != nil_index);
+        if (traffic != 0) *traffic = &records[data_table[pos] - 1].traffic;
+        return records[data_table[pos] - 1].conv;
     }
-    T find_data_by_conv(u32_t conv) {
-        return conv_to_data[conv];
+    T find_data_by_conv(u32_t conv, traffic_stats_t **traffic = 0) {
+        u32_t pos = find_slot_by_conv(conv);
+        assert(pos != nil_index);
+        if (traffic != 0) *traffic = &records[conv_table[pos] - 1].traffic;
+        return records[conv_table[pos] - 1].data;
     }
     int update_active_time(u32_t conv) {
-        // return conv_last_active_time[conv]=get_current_time();
-        lru.update(conv);
+        u32_t pos = find_slot_by_conv(conv);
+        assert(pos != nil_index);
+        u32_t idx = conv_table[pos] - 1;
+        records[idx].last_active_time = get_current_time();
+        if (idx != lru_head) {
+            lru_unlink(idx);
+            lru_push_front(idx);
+        }
         return 0;
     }
     int insert_conv(u32_t conv, T data) {
-        data_to_conv[data] = conv;
-        conv_to_data[conv] = data;
-        // conv_last_active_time[conv]=get_current_time();
-        lru.new_key(conv);
+        assert(!is_conv_used(conv) && !is_data_used(data));
+        if ((table_used + 1) * 2 > (int)conv_table.size()) rehash(live_num + 1);
+
+        u32_t idx;
+        if (free_head != nil_index) {
+            idx = free_head;
+            free_head = records[idx].lru_next;
+        } else {
+            idx = records.size();
+            records.push_back(conv_record_t());
+        }
+        conv_record_t &record = records[idx];
+        record.conv = conv;
+        record.data = data;
+        record.last_active_time = get_current_time();
+        record.traffic.clear();
+        assert(lru_head == nil_index || record.last_active_time >= records[lru_head].last_active_time);
+        lru_push_front(idx);
+
+        table_insert(conv_table, hash_conv(conv), idx);
+        table_insert(data_table, hash_data(data), idx);
+        live_num++;
+        table_used++;
         return 0;
     }
     int erase_conv(u32_t conv) {
         if (disable_conv_clear) return 0;
-        T data = conv_to_data[conv];
+        u32_t conv_pos = find_slot_by_conv(conv);
+        assert(conv_pos != nil_index);
+        u32_t idx = conv_table[conv_pos] - 1;
+        T data = records[idx].data;
         if (additional_clear_function != 0) {
             additional_clear_function(data);
         }
-        conv_to_data.erase(conv);
-        data_to_conv.erase(data);
-        // conv_last_active_time.erase(conv);
-        lru.erase(conv);
+        u32_t data_pos = find_slot_by_data(data);
+        assert(data_pos != nil_index);
+        conv_table[conv_pos] = slot_deleted;
+        data_table[data_pos] = slot_deleted;
+
+        lru_unlink(idx);
+        records[idx].data = T();
+        records[idx].lru_next = free_head;
+        free_head = idx;
+        live_num--;
         return 0;
     }
+    my_time_t next_clear_time()  // when the oldest conv expires,for scheduling clear_inactive0() on the timer wheel
+    {
+        my_time_t current_time = get_current_time();
+        if (lru_tail == nil_index) return current_time + conv_timeout;
+        my_time_t ts = records[lru_tail].last_active_time;
+        if (current_time - ts >= conv_timeout) return current_time + 1;  // some expired ones are left bc of conv_clear_ratio
+        return ts + conv_timeout;
+    }
     int clear_inactive(char *info = 0) {
         if (get_current_time() - last_clear_time > conv_clear_interval) {
             last_clear_time = get_current_time();
@@ -138,13 +231,8 @@ struct conv_manager_t  // manage the udp connections
     int clear_inactive0(char *info) {
         if (disable_conv_clear) return 0;
 
-        unordered_map<u32_t, u64_t>::iterator it;
-        unordered_map<u32_t, u64_t>::iterator old_it;
-
-        // map<uint32_t,uint64_t>::iterator it;
         int cnt = 0;
-        // it=clear_it;
-        int size = lru.size();
+        int size = live_num;
         int num_to_clean = size / conv_clear_ratio + conv_clear_min;  // clear 1/10 each time,to avoid latency glitch
 
         num_to_clean = min(num_to_clean, size);
@@ -152,10 +240,10 @@ struct conv_manager_t  // manage the udp connections
         my_time_t current_time = get_current_time();
         for (;;) {
             if (cnt >= num_to_clean) break;
-            if (lru.empty()) break;
+            if (lru_tail == nil_index) break;
 
-            u32_t conv;
-            my_time_t ts = lru.peek_back(conv);
+            u32_t conv = records[lru_tail].conv;
+            my_time_t ts = records[lru_tail].last_active_time;
 
             if (current_time - ts < conv_timeout) break;
 
@@ -170,24 +258,156 @@ struct conv_manager_t  // manage the udp connections
         return 0;
     }
 
-    /*
-conv_manager_t();
-~conv_manager_t();
-int get_size();
-void reserve();
-void clear();
-u32_t get_new_conv();
-int is_conv_used(u32_t conv);
-int is_u64_used(T u64);
-u32_t find_conv_by_u64(T u64);
-T find_u64_by_conv(u32_t conv);
-int update_active_time(u32_t conv);
-int insert_conv(u32_t conv,T u64);
-int erase_conv(u32_t conv);
-int clear_inactive(char * ip_port=0);
-int clear_inactive0(char * ip_port);*/
+   private:
+    u32_t hash_conv(u32_t conv) {
+        return (u32_t)(mix64(conv ^ hash_seed) >> 32u);
+    }
+    u32_t hash_data(const T &data) {
+        return (u32_t)(mix64(std::hash<T>()(data) ^ hash_seed) >> 32u);
+    }
+    static u64_t mix64(u64_t x)  // murmur3 finalizer
+    {
+        x ^= x >> 33u;
+        x *= 0xff51afd7ed558ccdllu;
+        x ^= x >> 33u;
+        x *= 0xc4ceb9fe1a85ec53llu;
+        x ^= x >> 33u;
+        return x;
+    }
+    u32_t find_slot_by_conv(u32_t conv)  // position in conv_table,nil_index if not found
+    {
+        if (conv_table.empty()) return nil_index;
+        for (u32_t pos = hash_conv(conv) & table_mask;; pos = (pos + 1) & table_mask) {
+            u32_t v = conv_table[pos];
+            if (v == slot_empty) return nil_index;
+            if (v != slot_deleted && records[v - 1].conv == conv) return pos;
+        }
+    }
+    u32_t find_slot_by_data(const T &data) {
+        if (data_table.empty()) return nil_index;
+        for (u32_t pos = hash_data(data) & table_mask;; pos = (pos + 1) & table_mask) {
+            u32_t v = data_table[pos];
+            if (v == slot_empty) return nil_index;
+            if (v != slot_deleted && records[v - 1].data == data) return pos;
+        }
+    }
+    void table_insert(vector<u32_t> &table, u32_t hash, u32_t idx)  // caller makes sure there is room and key is new
+    {
+        u32_t pos = hash & table_mask;
+        while (table[pos] != slot_empty)
+            pos = (pos + 1) & table_mask;
+        table[pos] = idx + 1;
+    }
+    void rehash(int num)  // rebuild tables for num live convs,drops deleted slots
+    {
+        u32_t size = 16;
+        while ((int)size < num * 4) size *= 2;  // load factor <=1/4 after rebuild,<=1/2 before next rebuild
+        conv_table.assign(size, (u32_t)slot_empty);
+        data_table.assign(size, (u32_t)slot_empty);
+        table_mask = size - 1;
+        table_used = live_num;
+        for (u32_t i = lru_head; i != nil_index; i = records[i].lru_next) {
+            table_insert(conv_table, hash_conv(records[i].conv), i);
+            table_insert(data_table, hash_data(records[i].data), i);
+        }
+    }
+    void reset(int num)  // num=0 gives all memory back,for a connection without convs
+    {
+        records.clear();
+        free_head = lru_head = lru_tail = nil_index;
+        live_num = 0;
+        if (num == 0) {
+            vector<conv_record_t>().swap(records);
+            vector<u32_t>().swap(conv_table);
+            vector<u32_t>().swap(data_table);
+            table_mask = 0;
+            table_used = 0;
+        } else {
+            rehash(num);
+        }
+    }
+    void lru_unlink(u32_t idx) {
+        conv_record_t &record = records[idx];
+        if (record.lru_prev != nil_index)
+            records[record.lru_prev].lru_next = record.lru_next;
+        else
+            lru_head = record.lru_next;
+        if (record.lru_next != nil_index)
+            records[record.lru_next].lru_prev = record.lru_prev;
+        else
+            lru_tail = record.lru_prev;
+    }
+    void lru_push_front(u32_t idx) {
+        conv_record_t &record = records[idx];
+        record.lru_prev = nil_index;
+        record.lru_next = lru_head;
+        if (lru_head != nil_index)
+            records[lru_head].lru_prev = idx;
+        else
+            lru_tail = idx;
+        lru_head = idx;
+    }
 };  // g_conv_manager;
 
+struct coalesce_t  // --coalesce,small datagrams of a connection wait here to share one 'm' frame
+{
+    vector<char> buf;  // sub frames,each is u16 len + payload of a 'd' frame (conv + data). reserved on first use
+    int cnt;
+    u64_t deadline;  // in us,when the first sub frame must go out
+    coalesce_t() {
+        cnt = 0;
+        deadline = 0;
+    }
+};
+
+const char pmtu_probe_tag = 'P';  // first byte of a heartbeat payload,normal heartbeats are zeros and older versions ignore it
+const char pmtu_ack_tag = 'A';
+const int pmtu_min_payload = 256;                // heartbeat payloads of the search,the largest one stays below max_data_len after encryption
+const int pmtu_max_payload = max_data_len - 84;
+const int pmtu_step = 16;                        // a search ends when its bounds are this close
+const u32_t pmtu_probe_timeout = 1000;           // ms
+const int pmtu_probe_tries = 2;                  // a size is given up after this many unanswered probes
+
+struct pmtu_t  // path mtu of the sending direction,found by a binary search with padded heartbeats that the peer acks.
+// the ip header has DF set,so a probe that doesnt fit is dropped on the way instead of being fragmented
+{
+    int lo;            // largest heartbeat payload acked in this search,0 if none yet
+    int hi;            // smallest one given up
+    int lo_raw_len;    // raw payload carrying lo
+    int probe_len;     // probe waiting for its ack,0 if none
+    int probe_raw_len;
+    int tries;
+    u64_t probe_time;        // ms
+    u64_t next_search_time;  // ms,0 while searching
+    int mtu;           // ip packet size found by the last search,0 if unknown
+    int frame_limit;   // largest payload of a 'd' or 'm' frame that fits,0 if unknown
+    int max_datagram;  // largest udp datagram that fits in a 'd' frame,0 if unknown
+    pmtu_t() {
+        lo = lo_raw_len = probe_len = probe_raw_len = tries = 0;
+        hi = pmtu_max_payload + 1;
+        probe_time = next_search_time = 0;
+        mtu = frame_limit = max_datagram = 0;
+    }
+};
+
+const u32_t pacing_queue_ms = 200;          // a connection queues at most this much of its rate,the rest is dropped
+const int pacing_queue_min = 64 * 1024;
+
+struct pacer_t  // --pacing-rate,token bucket of a connection. raw packets that find it empty wait in queue,in order
+{
+    double tokens;  // bytes,negative while in debt
+    u64_t last_time;  // us,of the last refill
+    vector<char> queue;  // u16 len + encrypted raw payload each
+    int head;            // offset of the first one in queue
+    int queued_bytes;
+    pacer_t() {
+        tokens = 0;
+        last_time = 0;
+        head = 0;
+        queued_bytes = 0;
+    }
+};
+
 struct blob_t : not_copy_able_t  // used in conn_info_t.
 {
     union tmp_union_t  // conv_manager_t is here to avoid copying when a connection is recovered
@@ -214,6 +434,15 @@ struct blob_t : not_copy_able_t  // used in conn_info_t.
     } conv_manager;
 
     anti_replay_t anti_replay;  // anti_replay_t is here bc its huge,its allocation is delayed.
+
+    coalesce_t coalesce;
+    fec_encoder_t fec_encoder;
+    fec_decoder_t fec_decoder;
+    pmtu_t pmtu;
+    pacer_t pacer;
+
+    static void *operator new(size_t size);  // from blob_pool
+    static void operator delete(void *p);
 };
 struct conn_info_t  // stores info for a raw connection.for client ,there is only one connection,for server there can be thousand of connection since server can
 // handle multiple clients
@@ -229,17 +458,31 @@ struct conn_info_t  // stores info for a raw connection.for client ,there is onl
     my_id_t my_id;
     my_id_t oppsite_id;
 
-    fd64_t timer_fd64;
+    wheel_timer_t hb_timer;      // server only,heartbeat deadline
+    wheel_timer_t conv_timer;    // server only,expiry of the oldest conv
+    wheel_timer_t expire_timer;  // server only,expiry of the conn itself
+    heap_timer_t coalesce_timer;  // pending while blob->coalesce holds datagrams
+    heap_timer_t fec_timer;       // pending while blob->fec_encoder has a group that is not full
+    heap_timer_t pacing_timer;    // pending while blob->pacer has raw packets queued
+    address_t addr;              // server only,key in conn_manager.mp
     fd64_t udp_fd64;
 
     my_id_t oppsite_const_id;
 
     blob_t *blob;
 
+    int frame_v2;     // compact frame format,agreed in handshake
+    int adaptive_hb;  // hb_mode 2,agreed in handshake
+    u64_t resume_ticket;  // server:the one a returning client must show,rotated on every use. client:the one of the last session,0 if none
+    int resuming;         // client only,handshake1 carries the ticket and the old ids instead of asking for a cookie
+    u64_t last_data_sent_time;  // any frame but a heartbeat,for hb_mode 2
+
     uint8_t my_roller;
     uint8_t oppsite_roller;
     u64_t last_oppsite_roller_time;
 
+    traffic_stats_t traffic;  // raw side,counted by send_safer() and reserved_parse_safer()
+
     //	ip_port_t ip_port;
 
     /*
@@ -254,8 +497,14 @@ struct conn_info_t  // stores info for a raw connection.for client ,there is onl
     conn_info_t(const conn_info_t &b);
     conn_info_t &operator=(const conn_info_t &b);
     ~conn_info_t();
+
+    static void *operator new(size_t size);  // from conn_info_pool,a handshake flood churns lots of them
+    static void operator delete(void *p);
 };  // g_conn_info;
 
+extern slab_pool_t conn_info_pool;
+extern slab_pool_t blob_pool;
+
 struct conn_manager_t  // manager for connections. for client,we dont need conn_manager since there is only one connection.for server we use one conn_manager for all connections
 {
     u32_t ready_num;
@@ -269,10 +518,6 @@ struct conn_manager_t  // manager for connections. for client,we dont need conn_
 
     // lru_collector_t<address_t> lru;
 
-    unordered_map<address_t, conn_info_t *>::iterator clear_it;
-
-    long long last_clear_time;
-
     conn_manager_t();
     int exist(address_t addr);
     /*
@@ -289,23 +534,40 @@ struct conn_manager_t  // manager for connections. for client,we dont need conn_
     conn_info_t &find_insert(address_t addr);     // be aware,the adress may change after rehash
 
     int erase(unordered_map<address_t, conn_info_t *>::iterator erase_it);
-    int clear_inactive();
-    int clear_inactive0();
+    u64_t get_expire_time(conn_info_t &conn_info);  // deadline of a conn,it only moves later
 };
 
 extern conn_manager_t conn_manager;
 
 void server_clear_function(u64_t u64);
+void upstream_pool_release(fd64_t fd64);  // defined in server.cpp
 
 int send_bare(raw_info_t &raw_info, const char *data, int len);  // send function with encryption but no anti replay,this is used when client and server verifys each other
 // you have to design the protocol carefully, so that you wont be affect by relay attack
 // int reserved_parse_bare(const char *input,int input_len,char* & data,int & len); // a sub function used in recv_bare
 int recv_bare(raw_info_t &raw_info, char *&data, int &len);  // recv function with encryption but no anti replay,this is used when client and server verifys each other
 // you have to design the protocol carefully, so that you wont be affect by relay attack
-int send_handshake(raw_info_t &raw_info, my_id_t id1, my_id_t id2, my_id_t id3);         // a warp for send_bare for sending handshake(this is not tcp handshake) easily
+int send_handshake(raw_info_t &raw_info, my_id_t id1, my_id_t id2, my_id_t id3, char flags = 0, u64_t ticket = 0);  // a warp for send_bare for sending handshake(this is not tcp handshake) easily
+char handshake_flags(const char *data, int len);  // the optional flags byte after the 3 ids of a handshake,0 if absent
+u64_t handshake_ticket(const char *data, int len);  // resumption ticket after the flags,0 if absent
+int conn_hb_mode(const conn_info_t &conn_info);        // hb_mode in effect,2 only if the peer agreed
+int send_heartbeat(conn_info_t &conn_info);            // padded with hb_len in hb_mode 1,empty otherwise
+u64_t next_heartbeat_time(const conn_info_t &conn_info);  // in hb_mode 2 data that was sent recently postpones it
+int write_safer_header(conn_info_t &conn_info, char *p);  // ids and seq in front of a safer frame,returns its len
 int send_safer(conn_info_t &conn_info, char type, const char *data, int len);            // safer transfer function with anti-replay,when mutually verification is done.
 int send_data_safer(conn_info_t &conn_info, const char *data, int len, u32_t conv_num);  // a wrap for  send_safer for transfer data.
-// int reserved_parse_safer(conn_info_t &conn_info,const char * input,int input_len,char &type,char* &data,int &len);//subfunction for recv_safer,allow overlap
+int coalesce_flush(conn_info_t &conn_info);  // send what is waiting in blob->coalesce
+int fec_flush(conn_info_t &conn_info);       // repair frames of the current fec group
+int pacing_flush(conn_info_t &conn_info);    // raw packets of the pacing queue that the bucket allows now
+void pacing_clear(conn_info_t &conn_info);    // drop the pacing queue,ie the connection got new ids
+void send_flush_due();                       // --coalesce,--fec and --pacing-rate,flush every connection whose deadline has passed
+u64_t send_next_deadline();                  // in us,0 if nothing is waiting
+void pmtu_on_timer(conn_info_t &conn_info);  // starts a search when its due,retries or gives up a probe. called from the heartbeat timers
+void pmtu_on_hb(conn_info_t &conn_info, const char *data, int len);  // payload of a received heartbeat,acks a probe or moves our search on
+int coalesce_split(const char *data, int len, int frame_v2, vector<char> &type_arr, vector<string> &data_arr);  // payload of an 'm' frame into 'd' payloads
+int write_conv(int frame_v2, char *p, u32_t conv);                               // conv of a 'd' payload,4 bytes or a varint for frame v2. returns its len
+int push_data_payload(int frame_v2, const char *data, int len, vector<string> &data_arr);  // 'd' payload with its conv widened to 4 bytes
+int reserved_parse_safer(conn_info_t &conn_info, const char *input, int input_len, char &type, char *&data, int &len);  // subfunction for recv_safer,allow overlap
 
 // int recv_safer(conn_info_t &conn_info,char &type,char* &data,int &len);///safer transfer function with anti-replay,when mutually verification is done.
 
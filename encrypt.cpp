@@ -9,6 +9,7 @@
 #include "encrypt.h"
 #include "common.h"
 #include "log.h"
+#include "stats.h"
 
 // static uint64_t seq=1;
 
@@ -528,7 +529,7 @@ int decrypt_AE(const char *data, char *output, int &len /*,char * key*/) {
     return 0;
 }
 
-int my_encrypt(const char *data, char *output, int &len /*,char * key*/) {
+static int my_encrypt0(const char *data, char *output, int &len /*,char * key*/) {
     if (len < 0) {
         mylog(log_trace, "len<0");
         return -1;
@@ -555,7 +556,7 @@ int my_encrypt(const char *data, char *output, int &len /*,char * key*/) {
     return 0;
 }
 
-int my_decrypt(const char *data, char *output, int &len /*,char * key*/) {
+static int my_decrypt0(const char *data, char *output, int &len /*,char * key*/) {
     if (len < 0) return -1;
     if (len > max_data_len) {
         mylog(log_warn, "len>max_data_len");
@@ -577,6 +578,19 @@ int my_decrypt(const char *data, char *output, int &len /*,char * key*/) {
     return 0;
 }
 
+int my_encrypt(const char *data, char *output, int &len /*,char * key*/) {
+    u64_t lat = lat_begin(lat_encrypt);
+    int ret = my_encrypt0(data, output, len);
+    lat_record(lat_encrypt, lat);
+    return ret;
+}
+int my_decrypt(const char *data, char *output, int &len /*,char * key*/) {
+    u64_t lat = lat_begin(lat_decrypt);
+    int ret = my_decrypt0(data, output, len);
+    lat_record(lat_decrypt, lat);
+    return ret;
+}
+
 int encrypt_AEAD(uint8_t *data, uint8_t *output, int &len, uint8_t *key, uint8_t *header, int hlen) {
     // TODO
     return -1;
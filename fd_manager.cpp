@@ -6,48 +6,55 @@
  */
 
 #include "fd_manager.h"
-int fd_manager_t::fd_exist(int fd) {
-    return fd_to_fd64_mp.find(fd) != fd_to_fd64_mp.end();
-}
 int fd_manager_t::exist(fd64_t fd64) {
-    return fd64_to_fd_mp.find(fd64) != fd64_to_fd_mp.end();
+    return find_slot(fd64) != 0;
 }
 int fd_manager_t::to_fd(fd64_t fd64) {
     assert(exist(fd64));
-    return fd64_to_fd_mp[fd64];
+    return (int)(u32_t)fd64;
 }
 void fd_manager_t::fd64_close(fd64_t fd64) {
-    assert(exist(fd64));
-    int fd = fd64_to_fd_mp[fd64];
-    fd64_to_fd_mp.erase(fd64);
-    fd_to_fd64_mp.erase(fd);
-    if (exist_info(fd64)) {
-        fd_info_mp.erase(fd64);
-    }
+    fd_slot_t *slot = find_slot(fd64);
+    assert(slot != 0);
+    slot->used = 0;
+    slot->has_info = 0;
+    slot->info.p_conn_info = 0;
     // assert(close(fd)==0);
-    sock_close(fd);
+    sock_close((int)(u32_t)fd64);
 }
 void fd_manager_t::reserve(int n) {
-    fd_to_fd64_mp.reserve(n);
-    fd64_to_fd_mp.reserve(n);
-    fd_info_mp.reserve(n);
+    slots.reserve(n);
 }
 u64_t fd_manager_t::create(int fd) {
-    assert(!fd_exist(fd));
-    fd64_t fd64 = counter++;
-    fd_to_fd64_mp[fd] = fd64;
-    fd64_to_fd_mp[fd64] = fd;
-    return fd64;
+    assert(fd >= 0);
+    if ((u32_t)fd >= slots.size()) {
+        fd_slot_t empty;
+        memset(&empty, 0, sizeof(empty));
+        slots.resize(max((size_t)fd + 1, slots.size() * 2), empty);
+    }
+    fd_slot_t &slot = slots[fd];
+    assert(!slot.used);
+    slot.generation++;
+    if (slot.generation == 0) slot.generation++;  // keep fd64 > u32_t(-1)
+    slot.used = 1;
+    slot.has_info = 0;
+    return pack_u64(slot.generation, (u32_t)fd);
 }
 fd_manager_t::fd_manager_t() {
-    counter = u32_t(-1);
-    counter += 100;
     reserve(10007);
 }
-fd_info_t& fd_manager_t::get_info(fd64_t fd64) {
-    assert(exist(fd64));
-    return fd_info_mp[fd64];
+fd_info_t &fd_manager_t::get_info(fd64_t fd64) {
+    fd_slot_t *slot = find_slot(fd64);
+    assert(slot != 0);
+    slot->has_info = 1;
+    return slot->info;
+}
+fd_info_t *fd_manager_t::find_info(fd64_t fd64) {
+    fd_slot_t *slot = find_slot(fd64);
+    if (slot == 0 || !slot->has_info) return 0;
+    return &slot->info;
 }
 int fd_manager_t::exist_info(fd64_t fd64) {
-    return fd_info_mp.find(fd64) != fd_info_mp.end();
+    fd_slot_t *slot = find_slot(fd64);
+    return slot != 0 && slot->has_info;
 }
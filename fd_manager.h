@@ -19,8 +19,10 @@ struct fd_info_t {
 
 struct fd_manager_t  // conver fd to a uniq 64bit number,avoid fd value conflict caused by close and re-create
 // this class is not strictly necessary,it just makes epoll fd handling easier
+// fd64 is (generation<<32)|fd,slots are indexed by fd directly. generation is never 0,so fd64 is always larger than u32_t(-1)
 {
     fd_info_t &get_info(fd64_t fd64);
+    fd_info_t *find_info(fd64_t fd64);  // null if fd64 is stale or has no info,for the hot path of event dispatch
     int exist_info(fd64_t);
     int exist(fd64_t fd64);
     int to_fd(fd64_t);
@@ -30,13 +32,21 @@ struct fd_manager_t  // conver fd to a uniq 64bit number,avoid fd value conflict
     fd_manager_t();
 
    private:
-    u64_t counter;
-    unordered_map<int, fd64_t> fd_to_fd64_mp;
-    unordered_map<fd64_t, int> fd64_to_fd_mp;
-    unordered_map<fd64_t, fd_info_t> fd_info_mp;
-    int fd_exist(int fd);
-    // void remove_fd(int fd);
-    // fd64_t fd_to_fd64(int fd);
+    struct fd_slot_t {
+        u32_t generation;  // bumped on every create
+        uint8_t used;
+        uint8_t has_info;
+        fd_info_t info;
+    };
+    vector<fd_slot_t> slots;
+    fd_slot_t *find_slot(fd64_t fd64)  // null if fd64 is stale
+    {
+        u32_t fd = (u32_t)fd64;
+        if (fd >= slots.size()) return 0;
+        fd_slot_t &slot = slots[fd];
+        if (!slot.used || slot.generation != (u32_t)(fd64 >> 32u)) return 0;
+        return &slot;
+    }
 };
 
 extern fd_manager_t fd_manager;
@@ -0,0 +1,370 @@
+/*
+ * fec.cpp
+ *
+ *  GF(2^8) with polynomial 0x11d. the hot loop is dst^=c*src,done with two 16 entry tables per coefficient
+ *  (products of the low and the high nibble) and a byte shuffle: pshufb on SSSE3/AVX2,tbl on NEON
+ */
+
+#include "fec.h"
+#include "log.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GF_HAVE_X86
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define GF_HAVE_NEON
+#endif
+
+int fec_data_num = 0;
+int fec_parity_num = 0;
+int fec_timeout_ms = 8;
+
+static int gf_inited = 0;
+static u8_t gf_exp[512];
+static u8_t gf_log[256];
+static u8_t gf_mul_table[256][256];
+static u8_t gf_nibble_lo[256][16];  // c*i
+static u8_t gf_nibble_hi[256][16];  // c*(i<<4)
+
+gf_mul_add_t gf_mul_add = gf_mul_add_scalar;
+const char *gf_kernel_name = "scalar";
+
+u8_t gf_mul(u8_t a, u8_t b) {
+    return gf_mul_table[a][b];
+}
+u8_t gf_inv(u8_t a) {
+    assert(a != 0);
+    return gf_exp[255 - gf_log[a]];
+}
+void gf_mul_add_scalar(u8_t *dst, const u8_t *src, u8_t c, int len) {
+    if (c == 0) return;
+    const u8_t *row = gf_mul_table[c];
+    for (int i = 0; i < len; i++) dst[i] ^= row[src[i]];
+}
+
+#ifdef GF_HAVE_X86
+__attribute__((target("ssse3"))) static void gf_mul_add_ssse3(u8_t *dst, const u8_t *src, u8_t c, int len) {
+    if (c == 0) return;
+    const __m128i lo = _mm_loadu_si128((const __m128i *)gf_nibble_lo[c]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)gf_nibble_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+__attribute__((target("avx2"))) static void gf_mul_add_avx2(u8_t *dst, const u8_t *src, u8_t c, int len) {
+    if (c == 0) return;
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nibble_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nibble_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+#ifdef GF_HAVE_NEON
+static void gf_mul_add_neon(u8_t *dst, const u8_t *src, u8_t c, int len) {
+    if (c == 0) return;
+    const uint8x16_t lo = vld1q_u8(gf_nibble_lo[c]);
+    const uint8x16_t hi = vld1q_u8(gf_nibble_hi[c]);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t l = vqtbl1q_u8(lo, vandq_u8(s, mask));
+        uint8x16_t h = vqtbl1q_u8(hi, vshrq_n_u8(s, 4));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(l, h)));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+int gf_kernels(gf_kernel_t *kernels) {
+    int n = 0;
+    kernels[n].name = "scalar";
+    kernels[n++].fn = gf_mul_add_scalar;
+#ifdef GF_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels[n].name = "ssse3";
+        kernels[n++].fn = gf_mul_add_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[n].name = "avx2";
+        kernels[n++].fn = gf_mul_add_avx2;
+    }
+#endif
+#ifdef GF_HAVE_NEON
+    kernels[n].name = "neon";
+    kernels[n++].fn = gf_mul_add_neon;
+#endif
+    return n;
+}
+
+void fec_init() {
+    if (gf_inited) return;
+    gf_inited = 1;
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) gf_exp[i] = gf_exp[i - 255];
+    for (int a = 0; a < 256; a++)
+        for (int b = 0; b < 256; b++)
+            gf_mul_table[a][b] = (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+    for (int c = 0; c < 256; c++)
+        for (int i = 0; i < 16; i++) {
+            gf_nibble_lo[c][i] = gf_mul_table[c][i];
+            gf_nibble_hi[c][i] = gf_mul_table[c][i << 4];
+        }
+    gf_kernel_t kernels[8];
+    int n = gf_kernels(kernels);
+    gf_mul_add = kernels[n - 1].fn;  // the last one is the widest
+    gf_kernel_name = kernels[n - 1].name;
+}
+
+u8_t fec_coef(int parity_index, int data_index) {
+    return gf_inv((u8_t)((255 - parity_index) ^ data_index));
+}
+
+int fec_recover(int data_num, int shard_len, const int *rows, const u8_t *const *in, int missing_num, const int *missing, u8_t *const *out) {
+    const int k = data_num;
+    vector<u8_t> a(k * k, 0), b(k * k, 0);  // b becomes the inverse of a
+    for (int i = 0; i < k; i++) {
+        b[i * k + i] = 1;
+        if (rows[i] < k) {
+            a[i * k + rows[i]] = 1;
+        } else {
+            for (int j = 0; j < k; j++) a[i * k + j] = fec_coef(rows[i] - k, j);
+        }
+    }
+    for (int col = 0; col < k; col++) {  // gauss-jordan
+        int pivot = col;
+        while (pivot < k && a[pivot * k + col] == 0) pivot++;
+        if (pivot == k) return -1;
+        if (pivot != col) {
+            swap_ranges(a.begin() + pivot * k, a.begin() + pivot * k + k, a.begin() + col * k);
+            swap_ranges(b.begin() + pivot * k, b.begin() + pivot * k + k, b.begin() + col * k);
+        }
+        u8_t inv = gf_inv(a[col * k + col]);
+        for (int j = 0; j < k; j++) {
+            a[col * k + j] = gf_mul(a[col * k + j], inv);
+            b[col * k + j] = gf_mul(b[col * k + j], inv);
+        }
+        for (int r = 0; r < k; r++) {
+            u8_t f = a[r * k + col];
+            if (r == col || f == 0) continue;
+            gf_mul_add(&a[r * k], &a[col * k], f, k);
+            gf_mul_add(&b[r * k], &b[col * k], f, k);
+        }
+    }
+    for (int m = 0; m < missing_num; m++) {
+        memset(out[m], 0, shard_len);
+        for (int i = 0; i < k; i++) gf_mul_add(out[m], in[i], b[missing[m] * k + i], shard_len);
+    }
+    return 0;
+}
+
+void fec_write_header(char *p, u32_t group_id, int index, int data_num, int parity_num) {
+    u32_t n_group_id = htonl(group_id);
+    memcpy(p, &n_group_id, sizeof(n_group_id));
+    p[4] = (char)index;
+    p[5] = (char)data_num;
+    p[6] = (char)parity_num;
+}
+void fec_read_header(const char *p, u32_t &group_id, int &index, int &data_num, int &parity_num) {
+    memcpy(&group_id, p, sizeof(group_id));
+    group_id = ntohl(group_id);
+    index = (u8_t)p[4];
+    data_num = (u8_t)p[5];
+    parity_num = (u8_t)p[6];
+}
+
+fec_encoder_t::fec_encoder_t() {
+    group_id = get_true_random_number();
+    data_cnt = 0;
+    shard_len = 0;
+    deadline = 0;
+}
+int fec_encoder_t::add(char type, const char *data, int len, char *header) {
+    assert(len + 3 <= fec_shard_cap && data_cnt < fec_data_num);
+    if (parity.empty()) parity.resize(fec_parity_num * fec_shard_cap);
+    u8_t shard[fec_shard_cap];
+    write_u16((char *)shard, 1 + len);
+    shard[2] = type;
+    memcpy(shard + 3, data, len);
+    for (int p = 0; p < fec_parity_num; p++) gf_mul_add(&parity[p * fec_shard_cap], shard, fec_coef(p, data_cnt), len + 3);
+    if (len + 3 > shard_len) shard_len = len + 3;
+
+    fec_write_header(header, group_id, data_cnt, fec_data_num, fec_parity_num);
+    if (data_cnt++ == 0) deadline = get_current_time_us() + fec_timeout_ms * 1000llu;
+    return data_cnt >= fec_data_num;
+}
+int fec_encoder_t::repair_frame(int parity_index, char *output) {
+    fec_write_header(output, group_id, parity_index, data_cnt, fec_parity_num);
+    memcpy(output + fec_header_len, &parity[parity_index * fec_shard_cap], shard_len);
+    return fec_header_len + shard_len;
+}
+void fec_encoder_t::next_group() {
+    for (int p = 0; p < fec_parity_num && !parity.empty(); p++) memset(&parity[p * fec_shard_cap], 0, shard_len);
+    group_id++;
+    data_cnt = 0;
+    shard_len = 0;
+    deadline = 0;
+}
+
+static void group_release(fec_group_t &group) {
+    vector<string>().swap(group.shards);
+}
+static int group_delivered(const fec_group_t &group, int index) {
+    return (group.delivered[index / 64] >> (index % 64)) & 1;
+}
+static void group_set_delivered(fec_group_t &group, int index) {
+    group.delivered[index / 64] |= 1llu << (index % 64);
+}
+int fec_decoder_t::add(const char *frame, int len, int is_repair, vector<string> &rebuilt) {
+    if (len < fec_header_len + 3) return -1;
+    u32_t group_id;
+    int index, data_num, parity_num;
+    fec_read_header(frame, group_id, index, data_num, parity_num);
+    if (data_num < 1 || data_num > fec_max_data_num || parity_num < 1 || parity_num > fec_max_parity_num) return -1;
+    if (index >= (is_repair ? parity_num : data_num)) return -1;
+    const char *shard = frame + fec_header_len;
+    int shard_len = len - fec_header_len;
+
+    if (groups.empty()) groups.resize(fec_group_slots);
+    fec_group_t &group = groups[group_id % fec_group_slots];
+    if (!group.used || group.group_id != group_id) {  // a new group,whatever was in the slot is given up
+        group_release(group);
+        group.shards.resize(data_num + parity_num);
+        group.data_cap = data_num;
+        group.parity_num = parity_num;
+        group.group_id = group_id;
+        group.used = 1;
+        group.done = 0;
+        group.data_num = 0;
+        group.shard_len = 0;
+        group.data_got = 0;
+        group.parity_got = 0;
+        memset(group.delivered, 0, sizeof(group.delivered));
+    }
+    if (!is_repair && group_delivered(group, index)) return fec_duplicate;
+    if (group.done) {
+        if (!is_repair) group_set_delivered(group, index);  // the caller passes it up
+        return 0;
+    }
+    if (parity_num != group.parity_num) return -1;
+    if (is_repair ? data_num > group.data_cap : index >= group.data_cap) return -1;  // doesnt fit the group as sized by its first frame
+
+    if (is_repair) {
+        string &slot = group.shards[group.data_cap + index];
+        if (!slot.empty()) return 0;
+        if (group.data_num != 0 && (group.data_num != data_num || group.shard_len != shard_len)) return -1;
+        group.data_num = data_num;  // the real number of data shards,the group may have been cut by --fec-timeout
+        group.shard_len = shard_len;
+        slot.assign(shard, shard_len);
+        group.parity_got++;
+    } else {
+        string &slot = group.shards[index];
+        group_set_delivered(group, index);  // the caller passes it up
+        slot.resize(2 + shard_len);  // data frame carries type+payload,the shard has their u16 len in front
+        write_u16(&slot[0], shard_len);
+        memcpy(&slot[2], shard, shard_len);
+        group.data_got++;
+        if (group.data_got >= data_num) {  // a full group without loss
+            group.done = 1;
+            group_release(group);
+            return 0;
+        }
+    }
+    return try_recover(group, rebuilt);
+}
+int fec_decoder_t::try_recover(fec_group_t &group, vector<string> &rebuilt) {
+    const int k = group.data_num;
+    if (k == 0) return 0;
+    int data_present = 0;
+    for (int j = 0; j < k; j++) data_present += !group.shards[j].empty();
+    if (data_present == k) {
+        group.done = 1;
+        group_release(group);
+        return 0;
+    }
+    if (data_present + group.parity_got < k) return 0;
+
+    int shard_len = group.shard_len;
+    vector<int> rows, missing;
+    vector<const u8_t *> in;
+    vector<u8_t> padded(data_present * shard_len, 0);  // data shards zero extended to the parity len
+    for (int j = 0; j < k; j++) {
+        string &s = group.shards[j];
+        if (s.empty()) {
+            missing.push_back(j);
+            continue;
+        }
+        if ((int)s.size() > shard_len) {
+            mylog(log_debug, "fec data shard longer than parity,group %u given up\n", group.group_id);
+            group.done = 1;
+            group_release(group);
+            return -1;
+        }
+        u8_t *p = &padded[rows.size() * shard_len];
+        memcpy(p, s.c_str(), s.size());
+        rows.push_back(j);
+        in.push_back(p);
+    }
+    for (int p = 0; p < group.parity_num && (int)rows.size() < k; p++) {
+        string &s = group.shards[group.data_cap + p];
+        if (s.empty()) continue;
+        rows.push_back(k + p);
+        in.push_back((const u8_t *)s.c_str());
+    }
+    vector<u8_t> out_buf(missing.size() * shard_len);
+    vector<u8_t *> out;
+    for (int m = 0; m < (int)missing.size(); m++) out.push_back(&out_buf[m * shard_len]);
+    if (fec_recover(k, shard_len, &rows[0], &in[0], missing.size(), &missing[0], &out[0]) != 0) {
+        mylog(log_debug, "fec group %u can not be recovered\n", group.group_id);
+        group.done = 1;
+        group_release(group);
+        return -1;
+    }
+    int cnt = 0;
+    for (int m = 0; m < (int)missing.size(); m++) {
+        int inner_len = read_u16((char *)out[m]);
+        if (inner_len < 1 || inner_len + 2 > shard_len) {
+            mylog(log_debug, "fec rebuilt shard has bad len %d\n", inner_len);
+            continue;
+        }
+        rebuilt.emplace_back((char *)out[m] + 2, inner_len);
+        group_set_delivered(group, missing[m]);
+        cnt++;
+    }
+    group.done = 1;
+    group_release(group);
+    return cnt;
+}
+u64_t fec_decoder_t::memory_bytes() {
+    u64_t bytes = groups.capacity() * sizeof(fec_group_t);
+    for (int i = 0; i < (int)groups.size(); i++) {
+        bytes += groups[i].shards.capacity() * sizeof(string);
+        for (int j = 0; j < (int)groups[i].shards.size(); j++) bytes += groups[i].shards[j].capacity();
+    }
+    return bytes;
+}
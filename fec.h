@@ -0,0 +1,91 @@
+/*
+ * fec.h
+ *
+ *  reed-solomon erasure code over GF(2^8) for --fec. a group is up to data_num data shards plus parity_num parity
+ *  shards,any data_num of them rebuild the group. the code is systematic with a cauchy matrix,so data shards go out
+ *  untouched and parity is accumulated while the group fills up
+ */
+
+#ifndef FEC_H_
+#define FEC_H_
+
+#include "common.h"
+
+typedef unsigned char u8_t;
+
+extern int fec_data_num;    // --fec,0 disables
+extern int fec_parity_num;
+extern int fec_timeout_ms;  // --fec-timeout,a group that is not full by then gets its parity anyway
+
+const int fec_max_data_num = 128;
+const int fec_max_parity_num = 64;
+const int fec_header_len = 7;                     // u32 group,u8 index,u8 data_num,u8 parity_num
+const int fec_shard_cap = 2 + 1 + max_data_len + 4;  // u16 len,type of the inner frame,payload of a 'd' or 'm' frame
+const int fec_group_slots = 32;                   // groups a receiver keeps,an older one is given up when its slot is reused
+const int fec_duplicate = -2;                     // fec_decoder_t::add,a data frame that was delivered or rebuilt already
+
+typedef void (*gf_mul_add_t)(u8_t *dst, const u8_t *src, u8_t c, int len);  // dst^=c*src
+
+struct gf_kernel_t {
+    const char *name;
+    gf_mul_add_t fn;
+};
+
+extern gf_mul_add_t gf_mul_add;  // best kernel of this cpu,picked by fec_init()
+extern const char *gf_kernel_name;
+
+void fec_init();  // tables and kernel choice,can be called more than once
+u8_t gf_mul(u8_t a, u8_t b);
+u8_t gf_inv(u8_t a);
+void gf_mul_add_scalar(u8_t *dst, const u8_t *src, u8_t c, int len);
+int gf_kernels(gf_kernel_t *kernels);  // every kernel this cpu supports,scalar first. for unit test and bench,returns the number
+
+u8_t fec_coef(int parity_index, int data_index);  // cauchy matrix,1/(x_p ^ y_d) with x_p=255-p,y_d=d
+int fec_recover(int data_num, int shard_len, const int *rows, const u8_t *const *in, int missing_num, const int *missing, u8_t *const *out);
+// rows[i]<data_num means in[i] is that data shard,otherwise in[i] is parity shard rows[i]-data_num. data_num rows are needed,
+// out[i] receives data shard missing[i]. returns -1 if the rows dont form a group
+
+void fec_write_header(char *p, u32_t group_id, int index, int data_num, int parity_num);
+void fec_read_header(const char *p, u32_t &group_id, int &index, int &data_num, int &parity_num);
+
+struct fec_encoder_t  // sender side of a connection,parity of the current group
+{
+    u32_t group_id;
+    int data_cnt;    // data shards in current group
+    int shard_len;   // longest shard of current group
+    u64_t deadline;  // in us,when the group gets its parity even if its not full. 0 if the group is empty
+    vector<u8_t> parity;  // fec_parity_num*fec_shard_cap,allocated on first use
+
+    fec_encoder_t();
+    int add(char type, const char *data, int len, char *header);  // header of the data frame is written to header,returns 1 if the group is full
+    int repair_frame(int parity_index, char *output);              // header + parity shard of current group,returns its len
+    void next_group();
+};
+
+struct fec_group_t {
+    u32_t group_id;
+    int used;
+    int done;        // all data shards delivered or rebuilt,later shards are ignored
+    int data_num;    // from a repair frame,0 if none arrived yet
+    int shard_len;   // of repair frames
+    int data_got;
+    int parity_got;
+    int data_cap;     // data_num in the header of the first frame,data shards the group can hold
+    int parity_num;
+    u64_t delivered[fec_max_data_num / 64];  // bitmap of data shards passed up,received or rebuilt. kept after the shards are freed,
+                                             // so that a late original of a rebuilt shard is not delivered twice
+    vector<string> shards;  // data_cap data shards first,then parity at data_cap+index. empty if not received,
+                            // sized when the group starts and freed when it is done
+};
+
+struct fec_decoder_t  // receiver side of a connection
+{
+    vector<fec_group_t> groups;  // fec_group_slots of them,allocated on first use
+
+    int add(const char *frame, int len, int is_repair, vector<string> &rebuilt);  // rebuilt gets type+payload of the lost data frames,
+    // returns -1 if the frame is malformed,fec_duplicate if its payload must not be passed up again
+    int try_recover(fec_group_t &group, vector<string> &rebuilt);
+    u64_t memory_bytes();
+};
+
+#endif /* FEC_H_ */
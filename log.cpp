@@ -6,52 +6,134 @@ int log_level = log_info;
 int enable_log_position = 0;
 int enable_log_color = 1;
 
+static int log_async = 0;
+static pthread_t log_main_thread;
+static pthread_t log_writer_thread;
+static spsc_ring_t log_ring;  // main thread -> writer thread
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;  // mutex+condvar rather than sem_t,unnamed
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;     // semaphores are missing on macos
+static int log_wake_pending = 0;  // set when the writer parked on an empty ring and a push arrived
+static u32_t log_dropped_reported = 0;
+
+static void *log_writer_entry(void *none) {
+    for (;;) {
+        char *p;
+        int len;
+        if (!log_ring.peek(p, len)) {
+            fflush(stdout);
+            if (log_ring.park()) {
+                pthread_mutex_lock(&log_wake_mutex);
+                while (!log_wake_pending) pthread_cond_wait(&log_wake_cond, &log_wake_mutex);
+                log_wake_pending = 0;
+                pthread_mutex_unlock(&log_wake_mutex);
+            }
+            continue;
+        }
+        fwrite(p, 1, len, stdout);
+        log_ring.pop();
+    }
+    return 0;
+}
+int log_async_start() {
+    if (log_async) return 0;  // options are processed twice
+    log_ring.init(4096, 256);
+    log_main_thread = pthread_self();
+    if (pthread_create(&log_writer_thread, 0, log_writer_entry, 0) != 0) {
+        return -1;
+    }
+    log_async = 1;
+    return 0;
+}
+void log_flush() {
+    if (!log_async) {
+        fflush(stdout);
+        return;
+    }
+    for (int i = 0; i < 1000; i++) {  // at most ~1s
+        if (log_ring.head.load() == log_ring.tail.load()) break;
+        usleep(1000);
+    }
+    fflush(stdout);
+}
+static void log_write(const char* buf, int len) {
+    if (log_async && pthread_equal(pthread_self(), log_main_thread)) {  // ring has a single producer,other threads write directly
+        u32_t dropped = log_ring.dropped;
+        if (dropped != log_dropped_reported) {
+            char tmp[100];
+            int tmp_len = snprintf(tmp, sizeof(tmp), "[%u log lines dropped,writer too slow]\n", dropped - log_dropped_reported);
+            if (log_ring.push(tmp, tmp_len) != -1) log_dropped_reported = dropped;
+        }
+        int ret = log_ring.push(buf, len);
+        if (ret == 1) {
+            pthread_mutex_lock(&log_wake_mutex);
+            log_wake_pending = 1;
+            pthread_cond_signal(&log_wake_cond);
+            pthread_mutex_unlock(&log_wake_mutex);
+        }
+        return;
+    }
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+}
+static int log_format(char* buf, int size, const char* str, va_list vlist)  // append,returns bytes written,truncated at size
+{
+    int ret = vsnprintf(buf, size, str, vlist);
+    if (ret < 0) return 0;
+    return ret < size ? ret : size - 1;
+}
+
 void log0(const char* file, const char* function, int line, int level, const char* str, ...) {
     if (level > log_level) return;
     if (level > log_trace || level < 0) return;
 
+    static time_t last_timer = 0;  // strftime only once per second
+    static char time_buf[100];
     time_t timer;
-    char buffer[100];
-    struct tm* tm_info;
-
     time(&timer);
-    tm_info = localtime(&timer);
+    if (timer != last_timer) {
+        struct tm* tm_info = localtime(&timer);
+        strftime(time_buf, 100, "%Y-%m-%d %H:%M:%S", tm_info);
+        last_timer = timer;
+    }
 
+    char buf[4096];
+    int len = 0;
     if (enable_log_color)
-        printf("%s", log_color[level]);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s", log_color[level]);
 
-    strftime(buffer, 100, "%Y-%m-%d %H:%M:%S", tm_info);
-    printf("[%s][%s]", buffer, log_text[level]);
+    len += snprintf(buf + len, sizeof(buf) - len, "[%s][%s]", time_buf, log_text[level]);
 
-    if (enable_log_position) printf("[%s,func:%s,line:%d]", file, function, line);
+    if (enable_log_position) len += snprintf(buf + len, sizeof(buf) - len, "[%s,func:%s,line:%d]", file, function, line);
 
     va_list vlist;
     va_start(vlist, str);
-    vfprintf(stdout, str, vlist);
+    len += log_format(buf + len, sizeof(buf) - len - sizeof(RESET), str, vlist);
     va_end(vlist);
     if (enable_log_color)
-        printf("%s", RESET);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s", RESET);
 
     // printf("\n");
     // if(enable_log_color)
     // printf(log_color[level]);
-    fflush(stdout);
+    log_write(buf, len);
 
     if (log_level == log_fatal) {
         about_to_exit = 1;
     }
 }
 
-void log_bare(int level, const char* str, ...) {
+void log_bare0(int level, const char* str, ...) {
     if (level > log_level) return;
     if (level > log_trace || level < 0) return;
+    char buf[4096];
+    int len = 0;
     if (enable_log_color)
-        printf("%s", log_color[level]);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s", log_color[level]);
     va_list vlist;
     va_start(vlist, str);
-    vfprintf(stdout, str, vlist);
+    len += log_format(buf + len, sizeof(buf) - len - sizeof(RESET), str, vlist);
     va_end(vlist);
     if (enable_log_color)
-        printf("%s", RESET);
-    fflush(stdout);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s", RESET);
+    log_write(buf, len);
 }
@@ -35,13 +35,27 @@ extern int enable_log_color;
 #define mylog(__first_argu__dummy_abcde__, ...) printf(__VA_ARGS__)
 
 #else
-#define mylog(...) log0(__FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
+// level is checked before the call,so arguments are not evaluated for a disabled level
+#define mylog(__level__, ...)                                                  \
+    do {                                                                       \
+        if ((__level__) <= log_level)                                          \
+            log0(__FILE__, __FUNCTION__, __LINE__, (__level__), __VA_ARGS__);  \
+    } while (0)
 #endif
 
 //#define mylog(__first_argu__dummy_abcde__,...) {;}
 
+#define log_bare(__level__, ...)                        \
+    do {                                                \
+        if ((__level__) <= log_level)                   \
+            log_bare0((__level__), __VA_ARGS__);        \
+    } while (0)
+
 void log0(const char* file, const char* function, int line, int level, const char* str, ...);
 
-void log_bare(int level, const char* str, ...);
+void log_bare0(int level, const char* str, ...);
+
+int log_async_start();  // --log-async,hand formatted lines to a writer thread
+void log_flush();       // wait until the writer thread has written everything,called before exit
 
 #endif
@@ -23,6 +23,7 @@ void sigint_cb(struct ev_loop *l, ev_signal *w, int revents) {
 
 int client_event_loop();
 int server_event_loop();
+int server_replay_pcap();
 
 int main(int argc, char *argv[]) {
     assert(sizeof(unsigned short) == 2);
@@ -84,7 +85,14 @@ int main(int argc, char *argv[]) {
 
     my_init_keys(key_string, program_mode == client_mode ? 1 : 0);
 
+    fec_init();
+    if (fec_data_num != 0) mylog(log_info, "fec %d:%d,timeout %dms,gf kernel:%s\n", fec_data_num, fec_parity_num, fec_timeout_ms, gf_kernel_name);
+
 #ifdef UDP2RAW_LINUX
+    if (program_mode == server_mode && replay_file[0] != 0) {  // offline,no raw socket and no iptables rule
+        server_replay_pcap();
+        myexit(0);
+    }
     iptables_rule();
     init_raw_socket();
 #endif
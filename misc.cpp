@@ -11,6 +11,7 @@
 #include "network.h"
 #include "connection.h"
 #include "fd_manager.h"
+#include "timer_wheel.h"
 
 int hb_mode = 1;
 int hb_len = 1200;
@@ -28,6 +29,8 @@ int ttl_value = 64;
 
 fd_manager_t fd_manager;
 
+timer_wheel_t timer_wheel;
+
 // char remote_address[max_address_len]="";
 // char local_ip[100]="0.0.0.0", remote_ip[100]="255.255.255.255",source_ip[100]="0.0.0.0";//local_ip is for -l option,remote_ip for -r option,source for --source-ip
 // u32_t local_ip_uint32,remote_ip_uint32,source_ip_uint32;//convert from last line.
@@ -48,7 +51,7 @@ int udp_fd = -1;   // for client only. client use this fd to listen and handle u
 int bind_fd = -1;  // bind only,never send or recv.  its just a dummy fd for bind,so that other program wont occupy the same port
 #ifdef UDP2RAW_LINUX
 int epollfd = -1;   // fd for epoll
-int timer_fd = -1;  // the general timer fd for client and server.for server this is not the only timer find,every connection has a timer fd.
+int timer_fd = -1;  // the general timer fd for client and server.for server it drives the timer wheel
 #endif
 int fail_time_counter = 0;      // determine if the max_fail_time is reached
 int epoll_trigger_counter = 0;  // for debug only
@@ -87,6 +90,11 @@ unordered_map<int, const char *> raw_mode_tostring = {{mode_faketcp, "faketcp"},
 int about_to_exit = 0;
 
 int socket_buf_size = 1024 * 1024;
+int udp_offload = 0;  // UDP_GRO/UDP_SEGMENT on client's udp_fd
+int upstream_pool_size = 0;  // server only,0 means one connected udp socket per conv
+char metrics_sock[1000] = "";  // unix socket path for prometheus,empty means disabled
+char replay_file[1000] = "";   // hidden option --replay-pcap,server only
+int replay_loops = 1;
 // int force_socket_buf=0;
 
 // char lower_level_arg[1000];
@@ -146,25 +154,55 @@ void print_help() {
     printf("    -g,--gen-rule                         generate iptables rule then exit,so that you can copy and\n");
     printf("                                          add it manually.overrides -a\n");
     printf("    --disable-anti-replay                 disable anti-replay,not suggested\n");
+    printf("    --anti-replay-window  <number>        size of anti-replay window in packets,rounded up to a power of 2,\n");
+    printf("                                          default:4000. raise it if reordering on a fast link causes replay drops\n");
     printf("    --fix-gro                             try to fix huge packet caused by GRO. this option is at an early stage.\n");
     printf("                                          make sure client and server are at same version.\n");
+    printf("    --coalesce            <number>        let small datagrams wait up to <number> microseconds,so that several\n");
+    printf("                                          of them share one raw packet. 0 disables(default). trades latency for pps,\n");
+    printf("                                          the receiving side must be at same version\n");
+    printf("    --coalesce-size       <number>        max bytes of datagrams in one coalesced raw packet,default:1200\n");
+    printf("    --fec                 <x:y>           reed-solomon fec,every x data packets are followed by y repair packets,\n");
+    printf("                                          any x of the x+y rebuild the group. ie 10:3. disabled by default,\n");
+    printf("                                          the receiving side must be at same version\n");
+    printf("    --fec-timeout         <number>        ms a group waits to be filled before its repair packets are sent,default:8\n");
+    printf("    --pacing-rate         <number>        Mbit/s a connection sends at most,bursts above it are queued and sent\n");
+    printf("                                          evenly. 0 disables(default)\n");
+    printf("    --pacing-burst        <number>        bytes that may go out back to back before pacing starts,default:6000\n");
+    printf("    --pmtu-probe          <number>        probe the path mtu with padded heartbeats every <number> seconds,\n");
+    printf("                                          default:600. 0 disables. the peer must be at same version to answer\n");
+    printf("    --hb-mode             <number>        0:empty heart-beats,data also counts as one\n");
+    printf("                                          1:heart-beats padded to hb-len every 600ms(default)\n");
+    printf("                                          2:adaptive,no heart-beat while data is sent,empty ones when idle.\n");
+    printf("                                          falls back to 1 if the peer is older\n");
 
     // printf("\n");
     printf("client options:\n");
     printf("    --source-ip           <ip>            force source-ip for raw socket\n");
     printf("    --source-port         <port>          force source-port for raw socket,tcp/udp only\n");
     printf("                                          this option disables port changing while re-connecting\n");
+    printf("    --frame-v2                            ask the server for the compact frame format,about 10 bytes less\n");
+    printf("                                          per data packet.\n");
+    printf("                                          falls back to the old format if the server is older\n");
+    printf("    --disable-resume                      dont resume the last session with a ticket after a timeout,always do\n");
+    printf("                                          a full handshake\n");
     //	printf("                                          \n");
     printf("other options:\n");
     printf("    --conf-file           <string>        read options from a configuration file instead of command line.\n");
     printf("                                          check example.conf in repo for format\n");
     printf("    --fifo                <string>        use a fifo(named pipe) for sending commands to the running program,\n");
     printf("                                          check readme.md in repository for supported commands.\n");
+    printf("    --metrics-sock        <string>        serve counters in prometheus text format on a unix socket,\n");
+    printf("                                          ie:curl --unix-socket <string> http://localhost/metrics\n");
+    printf("    --latency-hist        <number>        keep latency histograms of the packet path stages,sampling one of every\n");
+    printf("                                          <number> packets per stage,1 means all,16 costs well under 1%% throughput.\n");
+    printf("                                          dump them with the fifo command 'latency' or via --metrics-sock\n");
     printf("    --log-level           <number>        0:never    1:fatal   2:error   3:warn \n");
     printf("                                          4:info (default)     5:debug   6:trace\n");
     //	printf("\n");
     printf("    --log-position                        enable file name,function name,line number in log\n");
     printf("    --disable-color                       disable log color\n");
+    printf("    --log-async                           write log from a background thread,so slow stdout wont stall packets\n");
     printf("    --disable-bpf                         disable the kernel space filter,most time its not necessary\n");
     printf("                                          unless you suspect there is a bug\n");
 //	printf("\n");
@@ -191,6 +229,11 @@ void print_help() {
     printf("    --mtu-warn            <number>        mtu warning threshold, unit:byte, default:1375\n");
     printf("    --clear                               clear any iptables rules added by this program.overrides everything\n");
     printf("    --retry-on-error                      retry on error, allow to start udp2raw before network is initialized\n");
+    printf("    --udp-offload                         client only,use UDP_GRO/UDP_SEGMENT on the local udp socket,needs linux 5.0+\n");
+    printf("    --upstream-pool       <number>        server only,serve convs from a pool of at most <number> recycled upstream udp\n");
+    printf("                                          sockets instead of creating one socket per conv.a released socket rests 5s\n");
+    printf("                                          before it serves another conv.convs beyond the pool are refused\n");
+    printf("    --coarse-clock                        use CLOCK_MONOTONIC_COARSE for internal time,cheaper but only ~4ms precision\n");
     printf("    -h,--help                             print this help message\n");
     // printf("common options,these options must be same on both side\n");
 }
@@ -241,6 +284,10 @@ int process_log_level(int argc, char *argv[])  // process  --log-level and --dis
         if (strcmp(argv[i], "--log-position") == 0) {
             enable_log_position = 1;
         }
+        if (strcmp(argv[i], "--log-async") == 0 && log_async_start() != 0) {
+            log_bare(log_fatal, "failed to start log writer thread\n");
+            myexit(-1);
+        }
     }
     return 0;
 }
@@ -264,8 +311,10 @@ void process_arg(int argc, char *argv[])  // process all options
             {"disable-color", no_argument, 0, 1},
             {"enable-color", no_argument, 0, 1},
             {"log-position", no_argument, 0, 1},
+            {"log-async", no_argument, 0, 1},
             {"disable-bpf", no_argument, 0, 1},
             {"disable-anti-replay", no_argument, 0, 1},
+            {"anti-replay-window", required_argument, 0, 1},
             {"auto-rule", no_argument, 0, 'a'},
             {"gen-rule", no_argument, 0, 'g'},
             {"gen-add", no_argument, 0, 1},
@@ -296,6 +345,22 @@ void process_arg(int argc, char *argv[])  // process all options
             {"no-pcap-mutex", no_argument, 0, 1},
 #endif
             {"fix-gro", no_argument, 0, 1},
+            {"coalesce", required_argument, 0, 1},
+            {"coalesce-size", required_argument, 0, 1},
+            {"frame-v2", no_argument, 0, 1},
+            {"disable-resume", no_argument, 0, 1},
+            {"pmtu-probe", required_argument, 0, 1},
+            {"pacing-rate", required_argument, 0, 1},
+            {"pacing-burst", required_argument, 0, 1},
+            {"fec", required_argument, 0, 1},
+            {"fec-timeout", required_argument, 0, 1},
+            {"coarse-clock", no_argument, 0, 1},
+            {"upstream-pool", required_argument, 0, 1},
+            {"udp-offload", no_argument, 0, 1},
+            {"metrics-sock", required_argument, 0, 1},
+            {"latency-hist", required_argument, 0, 1},
+            {"replay-pcap", required_argument, 0, 1},
+            {"replay-loops", required_argument, 0, 1},
             {NULL, 0, 0, 0}};
 
     process_log_level(argc, argv);
@@ -584,6 +649,8 @@ void process_arg(int argc, char *argv[])  // process all options
                     // enable_log_color=0;
                 } else if (strcmp(long_options[option_index].name, "log-position") == 0) {
                     // enable_log_position=1;
+                } else if (strcmp(long_options[option_index].name, "log-async") == 0) {
+                    // handled in process_log_level()
                 } else if (strcmp(long_options[option_index].name, "force-sock-buf") == 0) {
                     if (is_udp2raw_mp) {
                         mylog(log_fatal, "--force-sock-buf not supported in this version\n");
@@ -598,6 +665,15 @@ void process_arg(int argc, char *argv[])  // process all options
                     disable_bpf_filter = 1;
                 } else if (strcmp(long_options[option_index].name, "disable-anti-replay") == 0) {
                     disable_anti_replay = 1;
+                } else if (strcmp(long_options[option_index].name, "anti-replay-window") == 0) {
+                    int size = 0;
+                    sscanf(optarg, "%d", &size);
+                    if (size < 64 || size > 4 * 1024 * 1024) {
+                        mylog(log_fatal, "anti-replay-window must be >=64 and <=%d\n", 4 * 1024 * 1024);
+                        myexit(-1);
+                    }
+                    anti_replay_window_size = size;
+                    mylog(log_info, "anti_replay_window_size=%u\n", anti_replay_window_size);
                 } else if (strcmp(long_options[option_index].name, "sock-buf") == 0) {
                     int tmp = -1;
                     sscanf(optarg, "%d", &tmp);
@@ -633,7 +709,10 @@ void process_arg(int argc, char *argv[])  // process all options
                     mylog(log_info, "configuration loaded from %s\n", optarg);
                 } else if (strcmp(long_options[option_index].name, "hb-mode") == 0) {
                     sscanf(optarg, "%d", &hb_mode);
-                    assert(hb_mode == 0 || hb_mode == 1);
+                    if (hb_mode < 0 || hb_mode > 2) {
+                        mylog(log_fatal, "hb-mode must be 0,1 or 2\n");
+                        myexit(-1);
+                    }
                     mylog(log_info, "hb_mode =%d \n", hb_mode);
                 } else if (strcmp(long_options[option_index].name, "hb-len") == 0) {
                     sscanf(optarg, "%d", &hb_len);
@@ -677,6 +756,117 @@ void process_arg(int argc, char *argv[])  // process all options
                 } else if (strcmp(long_options[option_index].name, "fix-gro") == 0) {
                     mylog(log_info, "--fix-gro enabled\n");
                     g_fix_gro = 1;
+                } else if (strcmp(long_options[option_index].name, "pacing-rate") == 0) {
+                    double tmp = -1;
+                    sscanf(optarg, "%lf", &tmp);
+                    if (tmp < 0 || tmp > 100000) {
+                        mylog(log_fatal, "pacing-rate must be >=0 and <=100000\n");
+                        myexit(-1);
+                    }
+                    pacing_rate = tmp / 8;  // Mbit/s to bytes per us
+                    mylog(log_info, "pacing_rate=%gMbit/s\n", tmp);
+                } else if (strcmp(long_options[option_index].name, "pacing-burst") == 0) {
+                    int tmp = -1;
+                    sscanf(optarg, "%d", &tmp);
+                    if (tmp < max_data_len || tmp > 10000000) {
+                        mylog(log_fatal, "pacing-burst must be >=%d and <=10000000\n", max_data_len);
+                        myexit(-1);
+                    }
+                    pacing_burst = tmp;
+                    mylog(log_info, "pacing_burst=%d\n", pacing_burst);
+                } else if (strcmp(long_options[option_index].name, "pmtu-probe") == 0) {
+                    int tmp = -1;
+                    sscanf(optarg, "%d", &tmp);
+                    if (tmp < 0 || tmp > 86400) {
+                        mylog(log_fatal, "pmtu-probe must be >=0 and <=86400\n");
+                        myexit(-1);
+                    }
+                    pmtu_probe_interval = tmp;
+                    mylog(log_info, "pmtu_probe_interval=%ds\n", pmtu_probe_interval);
+                } else if (strcmp(long_options[option_index].name, "frame-v2") == 0) {
+                    frame_v2_offer = 1;
+                    mylog(log_info, "frame_v2 offered\n");
+                } else if (strcmp(long_options[option_index].name, "disable-resume") == 0) {
+                    resume_offer = 0;
+                    mylog(log_info, "session resumption disabled\n");
+                } else if (strcmp(long_options[option_index].name, "coalesce") == 0) {
+                    int tmp = -1;
+                    sscanf(optarg, "%d", &tmp);
+                    if (tmp < 0 || tmp > 1000 * 1000) {
+                        mylog(log_fatal, "coalesce must be >=0 and <=1000000\n");
+                        myexit(-1);
+                    }
+                    coalesce_us = tmp;
+                    mylog(log_info, "coalesce=%dus\n", coalesce_us);
+                } else if (strcmp(long_options[option_index].name, "coalesce-size") == 0) {
+                    int tmp = -1;
+                    sscanf(optarg, "%d", &tmp);
+                    if (tmp < 64 || tmp > max_data_len) {
+                        mylog(log_fatal, "coalesce-size must be >=64 and <=%d\n", max_data_len);
+                        myexit(-1);
+                    }
+                    coalesce_size = tmp;
+                    mylog(log_info, "coalesce_size=%d\n", coalesce_size);
+                } else if (strcmp(long_options[option_index].name, "fec") == 0) {
+                    int x = -1, y = -1;
+                    if (sscanf(optarg, "%d:%d", &x, &y) != 2 || x < 1 || x > fec_max_data_num || y < 1 || y > fec_max_parity_num) {
+                        mylog(log_fatal, "fec must be x:y,1<=x<=%d,1<=y<=%d\n", fec_max_data_num, fec_max_parity_num);
+                        myexit(-1);
+                    }
+                    fec_data_num = x;
+                    fec_parity_num = y;
+                    mylog(log_info, "fec=%d:%d\n", fec_data_num, fec_parity_num);
+                } else if (strcmp(long_options[option_index].name, "fec-timeout") == 0) {
+                    int tmp = -1;
+                    sscanf(optarg, "%d", &tmp);
+                    if (tmp < 1 || tmp > 1000) {
+                        mylog(log_fatal, "fec-timeout must be >=1 and <=1000\n");
+                        myexit(-1);
+                    }
+                    fec_timeout_ms = tmp;
+                    mylog(log_info, "fec_timeout=%dms\n", fec_timeout_ms);
+                } else if (strcmp(long_options[option_index].name, "coarse-clock") == 0) {
+#if defined(CLOCK_MONOTONIC_COARSE)
+                    use_coarse_clock = 1;
+                    mylog(log_info, "--coarse-clock enabled\n");
+#else
+                    mylog(log_warn, "--coarse-clock not supported on this platform, ignored\n");
+#endif
+                } else if (strcmp(long_options[option_index].name, "udp-offload") == 0) {
+#ifdef UDP2RAW_LINUX
+                    udp_offload = 1;
+                    mylog(log_info, "--udp-offload enabled\n");
+#else
+                    mylog(log_warn, "--udp-offload not supported on this platform, ignored\n");
+#endif
+                } else if (strcmp(long_options[option_index].name, "upstream-pool") == 0) {
+                    sscanf(optarg, "%d", &upstream_pool_size);
+                    if (upstream_pool_size < 0 || upstream_pool_size > max_conv_num) {
+                        mylog(log_fatal, "upstream-pool must be >=0 and <=%d\n", max_conv_num);
+                        myexit(-1);
+                    }
+                    mylog(log_info, "upstream_pool_size=%d\n", upstream_pool_size);
+                } else if (strcmp(long_options[option_index].name, "metrics-sock") == 0) {
+                    sscanf(optarg, "%s", metrics_sock);
+                    mylog(log_info, "metrics_sock=%s\n", metrics_sock);
+                } else if (strcmp(long_options[option_index].name, "latency-hist") == 0) {
+                    int rate = 0;
+                    sscanf(optarg, "%d", &rate);
+                    if (rate < 1) {
+                        mylog(log_fatal, "latency-hist must be >=1\n");
+                        myexit(-1);
+                    }
+                    latency_start(rate);
+                    mylog(log_info, "latency histograms enabled,sample rate 1/%d\n", rate);
+                } else if (strcmp(long_options[option_index].name, "replay-pcap") == 0) {
+                    sscanf(optarg, "%s", replay_file);
+                    mylog(log_info, "replay_file=%s\n", replay_file);
+                } else if (strcmp(long_options[option_index].name, "replay-loops") == 0) {
+                    sscanf(optarg, "%d", &replay_loops);
+                    if (replay_loops < 1) {
+                        mylog(log_fatal, "replay-loops must be >=1\n");
+                        myexit(-1);
+                    }
                 } else {
                     mylog(log_warn, "ignored unknown long option ,option_index:%d code:<%x>\n", option_index, optopt);
                 }
@@ -742,6 +932,10 @@ void pre_process_arg(int argc, char *argv[])  // mainly for load conf file
             unit_test();
             myexit(0);
         }
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench_test();
+            myexit(0);
+        }
     }
 
     for (i = 0; i < argc; i++) {
@@ -1010,6 +1204,747 @@ int unit_test() {
     for (int i = 0; i < temp_len; i++) {
         printf("<%d>", buf4[i]);
     }
+    printf("\n");
+
+    // cached clock must stay still inside an iteration and must follow CLOCK_MONOTONIC,
+    // so that a wall-clock jump (settimeofday,ntp step) never expires or extends a timeout
+    update_current_time();
+    u64_t t1 = get_current_time();
+    usleep(20 * 1000);
+    u64_t t2 = get_current_time();
+    update_current_time();
+    u64_t t3 = get_current_time();
+    timespec mono;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    u64_t mono_ms = ((u64_t)mono.tv_sec) * 1000llu + ((u64_t)mono.tv_nsec) / 1000000llu;
+    printf("clock test: cached %llu %llu, updated %llu, monotonic %llu\n", t1, t2, t3, mono_ms);
+    assert(t1 == t2);
+    assert(t3 - t1 >= 20);
+    assert(t3 <= mono_ms + 1);  // cache is never ahead of the clock
+    assert(mono_ms + 1 - t3 < 1000);  // and not far behind,loose bound so a loaded machine doesnt fail it
+    printf("clock test passed\n");
+
+    {  // timer wheel: every timer fires exactly once,never early and at most one tick late
+        static u64_t fire_time[2000];
+        static u64_t wheel_now;
+        timer_wheel_t wheel;
+        vector<wheel_timer_t> timers(2000);
+        vector<u64_t> deadline(2000);
+        u64_t start = 123456789;
+        wheel.init(start, 10);
+        for (int i = 0; i < (int)timers.size(); i++) {
+            timers[i].cb = [](wheel_timer_t *t) { fire_time[(long)t->data] = wheel_now; };
+            timers[i].data = (void *)(long)i;
+            deadline[i] = start + get_true_random_number() % (i < 1000 ? 5000 : 3000000);
+            fire_time[i] = 0;
+            wheel.add(&timers[i], deadline[i]);
+        }
+        wheel.del(&timers[0]);
+        for (wheel_now = start; wheel.size() > 0; wheel_now += 1 + get_true_random_number() % 7) {
+            wheel.advance(wheel_now);
+        }
+        int bad = fire_time[0] != 0;  // deleted timer fired
+        for (int i = 1; i < (int)timers.size(); i++) {
+            if (fire_time[i] < deadline[i] || fire_time[i] >= deadline[i] + 10 + 7) bad++;  // early,or more than one tick+step late
+        }
+        if (bad != 0) {  // not an assert,so that the check survives NDEBUG builds
+            mylog(log_fatal, "timer wheel test failed,%d timers fired early,late or after del\n", bad);
+            myexit(-1);
+        }
+        printf("timer wheel test passed\n");
+    }
+
+    {  // timer heap: random set/move/del against a reference,then drained in deadline order
+        timer_heap_t heap;
+        vector<heap_timer_t> timers(1000);
+        map<int, u64_t> ref;
+        for (int i = 0; i < 20000; i++) {
+            int k = get_true_random_number() % timers.size();
+            if (get_true_random_number() % 4 == 0) {
+                heap.del(&timers[k]);
+                ref.erase(k);
+            } else {
+                u64_t deadline = get_true_random_number() % 100000;
+                heap.set(&timers[k], deadline);
+                ref[k] = deadline;
+            }
+            assert(heap.size() == (int)ref.size());
+        }
+        u64_t last = 0;
+        int bad = 0;
+        while (heap.top() != 0) {
+            heap_timer_t *timer = heap.top();
+            int k = timer - &timers[0];
+            if (timer->deadline < last || !ref.count(k) || ref[k] != timer->deadline) bad++;  // out of order or unknown
+            last = timer->deadline;
+            ref.erase(k);
+            heap.del(timer);
+            if (timer->is_pending()) bad++;
+        }
+        if (bad != 0 || !ref.empty()) {  // not an assert,like the timer wheel test
+            mylog(log_fatal, "timer heap test failed,%d bad pops,%d timers never popped\n", bad, (int)ref.size());
+            myexit(-1);
+        }
+        printf("timer heap test passed\n");
+    }
+
+    {  // conv_manager_t against a reference map,with random insert/erase/update
+        conv_manager_t<u64_t> conv_manager;
+        unordered_map<u32_t, u64_t> ref;
+        for (int i = 0; i < 200000; i++) {
+            u32_t op = get_true_random_number() % 3;
+            if (op == 0 && ref.size() < 3000) {
+                u32_t conv = conv_manager.get_new_conv();
+                u64_t data = get_true_random_number_64();
+                if (conv_manager.is_data_used(data)) continue;
+                conv_manager.insert_conv(conv, data);
+                ref[conv] = data;
+            } else if (!ref.empty()) {
+                auto it = ref.begin();
+                std::advance(it, get_true_random_number() % min((int)ref.size(), 10));
+                if (op == 1) {
+                    conv_manager.erase_conv(it->first);
+                    assert(!conv_manager.is_conv_used(it->first) && !conv_manager.is_data_used(it->second));
+                    ref.erase(it);
+                } else {
+                    conv_manager.update_active_time(it->first);
+                }
+            }
+            assert(conv_manager.get_size() == (int)ref.size());
+        }
+        for (auto it = ref.begin(); it != ref.end(); it++) {
+            assert(conv_manager.find_data_by_conv(it->first) == it->second);
+            assert(conv_manager.find_conv_by_data(it->second) == it->first);
+        }
+        printf("conv manager test passed\n");
+    }
+
+    {  // spsc_ring_t: a producer thread pushes records of random length,consumer checks order and content
+        static spsc_ring_t ring;
+        ring.init(3000, 8);
+        static const int total = 300000;
+        pthread_t producer;
+        pthread_create(
+            &producer, 0, [](void *) -> void * {
+                char tmp[3000];
+                for (int i = 0; i < total;) {
+                    int len = 4 + (i * 7919u) % 2990;
+                    memcpy(tmp, &i, sizeof(i));
+                    memset(tmp + 4, i & 0xff, len - 4);
+                    if (ring.push(tmp, len) == -1) {  // full,retry
+                        sched_yield();
+                        continue;
+                    }
+                    i++;
+                }
+                return 0;
+            },
+            0);
+        int expect = 0;
+        while (expect < total) {
+            char *p;
+            int len;
+            if (!ring.peek(p, len)) {
+                sched_yield();
+                continue;
+            }
+            int seq;
+            memcpy(&seq, p, sizeof(seq));
+            assert(seq == expect && len == int(4 + (seq * 7919u) % 2990));
+            assert(len == 4 || (p[len - 1] == char(seq & 0xff) && p[4] == char(seq & 0xff)));
+            ring.pop();
+            expect++;
+        }
+        pthread_join(producer, 0);
+        char *p;
+        int len;
+        assert(!ring.peek(p, len) && ring.park() == 1);
+        printf("spsc ring test passed,%u pushes retried on full\n", ring.dropped);
+    }
+
+    {  // latency histogram buckets and percentiles
+        for (u64_t v = 0; v < 100000; v = v * 9 / 8 + 1) {
+            int b = latency_hist_t::bucket_of(v);
+            assert(b >= 0 && b < latency_hist_t::bucket_num);
+            assert(latency_hist_t::bucket_of(v + 1) >= b);
+            u64_t mid = latency_hist_t::value_of(b);
+            assert(mid * 8 >= v * 7 && mid * 7 <= v * 8 + 7);  // within one sub bucket
+        }
+        assert(latency_hist_t::bucket_of(u64_t(-1)) == latency_hist_t::bucket_num - 1);
+
+        latency_hist_t h;
+        h.clear();
+        assert(h.quantile(0.5) == 0);
+        for (int i = 1; i <= 10000; i++) h.add(i);
+        assert(h.count == 10000 && h.max == 10000);
+        u64_t p50 = h.quantile(0.5), p99 = h.quantile(0.99);
+        assert(p50 >= 5000 * 7 / 8 && p50 <= 5000 * 9 / 8);
+        assert(p99 >= 9900 * 7 / 8 && p99 <= 10000);
+        assert(h.quantile(1.0) == 10000);
+        printf("latency histogram test passed,p50=%llu p99=%llu\n", p50, p99);
+    }
+
+    {  // anti replay window against a reference set,with reordering,duplicates and jumps
+        u32_t saved_window_size = anti_replay_window_size;
+        u32_t sizes[] = {64, 4000, 65536};
+        for (int k = 0; k < 3; k++) {
+            anti_replay_window_size = sizes[k];
+            anti_replay_t anti_replay;
+            u64_t tracked = (anti_replay.word_num - 1) * 64llu;
+            assert(tracked + 64 >= anti_replay_window_size && tracked < anti_replay_window_size * 2);
+            set<u64_t> seen;
+            u64_t max_seq = 0;
+            u64_t next = 1000000;
+            for (int i = 0; i < 300000; i++) {
+                u32_t r = get_true_random_number() % 100;
+                u64_t seq;
+                if (r < 60)
+                    seq = next++;
+                else if (r < 95)
+                    seq = next - 1 - get_true_random_number() % (tracked + 100);  // late,sometimes older than the window
+                else if (r < 99)
+                    seq = next + get_true_random_number() % (tracked / 2);  // ahead,leaves holes
+                else
+                    seq = next + tracked * (1 + get_true_random_number() % 3);  // far jump
+                if (seq >= next) next = seq + 1;
+                int expect;
+                if (seq > max_seq)
+                    expect = 1;
+                else if (max_seq - seq >= tracked)
+                    expect = 0;
+                else
+                    expect = seen.count(seq) == 0;
+                assert(anti_replay.is_vaild(seq) == expect);
+                if (expect) {
+                    seen.insert(seq);
+                    if (seq > max_seq) max_seq = seq;
+                }
+            }
+        }
+        anti_replay_window_size = saved_window_size;
+        printf("anti replay test passed\n");
+    }
+
+    {  // slab pool: objects are distinct,freed ones are reused before a new chunk is taken
+        slab_pool_t pool(100, 8);
+        assert(pool.obj_size == 112);
+        vector<char *> objs;
+        set<char *> uniq;
+        for (int i = 0; i < 20; i++) {
+            char *p = (char *)pool.alloc();
+            assert(((u64_t)p & 15) == 0);
+            memset(p, i, 100);
+            objs.push_back(p);
+            uniq.insert(p);
+        }
+        assert(uniq.size() == 20 && pool.used_num == 20 && pool.capacity() == 24);
+        for (int i = 0; i < 20; i++) assert(objs[i][0] == i && objs[i][99] == i);
+        for (int i = 0; i < 20; i += 2) pool.release(objs[i]);
+        for (int i = 0; i < 14; i++) uniq.insert((char *)pool.alloc());
+        assert(uniq.size() == 24 && pool.used_num == 24 && pool.capacity() == 24);  // 10 freed + 4 never used,no new chunk
+
+        conv_manager_t<u64_t> conv_manager;  // tables only exist while there are convs
+        assert(conv_manager.memory_bytes() == 0 && !conv_manager.is_conv_used(1234));
+        conv_manager.insert_conv(1234, 5678);
+        assert(conv_manager.memory_bytes() > 0 && conv_manager.find_data_by_conv(1234) == 5678);
+        conv_manager.clear();
+        assert(conv_manager.memory_bytes() == 0 && !conv_manager.is_conv_used(1234));
+        printf("slab pool test passed\n");
+    }
+
+    {  // coalesce: small datagrams queue up as sub frames of an 'm' frame,and split back into 'd' payloads
+        program_mode_t saved_mode = program_mode;
+        int saved_us = coalesce_us, saved_size = coalesce_size;
+        program_mode = client_mode;  // blob_t needs a mode
+        coalesce_us = 1000;
+        coalesce_size = 100;
+        conn_info_t *conn_info = new conn_info_t;
+        conn_info->prepare();
+        coalesce_t &coalesce = conn_info->blob->coalesce;
+        const char *msgs[] = {"a", "hello", "", "0123456789"};
+        for (int i = 0; i < 4; i++) send_data_safer(*conn_info, msgs[i], strlen(msgs[i]), 0x11223344 + i);
+        assert(coalesce.cnt == 4 && (int)coalesce.buf.size() == 4 * 6 + 16);
+        assert(send_next_deadline() == coalesce.deadline && coalesce.deadline > 0);
+
+        vector<char> type_arr;
+        vector<string> data_arr;
+        assert(coalesce_split(&coalesce.buf[0], coalesce.buf.size(), 0, type_arr, data_arr) == 0);
+        assert(type_arr.size() == 4 && data_arr.size() == 4);
+        for (int i = 0; i < 4; i++) {
+            u32_t conv;
+            memcpy(&conv, data_arr[i].c_str(), sizeof(conv));
+            assert(type_arr[i] == 'd' && ntohl(conv) == 0x11223344u + i && data_arr[i].substr(4) == msgs[i]);
+        }
+        type_arr.clear();
+        data_arr.clear();
+        assert(coalesce_split(&coalesce.buf[0], coalesce.buf.size() - 1, 0, type_arr, data_arr) == -1);  // truncated
+        assert(data_arr.size() == 3);
+
+        coalesce_flush(*conn_info);  // not ready,dropped
+        assert(coalesce.cnt == 0 && coalesce.buf.empty() && send_next_deadline() == 0);
+        delete conn_info;
+        program_mode = saved_mode;
+        coalesce_us = saved_us;
+        coalesce_size = saved_size;
+        printf("coalesce test passed\n");
+    }
+
+    {  // frame v2: varint convs,seq rebuilt from its low 32 bits,small conv ids
+        program_mode_t saved_mode = program_mode;
+        int saved_us = coalesce_us;
+        program_mode = client_mode;
+        coalesce_us = 1000;
+        conn_info_t *conn_info = new conn_info_t;
+        conn_info->prepare();
+        conn_info->frame_v2 = 1;
+        coalesce_t &coalesce = conn_info->blob->coalesce;
+        const u32_t convs[] = {1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffffu};
+        const int conv_lens[] = {1, 1, 2, 2, 3, 5};
+        int expect_size = 0;
+        for (int i = 0; i < 6; i++) {
+            char buf[8];
+            assert(write_conv(1, buf, convs[i]) == conv_lens[i]);
+            send_data_safer(*conn_info, "xy", 2, convs[i]);
+            expect_size += 2 + conv_lens[i] + 2;
+        }
+        assert((int)coalesce.buf.size() == expect_size);
+        vector<char> type_arr;
+        vector<string> data_arr;
+        assert(coalesce_split(&coalesce.buf[0], coalesce.buf.size(), 1, type_arr, data_arr) == 0);
+        assert(data_arr.size() == 6);
+        for (int i = 0; i < 6; i++) assert(read_u32(&data_arr[i][0]) == convs[i] && data_arr[i].substr(4) == "xy");
+        char bad[] = {char(0x80), char(0x80)};
+        assert(push_data_payload(1, bad, 2, data_arr) == -1 && data_arr.size() == 6);  // unterminated varint
+        coalesce_flush(*conn_info);
+        delete conn_info;
+
+        raw_mode_t saved_raw_mode = raw_mode;
+        raw_mode = mode_udp;
+        for (int v2 = 0; v2 <= 1; v2++) {  // a frame is accepted by the peer,but not by its sender when reflected back
+            conn_info_t *a = new conn_info_t, *b = new conn_info_t;
+            a->prepare();
+            b->prepare();
+            a->frame_v2 = b->frame_v2 = v2;
+            a->my_id = b->oppsite_id = 0x11111111;
+            a->oppsite_id = b->my_id = 0x22222222;
+            char plain[buf_len], cipher[buf_len], type, *data;
+            int header_len = write_safer_header(*a, plain);
+            plain[header_len] = 'd';
+            plain[header_len + 1] = 0;
+            memcpy(plain + header_len + 2, "xyzw", 4);
+            int len = header_len + 6, data_len;
+            assert(my_encrypt(plain, cipher, len) == 0);
+            assert(reserved_parse_safer(*a, cipher, len, type, data, data_len) == -1);  // reflected
+            assert(reserved_parse_safer(*b, cipher, len, type, data, data_len) == 0 && type == 'd' && data_len == 4);
+            delete a;
+            delete b;
+        }
+        raw_mode = saved_raw_mode;
+        program_mode = saved_mode;
+        coalesce_us = saved_us;
+
+        anti_replay_t anti_replay;
+        assert(anti_replay.expand_seq(0xfffffff0u) == 0xfffffff0u);
+        assert(anti_replay.is_vaild(0xfffffff0u) == 1);
+        u64_t seq = anti_replay.expand_seq(5);  // wrapped
+        assert(seq == 0x100000005llu && anti_replay.is_vaild(seq) == 1);
+        assert(anti_replay.expand_seq(0xfffffff8u) == 0xfffffff8u);  // late one from before the wrap
+        assert(anti_replay.is_vaild(anti_replay.expand_seq(0xfffffff0u)) == 0);  // replayed
+
+        conv_manager_t<u64_t> conv_manager;
+        set<u32_t> used;
+        for (int i = 0; i < 100; i++) {
+            u32_t conv = conv_manager.get_new_small_conv();
+            assert(conv >= 1 && conv <= conv_manager.small_conv_max && used.insert(conv).second);
+            conv_manager.insert_conv(conv, i);
+        }
+        printf("frame v2 test passed\n");
+    }
+
+    {  // fec: every kernel agrees with the scalar one,any data_num of a group rebuild the lost data frames
+        fec_init();
+        gf_kernel_t kernels[8];
+        int kernel_num = gf_kernels(kernels);
+        for (int a = 1; a < 256; a++) assert(gf_mul(a, gf_inv(a)) == 1);
+        const int lens[] = {0, 1, 15, 16, 17, 31, 32, 33, 100, 1500};
+        vector<u8_t> src(1500), dst(1500), ref(1500);
+        for (int k = 1; k < kernel_num; k++)
+            for (int i = 0; i < 10; i++)
+                for (int c = 0; c < 256; c += 17) {
+                    for (int j = 0; j < 1500; j++) src[j] = rand(), dst[j] = ref[j] = rand();
+                    kernels[k].fn(&dst[0], &src[0], c, lens[i]);
+                    gf_mul_add_scalar(&ref[0], &src[0], c, lens[i]);
+                    assert(dst == ref);
+                }
+
+        int saved_data_num = fec_data_num, saved_parity_num = fec_parity_num;
+        fec_data_num = 10;
+        fec_parity_num = 3;
+        for (int trial = 0; trial < 200; trial++) {
+            int data_cnt = trial % 4 == 0 ? 1 + rand() % 9 : 10;  // some groups are cut by --fec-timeout
+            fec_encoder_t encoder;
+            vector<string> frames, repairs;
+            for (int i = 0; i < data_cnt; i++) {
+                char frame[buf_len];
+                int len = 4 + rand() % 1200;
+                char type = i % 3 == 0 ? 'm' : 'd';
+                for (int j = 0; j < len; j++) frame[fec_header_len + 1 + j] = rand();
+                encoder.add(type, frame + fec_header_len + 1, len, frame);
+                frame[fec_header_len] = type;
+                frames.push_back(string(frame, fec_header_len + 1 + len));
+            }
+            for (int p = 0; p < fec_parity_num; p++) {
+                char frame[buf_len];
+                int len = encoder.repair_frame(p, frame);
+                repairs.push_back(string(frame, len));
+            }
+            vector<int> lost(data_cnt + fec_parity_num, 0);
+            for (int i = 0, lost_num = rand() % (fec_parity_num + 1); i < lost_num; i++) lost[rand() % lost.size()] = 1;
+
+            fec_decoder_t decoder;
+            vector<string> rebuilt;
+            for (int i = 0; i < data_cnt; i++)
+                if (!lost[i]) assert(decoder.add(frames[i].c_str(), frames[i].size(), 0, rebuilt) >= 0);
+            for (int p = 0; p < fec_parity_num; p++)
+                if (!lost[data_cnt + p]) assert(decoder.add(repairs[p].c_str(), repairs[p].size(), 1, rebuilt) >= 0);
+            vector<string> expect;
+            for (int i = 0; i < data_cnt; i++)
+                if (lost[i]) expect.push_back(frames[i].substr(fec_header_len));
+            assert(rebuilt == expect);
+            assert(decoder.memory_bytes() == fec_group_slots * sizeof(fec_group_t));  // a done group keeps no shards
+            for (int i = 0; i < data_cnt; i++)  // lost ones were only late,their originals arrive after the rebuild
+                if (lost[i]) assert(decoder.add(frames[i].c_str(), frames[i].size(), 0, rebuilt) == fec_duplicate);
+            if (!lost[0]) assert(decoder.add(frames[0].c_str(), frames[0].size(), 0, rebuilt) == fec_duplicate);
+            assert(rebuilt == expect);
+        }
+        {  // a group only holds the shards its header announces,not fec_max_data_num+fec_max_parity_num
+            fec_decoder_t decoder;
+            vector<string> rebuilt;
+            char frame[fec_header_len + 4] = {0};
+            fec_write_header(frame, 7, 0, 10, 3);
+            frame[fec_header_len] = 'd';
+            assert(decoder.add(frame, sizeof(frame), 0, rebuilt) == 0);
+            assert(decoder.groups[7 % fec_group_slots].shards.size() == 13);
+            fec_write_header(frame, 7, 0, 12, 3);
+            assert(decoder.add(frame, sizeof(frame), 1, rebuilt) == -1);  // repair of more data shards than the group holds
+            fec_write_header(frame, 7, 1, 10, 4);
+            assert(decoder.add(frame, sizeof(frame), 0, rebuilt) == -1);  // parity_num changed inside the group
+        }
+        fec_data_num = saved_data_num;
+        fec_parity_num = saved_parity_num;
+        printf("fec test passed,%d gf kernels,best is %s\n", kernel_num, gf_kernel_name);
+    }
+
+    {  // faketcp seq_mode 3: out of order segments are remembered,ack_seq jumps over them once the hole is filled
+        tcp_ooo_t ooo;
+        ooo.insert(100, 200);
+        ooo.insert(300, 400);
+        ooo.insert(200, 250);  // touches the first range
+        assert(ooo.num == 2 && ooo.start[0] == 100 && ooo.end[0] == 250 && ooo.start[1] == 300);
+        ooo.insert(240, 310);  // bridges both
+        assert(ooo.num == 1 && ooo.start[0] == 100 && ooo.end[0] == 400);
+        for (u32_t i = 1; i <= 4; i++) ooo.insert(1000 * i, 1000 * i + 10);
+        assert(ooo.num == tcp_ooo_max && ooo.start[0] == 4000 && ooo.start[tcp_ooo_max - 1] == 1000);  // 100-400 forgotten
+        assert(ooo.advance(50) == 50 && ooo.advance(2000) == 2010 && ooo.num == 2);
+        ooo = tcp_ooo_t();
+        ooo.insert(0xfffffff0u, 0x10);  // across the wrap
+        ooo.insert(0x10, 0x20);
+        assert(ooo.num == 1 && ooo.advance(0xfffffff0u) == 0x20 && ooo.num == 0);
+
+        raw_mode_t saved_raw_mode = raw_mode;
+        int saved_seq_mode = seq_mode;
+        raw_mode = mode_faketcp;
+        seq_mode = 3;
+        raw_info_t raw_info;
+        packet_info_t &recv_info = raw_info.recv_info;
+        raw_info.send_info.ack_seq = 1000;
+        recv_info.syn = 0;
+        recv_info.ack = 1;
+        recv_info.has_ts = 0;
+        const u32_t segs[] = {1000, 1200, 1300, 1100, 1100};  // 1100 is late,then replayed by the sender's rewind
+        const u32_t acks[] = {1100, 1100, 1100, 1400, 1400};
+        for (int i = 0; i < 5; i++) {
+            recv_info.seq = segs[i];
+            recv_info.data_len = 100;
+            after_recv_raw0(raw_info);
+            assert(raw_info.send_info.ack_seq == acks[i]);
+        }
+        assert(raw_info.ooo.num == 0);
+        raw_mode = saved_raw_mode;
+        seq_mode = saved_seq_mode;
+        printf("tcp sack test passed\n");
+    }
+
+    {  // hb_mode 2: recent data postpones the heartbeat,a peer that didnt agree gets hb_mode 1
+        program_mode_t saved_mode = program_mode;
+        int saved_hb_mode = hb_mode;
+        program_mode = client_mode;
+        hb_mode = 2;
+        conn_info_t *conn_info = new conn_info_t;
+        conn_info->last_hb_sent_time = 10000;
+        conn_info->last_data_sent_time = 10500;
+        assert(conn_hb_mode(*conn_info) == 1 && next_heartbeat_time(*conn_info) == 10000 + heartbeat_interval);
+        conn_info->adaptive_hb = 1;
+        assert(conn_hb_mode(*conn_info) == 2 && next_heartbeat_time(*conn_info) == 10500 + heartbeat_interval);
+        conn_info->last_data_sent_time = 9000;
+        assert(next_heartbeat_time(*conn_info) == 10000 + heartbeat_interval);
+        delete conn_info;
+        program_mode = saved_mode;
+        hb_mode = saved_hb_mode;
+        printf("heartbeat mode test passed\n");
+    }
+    return 0;
+}
+
+int bench_test()  // micro benchmarks for hot path data structures,hidden option --bench
+{
+    printf("running benchmark\n");
+
+    {  // event dispatch: fd64 -> conn_info,as done for every udp event in server_event_loop
+        const int fd_num = 1000;
+        const int rounds = 5000;
+        conn_info_t *dummy_conn = (conn_info_t *)&fd_num;
+        vector<fd64_t> fd64s;
+        u64_t sum = 0;
+
+        fd_manager_t slab;  // fds are fake,never call fd64_close() on them
+        for (int i = 0; i < fd_num; i++) {
+            fd64s.push_back(slab.create(i + 10));
+            slab.get_info(fd64s.back()).p_conn_info = dummy_conn;
+        }
+        u64_t begin = update_current_time();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < fd_num; i++) {
+                fd_info_t *p = slab.find_info(fd64s[i]);
+                sum += (u64_t)p->p_conn_info + slab.to_fd(fd64s[i]);
+            }
+        u64_t slab_us = update_current_time() - begin;
+
+        // the old layout: 3 hash maps,exist()+exist_info()+get_info()+to_fd()
+        unordered_map<int, fd64_t> fd_to_fd64_mp;
+        unordered_map<fd64_t, int> fd64_to_fd_mp;
+        unordered_map<fd64_t, fd_info_t> fd_info_mp;
+        fd64_t counter = u32_t(-1) + 100llu;
+        fd64s.clear();
+        for (int i = 0; i < fd_num; i++) {
+            fd64_t fd64 = counter++;
+            fd_to_fd64_mp[i + 10] = fd64;
+            fd64_to_fd_mp[fd64] = i + 10;
+            fd_info_mp[fd64].p_conn_info = dummy_conn;
+            fd64s.push_back(fd64);
+        }
+        begin = update_current_time();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < fd_num; i++) {
+                fd64_t fd64 = fd64s[i];
+                if (fd64_to_fd_mp.find(fd64) == fd64_to_fd_mp.end()) continue;
+                if (fd_info_mp.find(fd64) == fd_info_mp.end()) continue;
+                sum += (u64_t)fd_info_mp[fd64].p_conn_info + fd64_to_fd_mp[fd64];
+            }
+        u64_t map_us = update_current_time() - begin;
+
+        double ops = (double)fd_num * rounds;
+        printf("fd dispatch, %d fds: slab %.2f ns/op, hash maps %.2f ns/op (%llu)\n", fd_num,
+               slab_us * 1000.0 / ops, map_us * 1000.0 / ops, sum % 10);
+    }
+
+    {  // conv lookup and lru touch for every data packet,with max_conv_num convs in one connection
+        const int conv_num = max_conv_num;
+        const int rounds = 200;
+        vector<u32_t> convs;
+        u64_t sum = 0;
+
+        conv_manager_t<u64_t> conv_manager;
+        u64_t begin = update_current_time();
+        for (int i = 0; i < conv_num; i++) {
+            convs.push_back(conv_manager.get_new_conv());
+            conv_manager.insert_conv(convs.back(), i + 1000);
+        }
+        u64_t insert_us = update_current_time() - begin;
+        begin = update_current_time();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < conv_num; i++) {
+                u32_t conv = convs[(i * 7919) % conv_num];
+                if (!conv_manager.is_conv_used(conv)) continue;
+                sum += conv_manager.find_data_by_conv(conv);
+                conv_manager.update_active_time(conv);
+            }
+        u64_t lookup_us = update_current_time() - begin;
+
+        // the old layout: 2 hash maps + lru_collector_t
+        unordered_map<u64_t, u32_t> data_to_conv;
+        unordered_map<u32_t, u64_t> conv_to_data;
+        lru_collector_t<u32_t> lru;
+        begin = update_current_time();
+        for (int i = 0; i < conv_num; i++) {
+            data_to_conv[i + 1000] = convs[i];
+            conv_to_data[convs[i]] = i + 1000;
+            lru.new_key(convs[i]);
+        }
+        u64_t old_insert_us = update_current_time() - begin;
+        begin = update_current_time();
+        for (int r = 0; r < rounds; r++)
+            for (int i = 0; i < conv_num; i++) {
+                u32_t conv = convs[(i * 7919) % conv_num];
+                if (conv_to_data.find(conv) == conv_to_data.end()) continue;
+                sum += conv_to_data[conv];
+                lru.update(conv);
+            }
+        u64_t old_lookup_us = update_current_time() - begin;
+
+        printf("conv insert, %d convs: pool %.2f ns/op, hash maps+list %.2f ns/op\n", conv_num,
+               insert_us * 1000.0 / conv_num, old_insert_us * 1000.0 / conv_num);
+        printf("conv lookup+update_active_time, %d convs: pool %.2f ns/op, hash maps+list %.2f ns/op (%llu)\n", conv_num,
+               lookup_us * 1000.0 / conv_num / rounds, old_lookup_us * 1000.0 / conv_num / rounds, sum % 10);
+    }
+
+    {  // a disabled trace line with an address argument,as in the per packet path of server
+        const int rounds = 1000000;
+        address_t addr;
+        addr.from_str((char *)"10.1.2.3:4096");
+        int saved_log_level = log_level;
+        log_level = log_info;
+        u64_t begin = update_current_time();
+        for (int i = 0; i < rounds; i++) {
+            addr_str_t ip_port(addr);
+            mylog(log_trace, "[%s]peek_raw\n", ip_port.c_str());
+        }
+        u64_t lazy_us = update_current_time() - begin;
+        begin = update_current_time();
+        for (int i = 0; i < rounds; i++) {  // the old way: format first,then call log0() which checks the level
+            char ip_port[max_addr_len];
+            addr.to_str(ip_port);
+            log0(__FILE__, __FUNCTION__, __LINE__, log_trace, "[%s]peek_raw\n", ip_port);
+        }
+        u64_t eager_us = update_current_time() - begin;
+        log_level = saved_log_level;
+        printf("disabled trace log with ip_port: lazy %.2f ns/op, eager %.2f ns/op\n", lazy_us * 1000.0 / rounds, eager_us * 1000.0 / rounds);
+    }
+
+    {  // one stage measurement of the latency histograms,as done several times per packet
+        const int rounds = 1000000;
+        int saved_rate = latency_sample_rate;
+        const int rates[] = {0, 1, 16};
+        printf("latency stage measurement:");
+        for (int r = 0; r < 3; r++) {
+            latency_sample_rate = rates[r];
+            latency_reset();
+            u64_t begin = update_current_time();
+            for (int i = 0; i < rounds; i++) {
+                u64_t lat = lat_begin(lat_decrypt);
+                lat_record(lat_decrypt, lat);
+            }
+            u64_t us = update_current_time() - begin;
+            printf(" rate %d %.2f ns/op%s", rates[r], us * 1000.0 / rounds, r == 2 ? "\n" : ",");
+        }
+        latency_sample_rate = saved_rate;
+        latency_reset();
+    }
+
+    {  // anti replay check of every data packet,mostly in order with some reordering and holes
+        const int rounds = 4000000;
+        vector<u64_t> seqs;
+        u64_t next = 1000000;
+        for (int i = 0; i < rounds; i++) {
+            u32_t r = get_true_random_number() % 100;
+            if (r < 90)
+                seqs.push_back(next++);
+            else if (r < 98)
+                seqs.push_back(next - 1 - get_true_random_number() % 64);
+            else
+                seqs.push_back(next += 50);  // a burst of losses
+        }
+        u32_t saved_window_size = anti_replay_window_size;
+        const u32_t sizes[] = {4000, 65536};
+        for (int k = 0; k < 2; k++) {
+            anti_replay_window_size = sizes[k];
+            anti_replay_t anti_replay;
+            u64_t sum = 0;
+            u64_t begin = update_current_time();
+            for (int i = 0; i < rounds; i++) sum += anti_replay.is_vaild(seqs[i]);
+            u64_t bitmap_us = update_current_time() - begin;
+
+            // the old layout: one byte per seq,cleared one by one
+            vector<char> window(sizes[k]);
+            u64_t max_received = 0;
+            begin = update_current_time();
+            for (int i = 0; i < rounds; i++) {
+                u64_t seq = seqs[i];
+                if (seq > max_received) {
+                    if (seq - max_received >= sizes[k])
+                        memset(&window[0], 0, sizes[k]);
+                    else
+                        for (u64_t j = max_received + 1; j < seq; j++) window[j % sizes[k]] = 0;
+                    window[seq % sizes[k]] = 1;
+                    max_received = seq;
+                    sum++;
+                } else if (max_received - seq < sizes[k] && window[seq % sizes[k]] == 0) {
+                    window[seq % sizes[k]] = 1;
+                    sum++;
+                }
+            }
+            u64_t byte_us = update_current_time() - begin;
+            printf("anti replay, window %u: bitmap %.2f ns/op %u bytes, byte per seq %.2f ns/op %u bytes (%llu)\n", sizes[k],
+                   bitmap_us * 1000.0 / rounds, anti_replay.word_num * 8, byte_us * 1000.0 / rounds, sizes[k], sum % 10);
+        }
+        anti_replay_window_size = saved_window_size;
+    }
+
+    {  // connection churn of a handshake flood: create and destroy conn_info_t
+        const int live = 10000;
+        const int rounds = 20;
+        vector<conn_info_t *> conns(live);
+        u64_t begin = update_current_time();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < live; i++) conns[i] = new conn_info_t;
+            for (int i = 0; i < live; i++) delete conns[i];
+        }
+        u64_t pool_us = update_current_time() - begin;
+        begin = update_current_time();
+        for (int r = 0; r < rounds; r++) {  // the old way,straight from the heap
+            for (int i = 0; i < live; i++) conns[i] = ::new (::operator new(sizeof(conn_info_t))) conn_info_t;
+            for (int i = 0; i < live; i++) {
+                conns[i]->~conn_info_t();
+                ::operator delete(conns[i]);
+            }
+        }
+        u64_t heap_us = update_current_time() - begin;
+        double ops = (double)live * rounds;
+        printf("conn_info_t new+delete, %d live: pool %.2f ns/op, heap %.2f ns/op\n", live, pool_us * 1000.0 / ops, heap_us * 1000.0 / ops);
+    }
+
+    {  // fec: dst^=c*src of every gf kernel,and the parity of a 10:3 group of 1400 byte packets
+        fec_init();
+        gf_kernel_t kernels[8];
+        int kernel_num = gf_kernels(kernels);
+        const int len = 1400;
+        const int rounds = 200000;
+        vector<u8_t> src(len), dst(len);
+        for (int i = 0; i < len; i++) src[i] = rand();
+        for (int k = 0; k < kernel_num; k++) {
+            u64_t begin = update_current_time();
+            for (int r = 0; r < rounds; r++) kernels[k].fn(&dst[0], &src[0], (u8_t)(r | 2), len);
+            u64_t us = update_current_time() - begin;
+            printf("gf_mul_add %-6s %d bytes: %.2f GB/s\n", kernels[k].name, len, (double)len * rounds / us / 1000.0);
+        }
+
+        int saved_data_num = fec_data_num, saved_parity_num = fec_parity_num;
+        fec_data_num = 10;
+        fec_parity_num = 3;
+        fec_encoder_t encoder;
+        char frame[buf_len];
+        const int groups = 20000;
+        u64_t begin = update_current_time();
+        for (int g = 0; g < groups; g++) {
+            for (int i = 0; i < fec_data_num; i++) encoder.add('d', (char *)&src[0], len, frame);
+            for (int p = 0; p < fec_parity_num; p++) encoder.repair_frame(p, frame);
+            encoder.next_group();
+        }
+        u64_t us = update_current_time() - begin;
+        printf("fec 10:3 encode,%d byte packets: %.1f ns per data packet,kernel %s\n", len, us * 1000.0 / groups / fec_data_num, gf_kernel_name);
+        fec_data_num = saved_data_num;
+        fec_parity_num = saved_parity_num;
+    }
     return 0;
 }
 
@@ -1042,31 +1977,36 @@ int set_timer(int epollfd, int &timer_fd)  // put a timer_fd into epoll,general
     return 0;
 }
 
-int set_timer_server(int epollfd, int &timer_fd, fd64_t &fd64)  // only for server
+int set_timer_oneshot(int timer_fd, u64_t delay_ms)  // re-arm timer_fd to fire once after delay_ms,used by server for driving the timer wheel
+// u64_t(-1) for disarm
 {
-    int ret;
-    epoll_event ev;
-
     itimerspec its;
     memset(&its, 0, sizeof(its));
 
-    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
-        mylog(log_fatal, "timer_fd create error\n");
-        myexit(1);
+    if (delay_ms != u64_t(-1)) {
+        its.it_value.tv_sec = (delay_ms / 1000);
+        its.it_value.tv_nsec = (delay_ms % 1000) * 1000ll * 1000ll;
+        if (delay_ms == 0) its.it_value.tv_nsec = 1;  // imidiately,all zero means disarm
     }
-    its.it_interval.tv_sec = (timer_interval / 1000);
-    its.it_interval.tv_nsec = (timer_interval % 1000) * 1000ll * 1000ll;
-    its.it_value.tv_nsec = 1;  // imidiately
-    timerfd_settime(timer_fd, 0, &its, 0);
-
-    fd64 = fd_manager.create(timer_fd);
+    if (timerfd_settime(timer_fd, 0, &its, 0) != 0) {
+        mylog(log_fatal, "timerfd_settime failed %s\n", strerror(errno));
+        myexit(-1);
+    }
+    return 0;
+}
 
-    ev.events = EPOLLIN;
-    ev.data.u64 = fd64;  ////difference
+int set_timer_at_us(int timer_fd, u64_t deadline_us)  // arm timer_fd to fire at deadline_us of get_current_time_us(),with full precision
+// 0 for disarm
+{
+    itimerspec its;
+    memset(&its, 0, sizeof(its));
 
-    ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, timer_fd, &ev);
-    if (ret < 0) {
-        mylog(log_fatal, "epoll_ctl return %d\n", ret);
+    if (deadline_us != 0) {  // cached clock is CLOCK_MONOTONIC,same as timer_fd
+        its.it_value.tv_sec = deadline_us / 1000000llu;
+        its.it_value.tv_nsec = (deadline_us % 1000000llu) * 1000ll;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, 0) != 0) {
+        mylog(log_fatal, "timerfd_settime failed %s\n", strerror(errno));
         myexit(-1);
     }
     return 0;
@@ -1185,7 +2125,7 @@ int keep_iptables_rule()  // magic to work on a machine without grep/iptables --
             keep_rule_last_time=tmp_current_time;
     }*/
 
-    mylog(log_debug, "keep_iptables_rule begin %llu\n", get_current_time());
+    mylog(log_debug, "keep_iptables_rule begin %llu\n", read_clock_us() / 1000);  // runs on keep_thread,dont touch the cached clock
     iptables_rule_keep_index += 1;
     iptables_rule_keep_index %= 2;
 
@@ -1210,7 +2150,7 @@ int keep_iptables_rule()  // magic to work on a machine without grep/iptables --
     if (run_command(rule_keep_add[i], output, show_log) != 0)
         mylog(log_warn, "rule_keep_del failed %d\n", i);
 
-    mylog(log_debug, "keep_iptables_rule end %llu\n", get_current_time());
+    mylog(log_debug, "keep_iptables_rule end %llu\n", read_clock_us() / 1000);
     return 0;
 }
 
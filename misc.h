@@ -27,21 +27,20 @@ extern int ttl_value;
 
 const u32_t max_handshake_conn_num = 10000;
 const u32_t max_ready_conn_num = 1000;
-const u32_t anti_replay_window_size = 4000;
 const int max_conv_num = 10000;
 
 const u32_t client_handshake_timeout = 5000;  // unit ms
-const u32_t client_retry_interval = 1000;     // ms
+const u32_t client_retry_interval = 1000;     // ms,largest gap between resends of a handshake
+const u32_t client_retry_min = 200;           // ms,first resend,the gap doubles from here with some jitter
+const u32_t client_resume_timeout = 1000;     // ms,a resumption that isnt answered by then falls back to a full handshake
 
 const u32_t server_handshake_timeout = client_handshake_timeout + 5000;  // this should be longer than clients. client retry initially ,server retry passtively
+const u32_t handshake_cookie_slot = client_handshake_timeout;  // ms,a cookie is accepted in its slot and the next one,so it lives longer than handshake2 of client
 
 const int conv_clear_ratio = 30;  // conv grabage collecter check 1/30 of all conv one time
-const int conn_clear_ratio = 50;
 const int conv_clear_min = 1;
-const int conn_clear_min = 1;
 
 const u32_t conv_clear_interval = 1000;  // ms
-const u32_t conn_clear_interval = 1000;  // ms
 
 const i32_t max_fail_time = 0;  // disable
 
@@ -49,6 +48,8 @@ const u32_t heartbeat_interval = 600;  // ms
 
 const u32_t timer_interval = 400;  // ms. this should be smaller than heartbeat_interval and retry interval;
 
+const u32_t timer_wheel_tick = 10;  // ms. granularity of server's timer wheel
+
 const uint32_t conv_timeout = 180000;  // ms. 120 second
 // const u32_t conv_timeout=30000; //for test
 
@@ -102,7 +103,7 @@ extern my_id_t const_id;  // an id used for connection recovery,its generated ra
 extern int udp_fd;                 // for client only. client use this fd to listen and handle udp connection
 extern int bind_fd;                // bind only,never send or recv.  its just a dummy fd for bind,so that other program wont occupy the same port
 extern int epollfd;                // fd for epoll
-extern int timer_fd;               // the general timer fd for client and server.for server this is not the only timer find,every connection has a timer fd.
+extern int timer_fd;               // the general timer fd for client and server.for server it drives the timer wheel
 extern int fail_time_counter;      // determine if the max_fail_time is reached
 extern int epoll_trigger_counter;  // for debug only
 extern int debug_flag;             // for debug only
@@ -129,6 +130,11 @@ extern unordered_map<int, const char *> raw_mode_tostring;
 extern int about_to_exit;
 
 extern int socket_buf_size;
+extern int udp_offload;
+extern int upstream_pool_size;
+extern char metrics_sock[1000];
+extern char replay_file[1000];
+extern int replay_loops;
 
 extern pthread_t keep_thread;
 extern int keep_thread_running;
@@ -138,8 +144,10 @@ void print_help();
 void iptables_rule();
 void pre_process_arg(int argc, char *argv[]);  // mainly for load conf file;
 int unit_test();
+int bench_test();
 int set_timer(int epollfd, int &timer_fd);
-int set_timer_server(int epollfd, int &timer_fd, fd64_t &fd64);
+int set_timer_oneshot(int timer_fd, u64_t delay_ms);
+int set_timer_at_us(int timer_fd, u64_t deadline_us);
 int handle_lower_level(raw_info_t &raw_info);
 
 int add_iptables_rule(const char *);
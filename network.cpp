@@ -8,6 +8,7 @@
 #include "network.h"
 #include "log.h"
 #include "misc.h"
+#include "stats.h"
 
 int g_fix_gro = 0;
 
@@ -24,6 +25,8 @@ int filter_port = -1;
 
 int disable_bpf_filter = 0;  // for test only,most time no need to disable this
 
+int replay_mode = 0;  // server_replay_pcap() fills g_packet_buf itself,and nothing is really sent to the raw socket
+
 // u32_t bind_address_uint32=0;
 
 int lower_level = 0;
@@ -75,9 +78,8 @@ int pcap_captured_full_len = -1;
 pcap_t *pcap_handle;
 int pcap_link_header_len = -1;
 // int pcap_cnt=0;
-queue_t my_queue;
+spsc_ring_t pcap_ring;
 
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t pcap_mutex = PTHREAD_MUTEX_INITIALIZER;
 int use_pcap_mutex = 1;
 
@@ -306,14 +308,10 @@ void my_packet_handler(
     if ((int)packet_header->caplen < pcap_link_header_len) return;
     // mylog(log_debug,"and its vaild!\n");
 
-    pthread_mutex_lock(&queue_mutex);
-    if (!my_queue.full())
-        my_queue.push_back((char *)pkt_data, (int)(packet_header->caplen));
-    pthread_mutex_unlock(&queue_mutex);
+    if (pcap_ring.push((char *)pkt_data, (int)(packet_header->caplen)) == 1)  // only wake up the loop if it has drained the ring
+        ev_async_send(g_default_loop, &async_watcher);
 
     // pcap_cnt++;
-
-    ev_async_send(g_default_loop, &async_watcher);
     return;
 }
 
@@ -503,6 +501,7 @@ int init_raw_socket() {
     }
 
     assert(pcap_set_snaplen(pcap_handle, huge_data_len) == 0);
+    pcap_ring.init(huge_data_len, 32);
     assert(pcap_set_promisc(pcap_handle, 0) == 0);
     assert(pcap_set_timeout(pcap_handle, 1) == 0);
     assert(pcap_set_immediate_mode(pcap_handle, 1) == 0);
@@ -1061,41 +1060,122 @@ int find_lower_level_info(u32_t ip, u32_t &dest_ip, string &if_name, string &hw)
 #endif
 
 #ifdef UDP2RAW_LINUX
+struct raw_send_batch_t  // packets queued by send_raw_packet() between raw_send_batch_begin() and raw_send_batch_flush()
+{
+    static const int max_num = 32;
+    int active;
+    int cnt;
+    char bufs[max_num][buf_len];
+    int lens[max_num];
+    union {
+        sockaddr_in v4;
+        sockaddr_in6 v6;
+        sockaddr_ll ll;
+    } addrs[max_num];
+    socklen_t addr_lens[max_num];
+    raw_send_batch_t() {
+        active = 0;
+        cnt = 0;
+    }
+} raw_send_batch;
+
+void raw_send_batch_begin() {
+    assert(raw_send_batch.cnt == 0);
+    raw_send_batch.active = 1;
+}
+static int raw_send_batch_send()  // one sendmmsg for all queued packets
+{
+    raw_send_batch_t &b = raw_send_batch;
+    struct mmsghdr msgs[raw_send_batch_t::max_num];
+    struct iovec iovs[raw_send_batch_t::max_num];
+    for (int i = 0; i < b.cnt; i++) {
+        iovs[i].iov_base = b.bufs[i];
+        iovs[i].iov_len = b.lens[i];
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &b.addrs[i];
+        msgs[i].msg_hdr.msg_namelen = b.addr_lens[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = 0;
+    while (sent < b.cnt) {
+        int ret = sendmmsg(raw_send_fd, msgs + sent, b.cnt - sent, 0);
+        if (ret <= 0) {  // a full send buffer drops the rest,same as sendto failing one by one
+            mylog(log_trace, "sendmmsg failed,%d of %d sent,%s\n", sent, b.cnt, strerror(errno));
+            break;
+        }
+        sent += ret;
+    }
+    for (int i = 0; i < b.cnt; i++) {
+        if (i < sent) {
+            stat_add(stat_raw_pkts_out);
+            stat_add(stat_raw_bytes_out, b.lens[i]);
+        } else {
+            stat_add(stat_raw_send_error);
+        }
+    }
+    b.cnt = 0;
+    return sent;
+}
+int raw_send_batch_flush() {
+    int ret = raw_send_batch.cnt == 0 ? 0 : raw_send_batch_send();
+    raw_send_batch.active = 0;
+    return ret;
+}
 int send_raw_packet(raw_info_t &raw_info, const char *packet, int len) {
     const packet_info_t &send_info = raw_info.send_info;
     const packet_info_t &recv_info = raw_info.recv_info;
 
-    int ret;
+    union {
+        sockaddr_in v4;
+        sockaddr_in6 v6;
+        sockaddr_ll ll;
+    } addr;
+    socklen_t addr_len = 0;
+    memset(&addr, 0, sizeof(addr));
     if (lower_level == 0) {
         if (raw_ip_version == AF_INET) {
-            struct sockaddr_in sin = {0};
-            sin.sin_family = raw_ip_version;
+            addr.v4.sin_family = raw_ip_version;
             // sin.sin_port = htons(info.dst_port); //dont need this
-            sin.sin_addr.s_addr = send_info.new_dst_ip.v4;
-            ret = sendto(raw_send_fd, packet, len, 0, (struct sockaddr *)&sin, sizeof(sin));
+            addr.v4.sin_addr.s_addr = send_info.new_dst_ip.v4;
+            addr_len = sizeof(addr.v4);
         } else if (raw_ip_version == AF_INET6) {
-            struct sockaddr_in6 sin = {0};
-            sin.sin6_family = raw_ip_version;
+            addr.v6.sin6_family = raw_ip_version;
             // sin.sin_port = htons(info.dst_port); //dont need this
-            sin.sin6_addr = send_info.new_dst_ip.v6;
-            ret = sendto(raw_send_fd, packet, len, 0, (struct sockaddr *)&sin, sizeof(sin));
+            addr.v6.sin6_addr = send_info.new_dst_ip.v6;
+            addr_len = sizeof(addr.v6);
         } else {
             assert(0 == 1);
         }
 
     } else {
-        struct sockaddr_ll addr = {0};  //={0} not necessary
-        memcpy(&addr, &send_info.addr_ll, sizeof(addr));
-
-        ret = sendto(raw_send_fd, packet, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+        memcpy(&addr.ll, &send_info.addr_ll, sizeof(addr.ll));
+        addr_len = sizeof(addr.ll);
+    }
+
+    if (raw_send_batch.active && len <= buf_len) {
+        raw_send_batch_t &b = raw_send_batch;
+        memcpy(b.bufs[b.cnt], packet, len);
+        b.lens[b.cnt] = len;
+        memcpy(&b.addrs[b.cnt], &addr, addr_len);
+        b.addr_lens[b.cnt] = addr_len;
+        b.cnt++;
+        if (b.cnt == raw_send_batch_t::max_num) raw_send_batch_send();
+        return 0;
     }
+    if (raw_send_batch.cnt != 0) raw_send_batch_send();  // keep the order
+
+    int ret = replay_mode ? len : sendto(raw_send_fd, packet, len, 0, (struct sockaddr *)&addr, addr_len);
     if (ret == -1) {
         mylog(log_trace, "sendto failed\n");
+        stat_add(stat_raw_send_error);
         // perror("why?");
         return -1;
     } else {
         // mylog(log_info,"sendto succ\n");
     }
+    stat_add(stat_raw_pkts_out);
+    stat_add(stat_raw_bytes_out, len);
     return 0;
 }
 #endif
@@ -1128,6 +1208,8 @@ int send_raw_packet(raw_info_t &raw_info, const char *packet, int len) {
             assert(raw_ip_version == AF_INET6);
             libnet_write_raw_ipv6(libnet_handle, (const unsigned char *)packet, len);
         }
+        stat_add(stat_raw_pkts_out);
+        stat_add(stat_raw_bytes_out, len);
 #endif
     } else {
         char buf[buf_len];
@@ -1138,9 +1220,13 @@ int send_raw_packet(raw_info_t &raw_info, const char *packet, int len) {
         // pthread_mutex_lock(&pcap_mutex); looks like this is not necessary, and it harms performance
         int ret = pcap_sendpacket(pcap_handle, (const unsigned char *)buf, len + pcap_link_header_len);
         if (ret != 0) {
+            stat_add(stat_raw_send_error);
             mylog(log_warn, "pcap_sendpcaket failed with vaule %d,%s, data_len=%d\n", ret, pcap_geterr(pcap_handle), len);
             // pthread_mutex_unlock(&pcap_mutex);
             // myexit(-1);
+        } else {
+            stat_add(stat_raw_pkts_out);
+            stat_add(stat_raw_bytes_out, len);
         }
         // pthread_mutex_unlock(&pcap_mutex);
         /*
@@ -1245,8 +1331,12 @@ int pre_recv_raw_packet() {
 #ifdef UDP2RAW_LINUX
     assert(g_packet_buf_cnt == 0);
 
-    g_sockaddr_len = sizeof(g_sockaddr.ll);
-    g_packet_buf_len = recvfrom(raw_recv_fd, g_packet_buf, huge_data_len + 1, 0, (sockaddr *)&g_sockaddr, &g_sockaddr_len);
+    if (!replay_mode) {
+        g_sockaddr_len = sizeof(g_sockaddr.ll);
+        u64_t lat = lat_begin(lat_raw_recv);
+        g_packet_buf_len = recvfrom(raw_recv_fd, g_packet_buf, huge_data_len + 1, 0, (sockaddr *)&g_sockaddr, &g_sockaddr_len);
+        lat_record(lat_raw_recv, lat);
+    }
     // assert(g_sockaddr_len==sizeof(g_sockaddr.ll)); //g_sockaddr_len=18, sizeof(g_sockaddr.ll)=20, why its not equal? maybe its bc sll_halen is 6?
 
     // assert(g_addr_ll_size==sizeof(g_addr_ll));
@@ -1254,6 +1344,7 @@ int pre_recv_raw_packet() {
     if (g_packet_buf_len == huge_data_len + 1) {
         if (g_fix_gro == 0) {
             mylog(log_warn, "huge packet, data_len %d > %d,dropped\n", g_packet_buf_len, huge_data_len);
+            stat_add(stat_drop_huge_packet);
             return -1;
         } else {
             mylog(log_debug, "huge packet, data_len %d > %d,not dropped\n", g_packet_buf_len, huge_data_len);
@@ -1265,6 +1356,7 @@ int pre_recv_raw_packet() {
         if (g_fix_gro == 0) {
             mylog(log_warn, "huge packet, data_len %d > %d(max_data_len) dropped, maybe you need to turn down mtu at upper level, or you may take a look at --fix-gro\n", g_packet_buf_len,
                   max_data_len);
+            stat_add(stat_drop_huge_packet);
             return -1;
         } else {
             mylog(log_debug, "huge packet, data_len %d > %d(max_data_len) not dropped\n", g_packet_buf_len,
@@ -1277,6 +1369,8 @@ int pre_recv_raw_packet() {
         mylog(log_trace, "recv_len %d\n", g_packet_buf_len);
         return -1;
     }
+    stat_add(stat_raw_pkts_in);
+    stat_add(stat_raw_bytes_in, g_packet_buf_len);
     g_packet_buf_cnt++;
 #endif
     return 0;
@@ -1312,12 +1406,14 @@ int recv_raw_packet(char *&packet, int &len, int peek) {
 }
 #endif
 #ifdef UDP2RAW_MP
+char *g_packet_ptr;  // points into pcap_ring,the packet is parsed in place
+
 int recv_raw_packet(char *&packet, int &len, int peek) {
     assert(g_packet_buf_cnt == 1);
     if (!peek)
         g_packet_buf_cnt--;
 
-    packet = g_packet_buf;
+    packet = g_packet_ptr;
     len = g_packet_buf_len;
     return 0;
 }
@@ -1682,6 +1778,7 @@ int send_raw_tcp(raw_info_t &raw_info, const char *payload, int payloadlen) {  /
     } else {
         tcph->doff = 8;
         int i = sizeof(my_tcphdr);
+        const tcp_ooo_t &ooo = raw_info.ooo;
 
         send_raw_tcp_buf[i++] = 0x01;
         send_raw_tcp_buf[i++] = 0x01;
@@ -1703,6 +1800,20 @@ int send_raw_tcp(raw_info_t &raw_info, const char *payload, int payloadlen) {  /
         u32_t ts_ack = htonl(send_info.ts_ack);
         memcpy(&send_raw_tcp_buf[i], &ts_ack, sizeof(ts_ack));
         i += 4;
+
+        if (ooo.num != 0 && (seq_mode == 3 || seq_mode == 4)) {
+            int block_num = min(ooo.num, tcp_sack_max);
+            send_raw_tcp_buf[i++] = 0x01;
+            send_raw_tcp_buf[i++] = 0x01;
+            send_raw_tcp_buf[i++] = 0x05;  // sack
+            send_raw_tcp_buf[i++] = char(2 + 8 * block_num);
+            for (int j = 0; j < block_num; j++) {
+                write_u32(&send_raw_tcp_buf[i], ooo.start[j]);
+                write_u32(&send_raw_tcp_buf[i + 4], ooo.end[j]);
+                i += 8;
+            }
+            tcph->doff += 1 + 2 * block_num;
+        }
     }
 
     tcph->urg = 0;
@@ -2529,30 +2640,44 @@ int send_raw0(raw_info_t &raw_info, const char *payload, int payloadlen) {
     packet_info_t &send_info = raw_info.send_info;
     packet_info_t &recv_info = raw_info.recv_info;
     mylog(log_trace, "send_raw : from %s %d  to %s %d\n", send_info.new_src_ip.get_str1(), send_info.src_port, send_info.new_dst_ip.get_str2(), send_info.dst_port);
+    u64_t lat = lat_begin(lat_raw_send);
+    int ret;
     switch (raw_mode) {
         case mode_faketcp:
-            return send_raw_tcp(raw_info, payload, payloadlen);
+            ret = send_raw_tcp(raw_info, payload, payloadlen);
+            break;
         case mode_udp:
-            return send_raw_udp(raw_info, payload, payloadlen);
+            ret = send_raw_udp(raw_info, payload, payloadlen);
+            break;
         case mode_icmp:
-            return send_raw_icmp(raw_info, payload, payloadlen);
+            ret = send_raw_icmp(raw_info, payload, payloadlen);
+            break;
         default:
-            return -1;
+            ret = -1;
     }
+    lat_record(lat_raw_send, lat);
+    return ret;
 }
 int recv_raw0(raw_info_t &raw_info, char *&payload, int &payloadlen) {
     packet_info_t &send_info = raw_info.send_info;
     packet_info_t &recv_info = raw_info.recv_info;
+    u64_t lat = lat_begin(lat_raw_parse);
+    int ret;
     switch (raw_mode) {
         case mode_faketcp:
-            return recv_raw_tcp(raw_info, payload, payloadlen);
+            ret = recv_raw_tcp(raw_info, payload, payloadlen);
+            break;
         case mode_udp:
-            return recv_raw_udp(raw_info, payload, payloadlen);
+            ret = recv_raw_udp(raw_info, payload, payloadlen);
+            break;
         case mode_icmp:
-            return recv_raw_icmp(raw_info, payload, payloadlen);
+            ret = recv_raw_icmp(raw_info, payload, payloadlen);
+            break;
         default:
-            return -1;
+            ret = -1;
     }
+    lat_record(lat_raw_parse, lat);
+    return ret;
 }
 
 int after_send_raw0(raw_info_t &raw_info) {
@@ -2602,6 +2727,45 @@ int after_send_raw0(raw_info_t &raw_info) {
     }
     return 0;
 }
+void tcp_ooo_t::remove(int i) {
+    for (; i + 1 < num; i++) {
+        start[i] = start[i + 1];
+        end[i] = end[i + 1];
+    }
+    num--;
+}
+void tcp_ooo_t::insert(u32_t seg_start, u32_t seg_end) {
+    for (int i = 0; i < num;) {
+        if (larger_than_u32(seg_start, end[i]) || larger_than_u32(start[i], seg_end)) {  // neither overlaps nor touches
+            i++;
+            continue;
+        }
+        if (larger_than_u32(seg_start, start[i])) seg_start = start[i];
+        if (larger_than_u32(end[i], seg_end)) seg_end = end[i];
+        remove(i);
+        i = 0;  // the merged range may reach others now
+    }
+    if (num == tcp_ooo_max) num--;  // forget the oldest
+    for (int i = num; i > 0; i--) {
+        start[i] = start[i - 1];
+        end[i] = end[i - 1];
+    }
+    start[0] = seg_start;
+    end[0] = seg_end;
+    num++;
+}
+u32_t tcp_ooo_t::advance(u32_t ack_seq) {
+    for (int i = 0; i < num;) {
+        if (larger_than_u32(start[i], ack_seq)) {
+            i++;
+            continue;
+        }
+        if (larger_than_u32(end[i], ack_seq)) ack_seq = end[i];
+        remove(i);
+        i = 0;
+    }
+    return ack_seq;
+}
 int after_recv_raw0(raw_info_t &raw_info) {
     packet_info_t &send_info = raw_info.send_info;
     packet_info_t &recv_info = raw_info.recv_info;
@@ -2615,9 +2779,12 @@ int after_recv_raw0(raw_info_t &raw_info) {
                 if (larger_than_u32(recv_info.seq + raw_info.recv_info.data_len, send_info.ack_seq))
                     send_info.ack_seq = recv_info.seq + raw_info.recv_info.data_len;  // TODO only update if its larger
             } else if (seq_mode == 3 || seq_mode == 4) {
-                if (recv_info.seq == send_info.ack_seq) {
-                    send_info.ack_seq = recv_info.seq + raw_info.recv_info.data_len;  // currently we dont remembr tcp segments,this is the simplest way
-                    // TODO implement tcp segment remembering and SACK.
+                u32_t seg_end = recv_info.seq + raw_info.recv_info.data_len;
+                if (!larger_than_u32(recv_info.seq, send_info.ack_seq)) {  // in order,or overlaps what is acked
+                    if (larger_than_u32(seg_end, send_info.ack_seq)) send_info.ack_seq = seg_end;
+                    send_info.ack_seq = raw_info.ooo.advance(send_info.ack_seq);
+                } else {  // a hole before it,sacked until the sender fills it
+                    raw_info.ooo.insert(recv_info.seq, seg_end);
                 }
             }
         }
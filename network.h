@@ -16,6 +16,7 @@ extern int max_seq_mode;
 extern int filter_port;
 // extern u32_t bind_address_uint32;
 extern int disable_bpf_filter;
+extern int replay_mode;
 
 extern int lower_level;
 extern int lower_level_manual;
@@ -31,12 +32,12 @@ extern char g_packet_buf[huge_buf_len];
 extern int g_packet_buf_len;
 extern int g_packet_buf_cnt;
 #ifdef UDP2RAW_MP
-extern queue_t my_queue;
+extern spsc_ring_t pcap_ring;
+extern char *g_packet_ptr;
 
 extern ev_async async_watcher;
 extern struct ev_loop *g_default_loop;
 
-extern pthread_mutex_t queue_mutex;
 extern int use_pcap_mutex;
 
 extern int pcap_cnt;
@@ -235,9 +236,27 @@ struct packet_info_t  // todo change this to union
     packet_info_t();
 };
 
+const int tcp_ooo_max = 4;   // out of order ranges a faketcp connection remembers
+const int tcp_sack_max = 3;  // sack blocks that fit in the options next to timestamps
+
+struct tcp_ooo_t  // seq_mode 3 and 4,ranges received above ack_seq,most recently changed first like the sack blocks of rfc 2018.
+// the oldest range is forgotten when there are too many,udp2raw doesnt retransmit so the sender's rewind on dup acks fills a hole anyway
+{
+    u32_t start[tcp_ooo_max];
+    u32_t end[tcp_ooo_max];
+    int num;
+    tcp_ooo_t() {
+        num = 0;
+    }
+    void insert(u32_t seg_start, u32_t seg_end);  // merges with the ranges it touches
+    u32_t advance(u32_t ack_seq);                 // cumulative ack after absorbing the ranges it reaches
+    void remove(int i);
+};
+
 struct raw_info_t {
     packet_info_t send_info;
     packet_info_t recv_info;
+    tcp_ooo_t ooo;
     // int last_send_len;
     // int last_recv_len;
     bool peek = 0;
@@ -257,6 +276,9 @@ void remove_filter();
 
 #ifdef UDP2RAW_LINUX
 int init_ifindex(const char *if_name, int fd, int &index);
+
+void raw_send_batch_begin();  // queue packets of send_raw_packet() instead of sending them one by one
+int raw_send_batch_flush();   // send queued packets with sendmmsg,returns number sent
 #endif
 
 #ifdef UDP2RAW_MP
@@ -16,58 +16,125 @@
 #include "encrypt.h"
 #include "fd_manager.h"
 
-int server_on_timer_multi(conn_info_t &conn_info)  // for server. called when a timer is ready in epoll.for server,there will be one timer for every connection
-// there is also a global timer for server,but its not handled here
-{
-    char ip_port[max_addr_len];
-    // u32_t ip=conn_info.raw_info.send_info.dst_ip;
-    // u32_t port=conn_info.raw_info.send_info.dst_port;
+const u64_t upstream_pool_quarantine_ms = 5000;  // a released socket rests this long before it serves another conv
+
+struct upstream_pool_free_t {
+    fd64_t fd64;
+    u64_t release_time;
+};
+struct upstream_pool_t  // --upstream-pool. unconnected upstream udp sockets,each with its own local port.
+{                        // a socket serves one conv at a time,the port is what tells replies of different convs apart
+    list<upstream_pool_free_t> free_list;  // fifo in release order. late replies to the old conv arrive while the socket rests
+                                           // and are dropped,new sockets are created up to the cap in the meantime
+    int created;
+    upstream_pool_t() {
+        created = 0;
+    }
+} upstream_pool;
 
-    address_t tmp_addr;
-    tmp_addr.from_ip_port_new(raw_ip_version, &conn_info.raw_info.send_info.new_dst_ip, conn_info.raw_info.send_info.dst_port);
-    // sprintf(ip_port,"%s:%d",my_ntoa(ip),port);
-    tmp_addr.to_str(ip_port);
+static void upstream_pool_drain(int fd)  // drop whatever is queued,it belongs to a conv that no longer exists
+{
+    char buf[buf_len];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+    }
+}
+static fd64_t upstream_pool_acquire(conn_info_t &conn_info, addr_str_t &ip_port)  // returns 0 if the pool is exhausted
+{
+    fd64_t fd64;
+    if (!upstream_pool.free_list.empty() && get_current_time() - upstream_pool.free_list.front().release_time >= upstream_pool_quarantine_ms) {
+        fd64 = upstream_pool.free_list.front().fd64;
+        upstream_pool.free_list.pop_front();
+        upstream_pool_drain(fd_manager.to_fd(fd64));
+    } else {
+        if (upstream_pool.created >= upstream_pool_size) {
+            mylog(log_warn, "[%s]upstream pool exhausted,%d sockets,%d of them resting after release\n", ip_port.c_str(), upstream_pool.created,
+                  (int)upstream_pool.free_list.size());
+            return 0;
+        }
+        int fd = socket(remote_addr.get_type(), SOCK_DGRAM, IPPROTO_UDP);
+        if (fd < 0) {
+            mylog(log_warn, "[%s]create upstream pool udp_fd error\n", ip_port.c_str());
+            return 0;
+        }
+        setnonblocking(fd);
+        set_buf_size(fd, socket_buf_size);
 
-    // keep_iptables_rule();
-    mylog(log_trace, "server timer!\n");
-    raw_info_t &raw_info = conn_info.raw_info;
+        address_t any = remote_addr;  // bind to an ephemeral port now,so the port is fixed for the socket's whole life
+        if (any.get_type() == AF_INET) {
+            any.inner.ipv4.sin_addr.s_addr = 0;
+            any.inner.ipv4.sin_port = 0;
+        } else {
+            memset(&any.inner.ipv6.sin6_addr, 0, sizeof(any.inner.ipv6.sin6_addr));
+            any.inner.ipv6.sin6_port = 0;
+        }
+        if (bind(fd, (struct sockaddr *)&any.inner, any.get_len()) != 0) {
+            mylog(log_warn, "[%s]bind upstream pool udp_fd failed,%s\n", ip_port.c_str(), strerror(errno));
+            sock_close(fd);
+            return 0;
+        }
 
-    assert(conn_info.state.server_current_state == server_ready);
+        fd64 = fd_manager.create(fd);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = fd64;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            mylog(log_warn, "[%s]add upstream pool udp_fd error\n", ip_port.c_str());
+            fd_manager.fd64_close(fd64);
+            return 0;
+        }
+        upstream_pool.created++;
+        mylog(log_debug, "[%s]upstream pool created fd=%d,%d in total\n", ip_port.c_str(), fd, upstream_pool.created);
+    }
+    fd_manager.get_info(fd64).p_conn_info = &conn_info;
+    return fd64;
+}
+void upstream_pool_release(fd64_t fd64)  // called by conv_manager when a conv is cleared
+{
+    upstream_pool_drain(fd_manager.to_fd(fd64));
+    fd_manager.get_info(fd64).p_conn_info = 0;
+    upstream_pool_free_t entry;
+    entry.fd64 = fd64;
+    entry.release_time = get_current_time();
+    upstream_pool.free_list.push_back(entry);
+}
 
-    if (conn_info.state.server_current_state == server_ready) {
-        conn_info.blob->conv_manager.s.clear_inactive(ip_port);
-        /*
-        if( get_current_time()-conn_info.last_hb_recv_time>heartbeat_timeout )
-        {
-                mylog(log_trace,"%lld %lld\n",get_current_time(),conn_info.last_state_time);
-                conn_info.server_current_state=server_nothing;
+void server_on_hb_timer(wheel_timer_t *timer)  // heartbeat deadline of a ready connection,driven by the timer wheel
+{
+    conn_info_t &conn_info = *(conn_info_t *)timer->data;
 
-                //conn_manager.current_ready_ip=0;
-                //conn_manager.current_ready_port=0;
+    mylog(log_trace, "server hb timer!\n");
 
-                mylog(log_info,"changed state to server_nothing\n");
-                return 0;
-        }*/
-        // dont need to do this at server,conn_manger will clear expired connections
+    assert(conn_info.state.server_current_state == server_ready);
 
-        if (get_current_time() - conn_info.last_hb_sent_time < heartbeat_interval) {
-            return 0;
-        }
+    pmtu_on_timer(conn_info);
 
-        if (hb_mode == 0)
-            send_safer(conn_info, 'h', hb_buf, 0);  /////////////send
-        else
-            send_safer(conn_info, 'h', hb_buf, hb_len);
+    if (get_current_time() >= next_heartbeat_time(conn_info)) {
+        send_heartbeat(conn_info);  /////////////send
         conn_info.last_hb_sent_time = get_current_time();
 
         mylog(log_debug, "heart beat sent<%x,%x>\n", conn_info.my_id, conn_info.oppsite_id);
-    } else {
-        mylog(log_fatal, "this shouldnt happen!\n");
-        myexit(-1);
     }
-    return 0;
+    // dont need to check heartbeat_timeout here,conn_manger will clear expired connections
+    timer_wheel.add(timer, next_heartbeat_time(conn_info));
+}
+void server_on_conv_timer(wheel_timer_t *timer)  // fires when the oldest conv of a connection may have expired
+{
+    conn_info_t &conn_info = *(conn_info_t *)timer->data;
+    conv_manager_t<u64_t> &conv_manager = conn_info.blob->conv_manager.s;
+
+    assert(conn_info.state.server_current_state == server_ready);
+
+    if (conv_manager.get_size() > 0) {
+        char ip_port[max_addr_len];
+        address_t tmp_addr;
+        tmp_addr.from_ip_port_new(raw_ip_version, &conn_info.raw_info.send_info.new_dst_ip, conn_info.raw_info.send_info.dst_port);
+        tmp_addr.to_str(ip_port);
+
+        conv_manager.clear_inactive0(ip_port);
+    }
+    timer_wheel.add(timer, conv_manager.next_clear_time());
 }
-int server_on_raw_recv_ready(conn_info_t &conn_info, char *ip_port, char type, char *data, int data_len)  // called while the state for a connection is server_ready
+int server_on_raw_recv_ready(conn_info_t &conn_info, addr_str_t &ip_port, char type, char *data, int data_len)  // called while the state for a connection is server_ready
 // receives data and heart beat by recv_safer.
 {
     raw_info_t &raw_info = conn_info.raw_info;
@@ -86,8 +153,9 @@ int server_on_raw_recv_ready(conn_info_t &conn_info, char *ip_port, char type, c
 
     if (type == 'h' && data_len >= 0) {
         // u32_t tmp = ntohl(*((u32_t *) &data[sizeof(u32_t)]));
-        mylog(log_debug, "[%s][hb]received hb \n", ip_port);
+        mylog(log_debug, "[%s][hb]received hb \n", ip_port.c_str());
         conn_info.last_hb_recv_time = get_current_time();
+        pmtu_on_hb(conn_info, data, data_len);
         return 0;
     } else if (type == 'd' && data_len >= int(sizeof(u32_t))) {
         // u32_t tmp_conv_id = ntohl(*((u32_t *) &data[0]));
@@ -95,15 +163,16 @@ int server_on_raw_recv_ready(conn_info_t &conn_info, char *ip_port, char type, c
         memcpy(&tmp_conv_id, &data[0], sizeof(tmp_conv_id));
         tmp_conv_id = ntohl(tmp_conv_id);
 
-        if (hb_mode == 0)
+        if (conn_hb_mode(conn_info) != 1)
             conn_info.last_hb_recv_time = get_current_time();
 
         mylog(log_trace, "conv:%u\n", tmp_conv_id);
         if (!conn_info.blob->conv_manager.s.is_conv_used(tmp_conv_id)) {
             if (conn_info.blob->conv_manager.s.get_size() >= max_conv_num) {
                 mylog(log_warn,
-                      "[%s]ignored new conv %x connect bc max_conv_num exceed\n", ip_port,
+                      "[%s]ignored new conv %x connect bc max_conv_num exceed\n", ip_port.c_str(),
                       tmp_conv_id);
+                stat_add(stat_drop_max_conv);
                 return 0;
             }
 
@@ -137,28 +206,38 @@ int server_on_raw_recv_ready(conn_info_t &conn_info, char *ip_port, char type, c
                     return -1;
             }*/
 
-            int new_udp_fd = remote_addr.new_connected_udp_fd();
-            if (new_udp_fd < 0) {
-                mylog(log_warn, "[%s]new_connected_udp_fd() failed\n", ip_port);
-                return -1;
-            }
+            fd64_t new_udp_fd64;
+            if (upstream_pool_size > 0) {
+                new_udp_fd64 = upstream_pool_acquire(conn_info, ip_port);
+                if (new_udp_fd64 == 0) {
+                    mylog(log_warn, "[%s]new conv %x ignored\n", ip_port.c_str(), tmp_conv_id);
+                    stat_add(stat_drop_pool_exhausted);
+                    return -1;
+                }
+            } else {
+                int new_udp_fd = remote_addr.new_connected_udp_fd();
+                if (new_udp_fd < 0) {
+                    mylog(log_warn, "[%s]new_connected_udp_fd() failed\n", ip_port.c_str());
+                    return -1;
+                }
 
-            struct epoll_event ev;
+                struct epoll_event ev;
 
-            fd64_t new_udp_fd64 = fd_manager.create(new_udp_fd);
-            fd_manager.get_info(new_udp_fd64).p_conn_info = &conn_info;
+                new_udp_fd64 = fd_manager.create(new_udp_fd);
+                fd_manager.get_info(new_udp_fd64).p_conn_info = &conn_info;
 
-            mylog(log_trace, "[%s]u64: %lld\n", ip_port, new_udp_fd64);
-            ev.events = EPOLLIN;
+                mylog(log_trace, "[%s]u64: %lld\n", ip_port.c_str(), new_udp_fd64);
+                ev.events = EPOLLIN;
 
-            ev.data.u64 = new_udp_fd64;
+                ev.data.u64 = new_udp_fd64;
 
-            int ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, new_udp_fd, &ev);
+                int ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, new_udp_fd, &ev);
 
-            if (ret != 0) {
-                mylog(log_warn, "[%s]add udp_fd error\n", ip_port);
-                close(new_udp_fd);
-                return -1;
+                if (ret != 0) {
+                    mylog(log_warn, "[%s]add udp_fd error\n", ip_port.c_str());
+                    close(new_udp_fd);
+                    return -1;
+                }
             }
 
             conn_info.blob->conv_manager.s.insert_conv(tmp_conv_id, new_udp_fd64);
@@ -169,31 +248,82 @@ int server_on_raw_recv_ready(conn_info_t &conn_info, char *ip_port, char type, c
 
             // pack_u64(conn_info.raw_info.recv_info.src_ip,conn_info.raw_info.recv_info.src_port);
 
-            mylog(log_info, "[%s]new conv conv_id=%x, assigned fd=%d\n", ip_port,
-                  tmp_conv_id, new_udp_fd);
+            mylog(log_info, "[%s]new conv conv_id=%x, assigned fd=%d\n", ip_port.c_str(),
+                  tmp_conv_id, fd_manager.to_fd(new_udp_fd64));
         }
 
-        fd64_t fd64 = conn_info.blob->conv_manager.s.find_data_by_conv(tmp_conv_id);
+        traffic_stats_t *traffic;
+        fd64_t fd64 = conn_info.blob->conv_manager.s.find_data_by_conv(tmp_conv_id, &traffic);
 
         conn_info.blob->conv_manager.s.update_active_time(tmp_conv_id);
 
         int fd = fd_manager.to_fd(fd64);
 
-        mylog(log_trace, "[%s]received a data from fake tcp,len:%d\n", ip_port, data_len);
-        int ret = send(fd, data + sizeof(u32_t),
+        mylog(log_trace, "[%s]received a data from fake tcp,len:%d\n", ip_port.c_str(), data_len);
+        int ret;
+        u64_t lat = lat_begin(lat_udp_send);
+        if (replay_mode)  // egress is stubbed while replaying a pcap
+            ret = data_len - (sizeof(u32_t));
+        else if (upstream_pool_size > 0)
+            ret = sendto(fd, data + sizeof(u32_t), data_len - (sizeof(u32_t)), 0, (struct sockaddr *)&remote_addr.inner, remote_addr.get_len());
+        else
+            ret = send(fd, data + sizeof(u32_t),
                        data_len - (sizeof(u32_t)), 0);
+        lat_record(lat_udp_send, lat);
 
-        mylog(log_trace, "[%s]%d byte sent  ,fd :%d\n ", ip_port, ret, fd);
+        mylog(log_trace, "[%s]%d byte sent  ,fd :%d\n ", ip_port.c_str(), ret, fd);
         if (ret < 0) {
             mylog(log_warn, "send returned %d\n", ret);
+            stat_add(stat_udp_send_error);
             // perror("what happened????");
+        } else {
+            stat_add(stat_udp_pkts_out);
+            stat_add(stat_udp_bytes_out, ret);
+            traffic->add_out(ret);
         }
         return 0;
     }
     return 0;
 }
 
-int server_on_raw_recv_pre_ready(conn_info_t &conn_info, char *ip_port, u32_t tmp_oppsite_const_id)  // do prepare work before state change to server ready for a specifc connection
+static void server_grab_conn(conn_info_t &conn_info, conn_info_t &ori_conn_info, addr_str_t &ip_port)  // the ready conn of a returning client moves to
+// the address of its new handshake,its convs survive. conn_info is left idle at the old address
+{
+    address_t addr1;
+    addr1.from_ip_port_new(raw_ip_version, &ori_conn_info.raw_info.recv_info.new_src_ip, ori_conn_info.raw_info.recv_info.src_port);
+    if (!conn_manager.exist(addr1))  // TODO remove this
+    {
+        mylog(log_fatal, "[%s]this shouldnt happen\n", ip_port.c_str());
+        myexit(-1);
+    }
+    address_t addr2;
+    addr2.from_ip_port_new(raw_ip_version, &conn_info.raw_info.recv_info.new_src_ip, conn_info.raw_info.recv_info.src_port);
+    if (!conn_manager.exist(addr2))  // TODO remove this
+    {
+        mylog(log_fatal, "[%s]this shouldnt happen2\n", ip_port.c_str());
+        myexit(-1);
+    }
+    conn_info_t *&p_ori = conn_manager.find_insert_p(addr1);
+    conn_info_t *&p = conn_manager.find_insert_p(addr2);
+    conn_info_t *tmp = p;
+    p = p_ori;
+    p_ori = tmp;
+    p->addr = addr2;  // keep keys of conn_manager.mp in sync,expire_timer relies on it
+    p_ori->addr = addr1;
+
+    // ori_conn_info.state.server_current_state=server_ready;
+    ori_conn_info.recover(conn_info);
+
+    // send_safer(ori_conn_info, 'h',hb_buf, hb_len);
+    // ori_conn_info.blob->anti_replay.re_init();
+    send_heartbeat(ori_conn_info);  /////////////send
+
+    ori_conn_info.last_hb_recv_time = get_current_time();
+
+    conn_info.state.server_current_state = server_idle;
+    conn_info.oppsite_const_id = 0;
+}
+int server_on_raw_recv_pre_ready(conn_info_t &conn_info, addr_str_t &ip_port, u32_t tmp_oppsite_const_id)  // do prepare work before state change to server ready for a specifc connection
 // connection recovery is also handle here
 {
     // u32_t ip;uint16_t port;
@@ -202,14 +332,15 @@ int server_on_raw_recv_pre_ready(conn_info_t &conn_info, char *ip_port, u32_t tm
     // char ip_port[40];
     // sprintf(ip_port,"%s:%d",my_ntoa(ip),port);
 
-    mylog(log_info, "[%s]received handshake oppsite_id:%x  my_id:%x\n", ip_port, conn_info.oppsite_id, conn_info.my_id);
+    mylog(log_info, "[%s]received handshake oppsite_id:%x  my_id:%x\n", ip_port.c_str(), conn_info.oppsite_id, conn_info.my_id);
 
-    mylog(log_info, "[%s]oppsite const_id:%x \n", ip_port, tmp_oppsite_const_id);
+    mylog(log_info, "[%s]oppsite const_id:%x \n", ip_port.c_str(), tmp_oppsite_const_id);
     if (conn_manager.const_id_mp.find(tmp_oppsite_const_id) == conn_manager.const_id_mp.end()) {
         // conn_manager.const_id_mp=
 
         if (conn_manager.ready_num >= max_ready_conn_num) {
-            mylog(log_info, "[%s]max_ready_conn_num,cant turn to ready\n", ip_port);
+            mylog(log_info, "[%s]max_ready_conn_num,cant turn to ready\n", ip_port.c_str());
+            stat_add(stat_handshake_rejected);
             conn_info.state.server_current_state = server_idle;
             return 0;
         }
@@ -231,19 +362,22 @@ int server_on_raw_recv_pre_ready(conn_info_t &conn_info, char *ip_port, u32_t tm
 
         conn_info.last_hb_sent_time = conn_info.last_hb_recv_time;  //=get_current_time()
 
-        if (hb_mode == 0)
-            send_safer(conn_info, 'h', hb_buf, 0);  /////////////send
-        else
-            send_safer(conn_info, 'h', hb_buf, hb_len);
+        send_heartbeat(conn_info);  /////////////send
 
-        mylog(log_info, "[%s]changed state to server_ready\n", ip_port);
+        mylog(log_info, "[%s]changed state to server_ready%s\n", ip_port.c_str(), conn_info.adaptive_hb ? ",adaptive heartbeat" : "");
+        stat_add(stat_handshake_ok);
         conn_info.blob->anti_replay.re_init();
 
         // g_conn_info=conn_info;
-        int new_timer_fd;
-        set_timer_server(epollfd, new_timer_fd, conn_info.timer_fd64);
+        conn_info.hb_timer.cb = server_on_hb_timer;
+        conn_info.hb_timer.data = &conn_info;
+        timer_wheel.add(&conn_info.hb_timer, conn_info.last_hb_sent_time + heartbeat_interval);
 
-        fd_manager.get_info(conn_info.timer_fd64).p_conn_info = &conn_info;
+        conn_info.conv_timer.cb = server_on_conv_timer;
+        conn_info.conv_timer.data = &conn_info;
+        timer_wheel.add(&conn_info.conv_timer, conn_info.blob->conv_manager.s.next_clear_time());
+
+        timer_wheel.add(&conn_info.expire_timer, conn_manager.get_expire_time(conn_info));  // deadline changed from handshake timeout to conn timeout
         // assert(conn_manager.timer_fd_mp.find(new_timer_fd)==conn_manager.timer_fd_mp.end());
         // conn_manager.timer_fd_mp[new_timer_fd] = &conn_info;//pack_u64(ip,port);
 
@@ -260,57 +394,97 @@ int server_on_raw_recv_pre_ready(conn_info_t &conn_info, char *ip_port, u32_t tm
 
         if (ori_conn_info.state.server_current_state == server_ready) {
             if (conn_info.last_state_time < ori_conn_info.last_state_time) {
-                mylog(log_info, "[%s]conn_info.last_state_time<ori_conn_info.last_state_time. ignored new handshake\n", ip_port);
+                mylog(log_info, "[%s]conn_info.last_state_time<ori_conn_info.last_state_time. ignored new handshake\n", ip_port.c_str());
                 conn_info.state.server_current_state = server_idle;
                 conn_info.oppsite_const_id = 0;
                 return 0;
             }
-            address_t addr1;
-            addr1.from_ip_port_new(raw_ip_version, &ori_conn_info.raw_info.recv_info.new_src_ip, ori_conn_info.raw_info.recv_info.src_port);
-            if (!conn_manager.exist(addr1))  // TODO remove this
-            {
-                mylog(log_fatal, "[%s]this shouldnt happen\n", ip_port);
-                myexit(-1);
-            }
-            address_t addr2;
-            addr2.from_ip_port_new(raw_ip_version, &conn_info.raw_info.recv_info.new_src_ip, conn_info.raw_info.recv_info.src_port);
-            if (!conn_manager.exist(addr2))  // TODO remove this
-            {
-                mylog(log_fatal, "[%s]this shouldnt happen2\n", ip_port);
-                myexit(-1);
-            }
-            conn_info_t *&p_ori = conn_manager.find_insert_p(addr1);
-            conn_info_t *&p = conn_manager.find_insert_p(addr2);
-            conn_info_t *tmp = p;
-            p = p_ori;
-            p_ori = tmp;
-
-            mylog(log_info, "[%s]grabbed a connection\n", ip_port);
-
-            // ori_conn_info.state.server_current_state=server_ready;
-            ori_conn_info.recover(conn_info);
-
-            // send_safer(ori_conn_info, 'h',hb_buf, hb_len);
-            // ori_conn_info.blob->anti_replay.re_init();
-            if (hb_mode == 0)
-                send_safer(ori_conn_info, 'h', hb_buf, 0);  /////////////send
-            else
-                send_safer(ori_conn_info, 'h', hb_buf, hb_len);
-
-            ori_conn_info.last_hb_recv_time = get_current_time();
-
-            conn_info.state.server_current_state = server_idle;
-            conn_info.oppsite_const_id = 0;
-
+            server_grab_conn(conn_info, ori_conn_info, ip_port);
+            mylog(log_info, "[%s]grabbed a connection\n", ip_port.c_str());
+            stat_add(stat_handshake_ok);
         } else {
-            mylog(log_fatal, "[%s]this should never happen\n", ip_port);
+            mylog(log_fatal, "[%s]this should never happen\n", ip_port.c_str());
             myexit(-1);
         }
         return 0;
     }
     return 0;
 }
-int server_on_raw_recv_handshake1(conn_info_t &conn_info, char *ip_port, char *data, int data_len)  // called when server received a handshake1 packet from client
+static my_id_t handshake_cookie(address_t &addr, my_id_t oppsite_id, u64_t slot)  // stateless id of server for a handshake,keyed hash of peer address,
+                                                                                 // id of the peer and a time slot. like a syn cookie,only a peer that received it can echo it
+{
+    static u64_t secret[2] = {0, 0};
+    if (secret[0] == 0) {
+        secret[0] = get_true_random_number_64() | 1;
+        secret[1] = get_true_random_number_64();
+    }
+    char buf[64];
+    int len = 0;
+    memcpy(buf + len, secret, sizeof(secret)), len += sizeof(secret);
+    memcpy(buf + len, &slot, sizeof(slot)), len += sizeof(slot);
+    memcpy(buf + len, &oppsite_id, sizeof(oppsite_id)), len += sizeof(oppsite_id);
+    if (addr.get_type() == AF_INET) {
+        memcpy(buf + len, &addr.inner.ipv4.sin_addr, 4), len += 4;
+        memcpy(buf + len, &addr.inner.ipv4.sin_port, 2), len += 2;
+    } else {
+        memcpy(buf + len, &addr.inner.ipv6.sin6_addr, 16), len += 16;
+        memcpy(buf + len, &addr.inner.ipv6.sin6_port, 2), len += 2;
+    }
+    unsigned char digest[16];
+    md5((uint8_t *)buf, len, digest);
+    my_id_t cookie;
+    memcpy(&cookie, digest, sizeof(cookie));
+    return cookie == 0 ? 1 : cookie;
+}
+static int server_on_resume(address_t &addr, addr_str_t &ip_port, raw_info_t &tmp_raw_info, char *data, int data_len)  // handshake with a ticket from an address
+// we dont know yet. the ready conn of that client takes over the new address right away,its own id stays so that the client could send data behind the ticket
+{
+    my_id_t tmp_oppsite_id = read_u32(data);
+    my_id_t tmp_my_id = read_u32(data + sizeof(my_id_t));
+    my_id_t tmp_oppsite_const_id = read_u32(data + sizeof(my_id_t) * 2);
+    u64_t ticket = handshake_ticket(data, data_len);
+
+    unordered_map<my_id_t, conn_info_t *>::iterator it = conn_manager.const_id_mp.find(tmp_oppsite_const_id);
+    if (it == conn_manager.const_id_mp.end() || it->second->state.server_current_state != server_ready || it->second->my_id != tmp_my_id ||
+        it->second->resume_ticket != ticket) {  // expired,restarted,or already used. the client falls back to a full handshake
+        mylog(log_info, "[%s]unknown or used resumption ticket,ignored\n", ip_port.c_str());
+        stat_add(stat_handshake_invalid);
+        return -1;
+    }
+    if (conn_manager.mp.size() >= max_handshake_conn_num) {
+        mylog(log_info, "[%s]reached max_handshake_conn_num,ignored resumption\n", ip_port.c_str());
+        stat_add(stat_handshake_rejected);
+        return 0;
+    }
+    conn_info_t &ori_conn_info = *it->second;
+
+    packet_info_t &send_info = tmp_raw_info.send_info;
+    packet_info_t &recv_info = tmp_raw_info.recv_info;
+    if (raw_mode == mode_faketcp) {
+        send_info.seq = recv_info.ack_seq;
+        send_info.ack_seq = recv_info.seq + recv_info.data_len;
+        send_info.ts_ack = recv_info.ts;
+    }
+    if (raw_mode == mode_icmp) {
+        send_info.my_icmp_seq = recv_info.my_icmp_seq;
+    }
+
+    conn_info_t &conn_info = conn_manager.find_insert(addr);
+    conn_info.raw_info = tmp_raw_info;
+    conn_info.my_id = ori_conn_info.my_id;
+    conn_info.oppsite_id = tmp_oppsite_id;
+    conn_info.frame_v2 = ori_conn_info.frame_v2;  // the session goes on as it was agreed
+    conn_info.adaptive_hb = ori_conn_info.adaptive_hb;
+    conn_info.resume_ticket = get_true_random_number_64() | 1;  // single use,a replayed handshake finds a different one
+    conn_info.state.server_current_state = server_handshake1;
+    conn_info.last_state_time = get_current_time();
+
+    server_grab_conn(conn_info, ori_conn_info, ip_port);
+    mylog(log_info, "[%s]resumed a connection,oppsite_id:%x my_id:%x\n", ip_port.c_str(), ori_conn_info.oppsite_id, ori_conn_info.my_id);
+    stat_add(stat_handshake_resumed);
+    return 0;
+}
+int server_on_raw_recv_handshake1(conn_info_t &conn_info, addr_str_t &ip_port, char *data, int data_len)  // called when server received a handshake1 packet from client
 {
     packet_info_t &send_info = conn_info.raw_info.send_info;
     packet_info_t &recv_info = conn_info.raw_info.recv_info;
@@ -323,7 +497,8 @@ int server_on_raw_recv_handshake1(conn_info_t &conn_info, char *ip_port, char *d
     // sprintf(ip_port,"%s:%d",my_ntoa(ip),port);
 
     if (data_len < int(3 * sizeof(my_id_t))) {
-        mylog(log_debug, "[%s] data_len=%d too short to be a handshake\n", ip_port, data_len);
+        mylog(log_debug, "[%s] data_len=%d too short to be a handshake\n", ip_port.c_str(), data_len);
+        stat_add(stat_handshake_invalid);
         return -1;
     }
     // id_t tmp_oppsite_id=  ntohl(* ((u32_t *)&data[0]));
@@ -346,9 +521,9 @@ int server_on_raw_recv_handshake1(conn_info_t &conn_info, char *ip_port, char *d
         if (raw_mode == mode_icmp) {
             send_info.my_icmp_seq = recv_info.my_icmp_seq;
         }
-        send_handshake(raw_info, conn_info.my_id, tmp_oppsite_id, const_id);  //////////////send
+        send_handshake(raw_info, conn_info.my_id, tmp_oppsite_id, const_id, handshake_flags(data, data_len) & handshake_flags_supported);  //////////////send
 
-        mylog(log_info, "[%s]changed state to server_handshake1,my_id is %x\n", ip_port, conn_info.my_id);
+        mylog(log_info, "[%s]changed state to server_handshake1,my_id is %x\n", ip_port.c_str(), conn_info.my_id);
     } else if (tmp_my_id == conn_info.my_id) {
         conn_info.oppsite_id = tmp_oppsite_id;
         // id_t tmp_oppsite_const_id=ntohl(* ((u32_t *)&data[sizeof(id_t)*2]));
@@ -356,6 +531,9 @@ int server_on_raw_recv_handshake1(conn_info_t &conn_info, char *ip_port, char *d
         my_id_t tmp_oppsite_const_id;
         memcpy(&tmp_oppsite_const_id, &data[sizeof(my_id_t) * 2], sizeof(tmp_oppsite_const_id));
         tmp_oppsite_const_id = ntohl(tmp_oppsite_const_id);
+        conn_info.frame_v2 = (handshake_flags(data, data_len) & handshake_flag_frame_v2) != 0;  // the client only asks for it after we echoed it
+        conn_info.adaptive_hb = (handshake_flags(data, data_len) & handshake_flag_adaptive_hb) != 0;
+        conn_info.resume_ticket = (handshake_flags(data, data_len) & handshake_flag_resume) ? get_true_random_number_64() | 1 : 0;
 
         if (raw_mode == mode_faketcp) {
             send_info.seq = recv_info.ack_seq;
@@ -370,7 +548,7 @@ int server_on_raw_recv_handshake1(conn_info_t &conn_info, char *ip_port, char *d
         server_on_raw_recv_pre_ready(conn_info, ip_port, tmp_oppsite_const_id);
 
     } else {
-        mylog(log_debug, "[%s]invalid my_id %x,my_id is %x\n", ip_port, tmp_my_id, conn_info.my_id);
+        mylog(log_debug, "[%s]invalid my_id %x,my_id is %x\n", ip_port.c_str(), tmp_my_id, conn_info.my_id);
     }
     return 0;
 }
@@ -404,10 +582,9 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
     address_t addr;
     addr.from_ip_port_new(raw_ip_version, &peek_info.new_src_ip, peek_info.src_port);
 
-    char ip_port[max_addr_len];
-    addr.to_str(ip_port);
+    addr_str_t ip_port(addr);  // only formatted if some log line prints it
     // sprintf(ip_port,"%s:%d",my_ntoa(ip),port);
-    mylog(log_trace, "[%s]peek_raw\n", ip_port);
+    mylog(log_trace, "[%s]peek_raw\n", ip_port.c_str());
 
     if (raw_mode == mode_faketcp && peek_info.syn == 1) {
         if (!conn_manager.exist(addr) || conn_manager.find_insert(addr).state.server_current_state != server_ready) {  // reply any syn ,before state become ready
@@ -444,7 +621,7 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
                 send_info.ack = 1;
                 send_info.ts_ack = recv_info.ts;
 
-                mylog(log_info, "[%s]received syn,sent syn ack back\n", ip_port);
+                mylog(log_info, "[%s]received syn,sent syn ack back\n", ip_port.c_str());
                 send_raw0(raw_info, 0, 0);
                 return 0;
             }
@@ -454,14 +631,7 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
         }
         return 0;
     }
-    if (!conn_manager.exist(addr)) {
-        if (conn_manager.mp.size() >= max_handshake_conn_num) {
-            mylog(log_info, "[%s]reached max_handshake_conn_num,ignored new handshake\n", ip_port);
-            discard_raw_packet();
-            // recv(raw_recv_fd, 0,0, 0  );//
-            return 0;
-        }
-
+    if (!conn_manager.exist(addr)) {  // nothing is kept for a new address until it echoes a valid cookie in handshake2
         raw_info_t tmp_raw_info;
 
         if (raw_mode == mode_icmp) {
@@ -471,31 +641,21 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
             return 0;
         }
         if (data_len < int(3 * sizeof(my_id_t))) {
-            mylog(log_debug, "[%s]too short to be a handshake\n", ip_port);
+            mylog(log_debug, "[%s]too short to be a handshake\n", ip_port.c_str());
+            stat_add(stat_handshake_invalid);
             return -1;
         }
 
-        // id_t zero=ntohl(* ((u32_t *)&data[sizeof(id_t)]));
-        my_id_t zero;
-        memcpy(&zero, &data[sizeof(my_id_t)], sizeof(zero));
-        zero = ntohl(zero);
-
-        if (zero != 0) {
-            mylog(log_debug, "[%s]not a invalid initial handshake\n", ip_port);
-            return -1;
-        }
+        my_id_t tmp_oppsite_id;
+        memcpy(&tmp_oppsite_id, &data[0], sizeof(tmp_oppsite_id));
+        tmp_oppsite_id = ntohl(tmp_oppsite_id);
 
-        mylog(log_info, "[%s]got packet from a new ip\n", ip_port);
-
-        conn_info_t &conn_info = conn_manager.find_insert(addr);
-        conn_info.raw_info = tmp_raw_info;
-        raw_info_t &raw_info = conn_info.raw_info;
+        my_id_t tmp_my_id;
+        memcpy(&tmp_my_id, &data[sizeof(my_id_t)], sizeof(tmp_my_id));
+        tmp_my_id = ntohl(tmp_my_id);
 
-        packet_info_t &send_info = conn_info.raw_info.send_info;
-        packet_info_t &recv_info = conn_info.raw_info.recv_info;
-
-        // conn_info.ip_port.ip=ip;
-        // conn_info.ip_port.port=port;
+        packet_info_t &send_info = tmp_raw_info.send_info;
+        packet_info_t &recv_info = tmp_raw_info.recv_info;
 
         send_info.new_src_ip = recv_info.new_dst_ip;
         send_info.src_port = recv_info.dst_port;
@@ -504,20 +664,50 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
         send_info.new_dst_ip = recv_info.new_src_ip;
 
         if (lower_level) {
-            handle_lower_level(raw_info);
+            handle_lower_level(tmp_raw_info);
+        }
+
+        u64_t slot = get_current_time() / handshake_cookie_slot;
+        if (tmp_my_id == 0) {  // handshake1,the cookie is our id
+            if (raw_mode == mode_faketcp) {
+                send_info.seq = recv_info.ack_seq;
+                send_info.ack_seq = recv_info.seq + recv_info.data_len;
+                send_info.ts_ack = recv_info.ts;
+            }
+            if (raw_mode == mode_icmp) {
+                send_info.my_icmp_seq = recv_info.my_icmp_seq;
+            }
+            my_id_t cookie = handshake_cookie(addr, tmp_oppsite_id, slot);
+            send_handshake(tmp_raw_info, cookie, tmp_oppsite_id, const_id, handshake_flags(data, data_len) & handshake_flags_supported);  // echo the flags we support
+            mylog(log_info, "[%s]got handshake1 from a new ip,replied with cookie %x\n", ip_port.c_str(), cookie);
+            return 0;
         }
 
-        // id_t tmp_oppsite_id=  ntohl(* ((u32_t *)&data[0]));
-        // mylog(log_info,"[%s]handshake1 received %x\n",ip_port,tmp_oppsite_id);
+        if (handshake_ticket(data, data_len) != 0) {  // a returning client,its ticket replaces the cookie
+            return server_on_resume(addr, ip_port, tmp_raw_info, data, data_len);
+        }
+        if (!replay_mode && tmp_my_id != handshake_cookie(addr, tmp_oppsite_id, slot) &&
+            tmp_my_id != handshake_cookie(addr, tmp_oppsite_id, slot - 1)) {  // a recorded client never has a valid cookie,accept it when replaying
+            mylog(log_debug, "[%s]invalid or expired cookie %x\n", ip_port.c_str(), tmp_my_id);
+            stat_add(stat_handshake_invalid);
+            return -1;
+        }
+        if (conn_manager.mp.size() >= max_handshake_conn_num) {
+            mylog(log_info, "[%s]reached max_handshake_conn_num,ignored new handshake\n", ip_port.c_str());
+            stat_add(stat_handshake_rejected);
+            return 0;
+        }
 
-        conn_info.my_id = get_true_random_number_nz();
+        conn_info_t &conn_info = conn_manager.find_insert(addr);
+        conn_info.raw_info = tmp_raw_info;
+        conn_info.my_id = tmp_my_id;
 
-        mylog(log_info, "[%s]created new conn,state: server_handshake1,my_id is %x\n", ip_port, conn_info.my_id);
+        mylog(log_info, "[%s]cookie verified,created new conn,my_id is %x\n", ip_port.c_str(), conn_info.my_id);
 
         conn_info.state.server_current_state = server_handshake1;
         conn_info.last_state_time = get_current_time();
 
-        server_on_raw_recv_handshake1(conn_info, ip_port, data, data_len);
+        server_on_raw_recv_handshake1(conn_info, ip_port, data, data_len);  // goes on to server_ready
         return 0;
     }
 
@@ -545,7 +735,9 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
             char type = type_vec[i];
             char *data = (char *)data_vec[i].c_str();  // be careful, do not append data to it
             int data_len = data_vec[i].length();
+            u64_t lat = lat_begin(lat_dispatch);
             server_on_raw_recv_ready(conn_info, ip_port, type, data, data_len);
+            lat_record(lat_dispatch, lat);
         }
         return 0;
     }
@@ -560,6 +752,59 @@ int server_on_raw_recv_multi()  // called when server received an raw packet
     return -1;
 }
 
+static int server_on_udp_recv_pool(conn_info_t &conn_info, fd64_t fd64, u32_t conv_id, traffic_stats_t &traffic)  // pooled sockets are unconnected,drain them in batches and check the source
+{
+    const int batch = 16;
+    static char bufs[batch][buf_len];
+    static struct mmsghdr msgs[batch];
+    static struct iovec iovs[batch];
+    static address_t::storage_t addrs[batch];
+
+    int fd = fd_manager.to_fd(fd64);
+    for (;;) {
+        for (int i = 0; i < batch; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = max_data_len + 1;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        u64_t lat = lat_begin(lat_udp_recv);
+        int n = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, 0);
+        lat_record(lat_udp_recv, lat);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) mylog(log_debug, "udp fd,recvmmsg failed,%s\n", strerror(errno));
+            break;
+        }
+        mylog(log_trace, "received %d packets from pooled udp_fd\n", n);
+        for (int i = 0; i < n; i++) {
+            int recv_len = msgs[i].msg_len;
+            address_t src;
+            src.from_sockaddr((struct sockaddr *)&addrs[i], msgs[i].msg_hdr.msg_namelen);
+            if (!(src == remote_addr)) {  // unconnected socket accepts anyone,only take replies of the upstream
+                mylog(log_debug, "packet from unexpected addr %s on pooled udp_fd,dropped\n", src.get_str());
+                continue;
+            }
+            if (recv_len == max_data_len + 1) {
+                mylog(log_warn, "huge packet, data_len > %d,dropped\n", max_data_len);
+                stat_add(stat_drop_huge_packet);
+                continue;
+            }
+            stat_add(stat_udp_pkts_in);
+            stat_add(stat_udp_bytes_in, recv_len);
+            traffic.add_in(recv_len);
+            if (recv_len >= mtu_warn) {
+                mylog(log_warn, "huge packet,data len=%d (>=%d).strongly suggested to set a smaller mtu at upper level,to get rid of this warn\n ", recv_len, mtu_warn);
+            }
+            send_data_safer(conn_info, bufs[i], recv_len, conv_id);
+        }
+        if (n < batch) break;
+    }
+    return 0;
+}
+
 int server_on_udp_recv(conn_info_t &conn_info, fd64_t fd64) {
     char buf[buf_len];
 
@@ -573,16 +818,22 @@ int server_on_udp_recv(conn_info_t &conn_info, fd64_t fd64) {
 
     assert(conn_info.blob->conv_manager.s.is_data_used(fd64));
 
-    u32_t conv_id = conn_info.blob->conv_manager.s.find_conv_by_data(fd64);
+    traffic_stats_t *traffic;
+    u32_t conv_id = conn_info.blob->conv_manager.s.find_conv_by_data(fd64, &traffic);
+
+    if (upstream_pool_size > 0) return server_on_udp_recv_pool(conn_info, fd64, conv_id, *traffic);
 
     int fd = fd_manager.to_fd(fd64);
 
+    u64_t lat = lat_begin(lat_udp_recv);
     int recv_len = recv(fd, buf, max_data_len + 1, 0);
+    lat_record(lat_udp_recv, lat);
 
     mylog(log_trace, "received a packet from udp_fd,len:%d\n", recv_len);
 
     if (recv_len == max_data_len + 1) {
         mylog(log_warn, "huge packet, data_len > %d,dropped\n", max_data_len);
+        stat_add(stat_drop_huge_packet);
         return -1;
     }
 
@@ -590,6 +841,9 @@ int server_on_udp_recv(conn_info_t &conn_info, fd64_t fd64) {
         mylog(log_debug, "udp fd,recv_len<0 continue,%s\n", strerror(errno));
         return -1;
     }
+    stat_add(stat_udp_pkts_in);
+    stat_add(stat_udp_bytes_in, recv_len);
+    traffic->add_in(recv_len);
 
     if (recv_len >= mtu_warn) {
         mylog(log_warn, "huge packet,data len=%d (>=%d).strongly suggested to set a smaller mtu at upper level,to get rid of this warn\n ", recv_len, mtu_warn);
@@ -606,12 +860,7 @@ int server_on_udp_recv(conn_info_t &conn_info, fd64_t fd64) {
     return 0;
 }
 
-int server_event_loop() {
-    char buf[buf_len];
-
-    int i, j, k;
-    int ret;
-
+static void server_init_bind_addr() {
     if (raw_ip_version == AF_INET) {
         if (local_addr.inner.ipv4.sin_addr.s_addr != 0) {
             bind_addr_used = 1;
@@ -626,6 +875,37 @@ int server_event_loop() {
         }
     }
     // bind_address_uint32=local_ip_uint32;//only server has bind adress,client sets it to zero
+}
+
+static int metrics_watched_fd = -1;  // client of --metrics-sock registered in epoll
+static void metrics_client_unwatch(int epollfd)  // before stats_serve()/stats_client_io(),they may close the fd
+{
+    if (metrics_watched_fd < 0) return;
+    epoll_event ev;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, metrics_watched_fd, &ev);
+    metrics_watched_fd = -1;
+}
+static void metrics_client_watch(int epollfd) {
+    int want_write;
+    int fd = stats_client_fd(&want_write);
+    if (fd < 0) return;
+    epoll_event ev;
+    ev.events = want_write ? EPOLLOUT : EPOLLIN;
+    ev.data.u64 = fd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        mylog(log_warn, "add metrics client to epoll error %s\n", strerror(errno));
+        return;
+    }
+    metrics_watched_fd = fd;
+}
+
+int server_event_loop() {
+    char buf[buf_len];
+
+    int i, j, k;
+    int ret;
+
+    server_init_bind_addr();
 
     if (lower_level) {
         if (lower_level_manual) {
@@ -686,8 +966,28 @@ int server_event_loop() {
 
     set_timer(epollfd, timer_fd);
 
-    u64_t begin_time = 0;
-    u64_t end_time = 0;
+    // timer of server, re-armed to the next deadline of the timer wheel
+    u64_t timer_armed_ms = 0;
+    timer_wheel.init(get_current_time(), timer_wheel_tick);
+
+    // deadlines of --coalesce,--fec and --pacing-rate need sub-ms precision,more than the timeout of epoll_wait has.
+    // not with --coarse-clock,the cached clock may lag the timer and it would keep firing till the next tick
+    int send_timer_fd = -1;
+    u64_t send_timer_armed_us = 0;
+    if (!use_coarse_clock) {
+        if ((send_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+            mylog(log_fatal, "send_timer_fd create error\n");
+            myexit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.u64 = send_timer_fd;
+        ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, send_timer_fd, &ev);
+        if (ret != 0) {
+            mylog(log_fatal, "add send_timer_fd to epoll error %s\n", strerror(errno));
+            myexit(-1);
+        }
+    }
+
 
     mylog(log_info, "now listening at %s\n", local_addr.get_str());
 
@@ -706,11 +1006,32 @@ int server_event_loop() {
         mylog(log_info, "fifo_file=%s\n", fifo_file);
     }
 
+    int metrics_fd = -1;
+
+    if (metrics_sock[0] != 0) {
+        metrics_fd = stats_listen(metrics_sock);
+        ev.events = EPOLLIN;
+        ev.data.u64 = metrics_fd;
+
+        ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, metrics_fd, &ev);
+        if (ret != 0) {
+            mylog(log_fatal, "add metrics_fd to epoll error %s\n", strerror(errno));
+            myexit(-1);
+        }
+    }
+
     while (1)  ////////////////////////
     {
         if (about_to_exit) myexit(0);
 
-        int nfds = epoll_wait(epollfd, events, max_events, 180 * 1000);
+        int wait_ms = 180 * 1000;
+        u64_t send_deadline = send_timer_fd < 0 ? send_next_deadline() : 0;
+        if (send_deadline != 0) {  // the timer wheel ticks at 10ms,too coarse for --coalesce and --fec-timeout
+            u64_t current_time_us = get_current_time_us();
+            wait_ms = send_deadline > current_time_us ? (send_deadline - current_time_us + 999) / 1000 : 0;
+        }
+        int nfds = epoll_wait(epollfd, events, max_events, wait_ms);
+        update_current_time();  // one clock read per iteration,handlers use the cached value
         if (nfds < 0) {  // allow zero
             if (errno == EINTR) {
                 mylog(log_info, "epoll interrupted by signal,continue\n");
@@ -726,26 +1047,26 @@ int server_event_loop() {
             epoll_trigger_counter++;
             // printf("%d %d %d %d\n",timer_fd,raw_recv_fd,raw_send_fd,n);
             if ((events[idx].data.u64) == (u64_t)timer_fd) {
-                if (debug_flag) begin_time = get_current_time();
-                conn_manager.clear_inactive();
+                update_current_time();  // timers always see fresh time
                 u64_t dummy;
                 int unused = read(timer_fd, &dummy, 8);
+                u64_t lat = lat_begin(lat_timer);
+                int fired = timer_wheel.advance(get_current_time());
+                lat_record(lat_timer, lat);
+                timer_armed_ms = 0;  // force re-arm,timer_fd is one-shot
                 // current_time_rough=get_current_time();
-                if (debug_flag) {
-                    end_time = get_current_time();
-                    mylog(log_debug, "timer_fd,%llu,%llu,%llu\n", begin_time, end_time, end_time - begin_time);
-                }
+                mylog(log_trace, "timer_fd,fired=%d\n", fired);
 
                 mylog(log_trace, "epoll_trigger_counter:  %d \n", epoll_trigger_counter);
                 epoll_trigger_counter = 0;
 
+            } else if (send_timer_fd >= 0 && events[idx].data.u64 == (u64_t)send_timer_fd) {
+                u64_t dummy;
+                int unused = read(send_timer_fd, &dummy, 8);
+                update_current_time();
+                send_timer_armed_us = 0;  // one-shot,flushed by send_flush_due() below
             } else if (events[idx].data.u64 == (u64_t)raw_recv_fd) {
-                if (debug_flag) begin_time = get_current_time();
                 server_on_raw_recv_multi();
-                if (debug_flag) {
-                    end_time = get_current_time();
-                    mylog(log_debug, "raw_recv_fd,%llu,%llu,%llu  \n", begin_time, end_time, end_time - begin_time);
-                }
             } else if (events[idx].data.u64 == (u64_t)fifo_fd) {
                 int len = read(fifo_fd, buf, sizeof(buf));
                 if (len < 0) {
@@ -757,43 +1078,205 @@ int server_event_loop() {
                 while (len >= 1 && buf[len - 1] == '\n')
                     buf[len - 1] = 0;
                 mylog(log_info, "got data from fifo,len=%d,s=[%s]\n", len, buf);
-                mylog(log_info, "unknown command\n");
+                if (strcmp(buf, "stats") == 0) {
+                    stats_dump(0);
+                } else if (strcmp(buf, "stats conv") == 0) {
+                    stats_dump(1);
+                } else if (strcmp(buf, "latency") == 0) {
+                    latency_dump();
+                } else if (strcmp(buf, "latency reset") == 0) {
+                    latency_reset();
+                } else {
+                    mylog(log_info, "unknown command\n");
+                }
+            } else if (events[idx].data.u64 == (u64_t)metrics_fd) {
+                metrics_client_unwatch(epollfd);
+                stats_serve(metrics_fd);
+                metrics_client_watch(epollfd);
+            } else if (metrics_watched_fd >= 0 && events[idx].data.u64 == (u64_t)metrics_watched_fd) {
+                metrics_client_unwatch(epollfd);
+                stats_client_io();
+                metrics_client_watch(epollfd);
             } else if (events[idx].data.u64 > u32_t(-1)) {
                 fd64_t fd64 = events[idx].data.u64;
-                if (!fd_manager.exist(fd64)) {
+                fd_info_t *p_fd_info = fd_manager.find_info(fd64);
+                if (p_fd_info == 0) {  // closed by an earlier event of the same batch
                     mylog(log_trace, "fd64 no longer exist\n");
-                    return -1;
+                    continue;
                 }
-                assert(fd_manager.exist_info(fd64));
-                conn_info_t *p_conn_info = fd_manager.get_info(fd64).p_conn_info;
-                conn_info_t &conn_info = *p_conn_info;
-                if (fd64 == conn_info.timer_fd64)  //////////timer_fd64
-                {
-                    if (debug_flag) begin_time = get_current_time();
-                    int fd = fd_manager.to_fd(fd64);
-                    u64_t dummy;
-                    int unused = read(fd, &dummy, 8);
-                    assert(conn_info.state.server_current_state == server_ready);  // TODO remove this for peformance
-                    server_on_timer_multi(conn_info);
-                    if (debug_flag) {
-                        end_time = get_current_time();
-                        mylog(log_debug, "(events[idx].data.u64 >>32u) == 2u ,%llu,%llu,%llu  \n", begin_time, end_time, end_time - begin_time);
-                    }
-                } else  // udp_fd64
-                {
-                    if (debug_flag) begin_time = get_current_time();
-                    server_on_udp_recv(conn_info, fd64);
-                    if (debug_flag) {
-                        end_time = get_current_time();
-                        mylog(log_debug, "(events[idx].data.u64 >>32u) == 1u,%lld,%lld,%lld  \n", begin_time, end_time, end_time - begin_time);
-                    }
+                if (p_fd_info->p_conn_info == 0) {  // idle socket of upstream pool,late reply of a cleared conv
+                    upstream_pool_drain(fd_manager.to_fd(fd64));
+                    continue;
                 }
+                conn_info_t &conn_info = *p_fd_info->p_conn_info;
+                // udp_fd64
+                server_on_udp_recv(conn_info, fd64);
             } else {
                 mylog(log_fatal, "unknown fd,this should never happen\n");
                 myexit(-1);
             }
         }
+        send_flush_due();
+        if (send_timer_fd >= 0) {
+            u64_t deadline = send_next_deadline();
+            if (deadline != send_timer_armed_us) {
+                set_timer_at_us(send_timer_fd, deadline);
+                send_timer_armed_us = deadline;
+            }
+        }
+        if (timer_armed_ms == 0 || timer_wheel.need_rearm(timer_armed_ms)) {  // a new deadline is earlier than the armed one
+            u64_t expire_ms = timer_wheel.next_expire_ms();
+            u64_t current_time = get_current_time();
+            if (expire_ms == 0) {  // wheel is empty
+                set_timer_oneshot(timer_fd, u64_t(-1));
+                timer_armed_ms = u64_t(-1);
+            } else {
+                set_timer_oneshot(timer_fd, expire_ms > current_time ? expire_ms - current_time : 0);
+                timer_armed_ms = expire_ms;
+            }
+        }
+    }
+    return 0;
+}
+
+static int replay_ip_offset(u32_t linktype, const unsigned char *frame, int len)  // offset of the ip header in a captured frame,-1 if it is not ipv4/ipv6
+{
+    int offset, proto_offset;
+    switch (linktype) {
+        case 1:  // ethernet
+            offset = 14, proto_offset = 12;
+            break;
+        case 113:  // linux cooked capture,tcpdump -i any
+            offset = 16, proto_offset = 14;
+            break;
+        case 276:  // linux cooked capture v2
+            offset = 20, proto_offset = 0;
+            break;
+        case 0:  // bsd loopback
+            offset = 4, proto_offset = -1;
+            break;
+        case 12:
+        case 14:
+        case 101:
+        case 228:
+        case 229:  // raw ip
+            offset = 0, proto_offset = -1;
+            break;
+        default:
+            return -1;
+    }
+    if (len < offset) return -1;
+    if (proto_offset >= 0) {
+        int proto = frame[proto_offset] << 8 | frame[proto_offset + 1];
+        if (linktype == 1 && proto == 0x8100 && len >= offset + 4) {  // one vlan tag
+            proto = frame[16] << 8 | frame[17];
+            offset += 4;
+        }
+        if (proto != 0x0800 && proto != 0x86dd) return -1;
+    }
+    return offset;
+}
+static int replay_frame_wanted(const unsigned char *ip, int len)  // what bpf filter and kernel would deliver to raw_recv_fd of this server
+{
+    int proto, l4_offset;
+    if (raw_ip_version == AF_INET) {
+        if (len < 20 || ip[0] >> 4 != 4) return 0;
+        if (bind_addr_used && memcmp(ip + 16, &bind_addr.v4, 4) != 0) return 0;
+        proto = ip[9];
+        l4_offset = (ip[0] & 0x0f) * 4;
+    } else {
+        if (len < 40 || ip[0] >> 4 != 6) return 0;
+        if (bind_addr_used && memcmp(ip + 24, &bind_addr.v6, 16) != 0) return 0;
+        proto = ip[6];
+        l4_offset = 40;
+    }
+    if (len < l4_offset + 4) return 0;
+    const unsigned char *l4 = ip + l4_offset;
+    if (raw_mode == mode_faketcp || raw_mode == mode_udp) {
+        if (proto != (raw_mode == mode_faketcp ? IPPROTO_TCP : IPPROTO_UDP)) return 0;
+        return u32_t(l4[2] << 8 | l4[3]) == local_addr.get_port();
+    }
+    if (raw_ip_version == AF_INET) return proto == IPPROTO_ICMP && l4[0] == 8;  // echo request,replies are from the server itself
+    return proto == IPPROTO_ICMPV6 && l4[0] == 128;
+}
+int server_replay_pcap()  // hidden option --replay-pcap. feed the client->server frames of a capture into server_on_raw_recv_multi(),
+                          // no socket is read and nothing is sent,so it needs no root and gives a repeatable cpu benchmark of the receive path
+{
+    FILE *fp = fopen(replay_file, "rb");
+    if (fp == 0) {
+        mylog(log_fatal, "cant open %s,%s\n", replay_file, strerror(errno));
+        myexit(-1);
+    }
+    u32_t file_header[6];  // magic,version,thiszone,sigfigs,snaplen,linktype
+    if (fread(file_header, sizeof(file_header), 1, fp) != 1) {
+        mylog(log_fatal, "%s is too short to be a pcap file\n", replay_file);
+        myexit(-1);
+    }
+    int swapped = 0;
+    if (file_header[0] == 0xa1b2c3d4 || file_header[0] == 0xa1b23c4d) {  // usec or nsec timestamps
+        swapped = 0;
+    } else if (file_header[0] == 0xd4c3b2a1 || file_header[0] == 0x4d3cb2a1) {
+        swapped = 1;
+    } else {
+        mylog(log_fatal, "%s is not a pcap file,magic=%x. pcapng is not supported,convert it with 'editcap -F pcap'\n", replay_file, file_header[0]);
+        myexit(-1);
+    }
+    u32_t linktype = (swapped ? __builtin_bswap32(file_header[5]) : file_header[5]) & 0xffff;  // upper bits are fcs info
+
+    server_init_bind_addr();
+    disable_bpf_filter = 1;  // there is no socket to attach it to,replay_frame_wanted() does its job
+    init_filter(local_addr.get_port());
+
+    vector<string> frames;  // ip packets,loaded before replaying so that file io is not measured
+    int total = 0;
+    u32_t record_header[4];  // ts_sec,ts_frac,incl_len,orig_len
+    while (fread(record_header, sizeof(record_header), 1, fp) == 1) {
+        u32_t incl_len = swapped ? __builtin_bswap32(record_header[2]) : record_header[2];
+        if (incl_len > 256 * 1024) {
+            mylog(log_fatal, "frame %d of %s has length %u,file corrupted?\n", total, replay_file, incl_len);
+            myexit(-1);
+        }
+        string frame(incl_len, 0);
+        if (incl_len > 0 && fread(&frame[0], incl_len, 1, fp) != 1) break;  // truncated capture
+        total++;
+        int offset = replay_ip_offset(linktype, (const unsigned char *)frame.c_str(), frame.length());
+        if (offset < 0) continue;
+        if (!replay_frame_wanted((const unsigned char *)frame.c_str() + offset, frame.length() - offset)) continue;
+        frames.push_back(frame.substr(offset));
+    }
+    fclose(fp);
+    mylog(log_info, "linktype=%u,%d frames in %s,%d of them are sent to %s\n", linktype, total, replay_file, (int)frames.size(), local_addr.get_str());
+    if (frames.empty()) {
+        mylog(log_fatal, "nothing to replay,check -l and --raw-mode\n");
+        myexit(-1);
+    }
+
+    epollfd = epoll_create1(0);  // udp sockets of new convs are added to it,but it is never polled
+    if (epollfd < 0) {
+        mylog(log_fatal, "epoll return %d\n", epollfd);
+        myexit(-1);
+    }
+    timer_wheel.init(get_current_time(), timer_wheel_tick);  // timers are registered but never advanced
+    replay_mode = 1;
+
+    u64_t elapsed_us = 0;
+    for (int loop = 0; loop < replay_loops; loop++) {
+        while (!conn_manager.mp.empty())  // every round starts again from the handshakes
+            conn_manager.erase(conn_manager.mp.begin());
+        u64_t begin = update_current_time();
+        for (int i = 0; i < (int)frames.size(); i++) {
+            update_current_time();
+            g_packet_buf_len = min((int)frames[i].length(), huge_data_len + 1);  // too long ones are handled as a truncated recvfrom()
+            memcpy(g_packet_buf, frames[i].c_str(), g_packet_buf_len);
+            server_on_raw_recv_multi();
+        }
+        elapsed_us += update_current_time() - begin;
     }
+    u64_t fed = (u64_t)frames.size() * replay_loops;
+    mylog(log_info, "replayed %llu frames in %llu loops,%.3f ms,%.1f ns per frame,%.0f frames per second\n", fed, (u64_t)replay_loops,
+          elapsed_us / 1000.0, elapsed_us * 1000.0 / fed, elapsed_us == 0 ? 0 : fed * 1000000.0 / elapsed_us);
+    stats_dump(0);
+    if (latency_sample_rate != 0) latency_dump();
     return 0;
 }
 
@@ -0,0 +1,410 @@
+/*
+ * stats.cpp
+ *
+ *  dump of the counters,to the log (fifo command "stats") or as prometheus text over a unix socket (--metrics-sock)
+ */
+
+#include "stats.h"
+#include "connection.h"
+#include "misc.h"
+#include "log.h"
+
+#if !defined(__MINGW32__)
+#include <sys/un.h>
+#include <sys/stat.h>
+#endif
+
+u64_t stats[stat_end];
+conn_info_t *stats_client_conn = 0;  // the only connection of client,set by client_event_loop()
+
+int latency_sample_rate = 0;
+int latency_countdown[lat_stage_end];
+latency_hist_t latency_hists[lat_stage_end];
+
+static const char *lat_stage_name[lat_stage_end] = {"raw_recv", "raw_parse", "decrypt", "dispatch", "udp_send", "udp_recv", "encrypt", "raw_send", "timer"};
+static u64_t tsc_base;  // read_tsc() and clock at latency_start(),to convert ticks to ns
+static u64_t ns_base;
+
+struct stat_desc_t {
+    const char *metric;
+    const char *labels;
+    const char *help;
+};
+
+static const stat_desc_t stat_desc[stat_end] = {
+    {"udp2raw_raw_packets_total", "dir=\"in\"", "raw packets received and sent"},
+    {"udp2raw_raw_bytes_total", "dir=\"in\"", "raw bytes received and sent"},
+    {"udp2raw_raw_packets_total", "dir=\"out\"", 0},
+    {"udp2raw_raw_bytes_total", "dir=\"out\"", 0},
+    {"udp2raw_udp_packets_total", "dir=\"in\"", "datagrams read from and written to the udp side"},
+    {"udp2raw_udp_bytes_total", "dir=\"in\"", "bytes read from and written to the udp side"},
+    {"udp2raw_udp_packets_total", "dir=\"out\"", 0},
+    {"udp2raw_udp_bytes_total", "dir=\"out\"", 0},
+    {"udp2raw_handshakes_total", "result=\"ok\"", "handshake outcomes"},
+    {"udp2raw_handshakes_total", "result=\"rejected\"", 0},
+    {"udp2raw_handshakes_total", "result=\"invalid\"", 0},
+    {"udp2raw_handshakes_total", "result=\"resumed\"", 0},
+    {"udp2raw_decrypt_failures_total", "", "packets failed to decrypt or authenticate"},
+    {"udp2raw_id_mismatch_total", "", "packets with unexpected connection ids"},
+    {"udp2raw_replay_rejects_total", "", "packets rejected by the anti-replay window"},
+    {"udp2raw_send_errors_total", "side=\"raw\"", "failed sends"},
+    {"udp2raw_send_errors_total", "side=\"udp\"", 0},
+    {"udp2raw_drops_total", "reason=\"huge_packet\"", "dropped packets by reason"},
+    {"udp2raw_drops_total", "reason=\"max_conv\"", 0},
+    {"udp2raw_drops_total", "reason=\"unknown_conv\"", 0},
+    {"udp2raw_drops_total", "reason=\"pool_exhausted\"", 0},
+    {"udp2raw_drops_total", "reason=\"pcap_ring_full\"", 0},
+    {"udp2raw_drops_total", "reason=\"pacing_queue_full\"", 0},
+    {"udp2raw_coalesced_total", "kind=\"frames\"", "raw frames carrying several small datagrams,and the datagrams in them"},
+    {"udp2raw_coalesced_total", "kind=\"datagrams\"", 0},
+    {"udp2raw_fec_total", "kind=\"repair_sent\"", "repair frames sent,and lost frames rebuilt from repair frames"},
+    {"udp2raw_fec_total", "kind=\"recovered\"", 0},
+    {"udp2raw_oversize_datagrams_total", "", "datagrams larger than the probed path mtu allows,sent anyway and likely lost on the path"},
+};
+
+static void append(string &s, const char *fmt, ...) {
+    char buf[1000];
+    va_list vlist;
+    va_start(vlist, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, vlist);
+    va_end(vlist);
+    if (len < 0) return;
+    s.append(buf, min(len, (int)sizeof(buf) - 1));
+}
+static void sync_external_stats() {
+#ifdef UDP2RAW_MP
+    stats[stat_drop_pcap_ring_full] = pcap_ring.dropped;  // owned by the pcap thread,a stale read is fine
+#endif
+}
+static int conv_num(conn_info_t &conn_info) {
+    if (conn_info.blob == 0) return 0;
+    return program_mode == client_mode ? conn_info.blob->conv_manager.c.get_size() : conn_info.blob->conv_manager.s.get_size();
+}
+static void conn_text(string &s, int metric, conn_info_t &conn_info, const char *peer) {
+    const traffic_stats_t &t = conn_info.traffic;
+    if (metric == 0) {
+        append(s, "udp2raw_conn_raw_packets_total{peer=\"%s\",dir=\"in\"} %llu\n", peer, t.pkts_in);
+        append(s, "udp2raw_conn_raw_packets_total{peer=\"%s\",dir=\"out\"} %llu\n", peer, t.pkts_out);
+    } else if (metric == 1) {
+        append(s, "udp2raw_conn_raw_bytes_total{peer=\"%s\",dir=\"in\"} %llu\n", peer, t.bytes_in);
+        append(s, "udp2raw_conn_raw_bytes_total{peer=\"%s\",dir=\"out\"} %llu\n", peer, t.bytes_out);
+    } else if (metric == 2) {
+        append(s, "udp2raw_conn_convs{peer=\"%s\"} %d\n", peer, conv_num(conn_info));
+    } else if (conn_info.blob != 0) {
+        const pmtu_t &pmtu = conn_info.blob->pmtu;
+        append(s, "%s{peer=\"%s\"} %d\n", metric == 3 ? "udp2raw_conn_path_mtu" : "udp2raw_conn_max_datagram", peer, metric == 3 ? pmtu.mtu : pmtu.max_datagram);
+    }
+}
+template <class T>
+static void convs_text(string &s, conv_manager_t<T> &conv_manager, const char *peer) {
+    for (u32_t i = conv_manager.lru_head; i != conv_manager_t<T>::nil_index; i = conv_manager.records[i].lru_next) {
+        const traffic_stats_t &t = conv_manager.records[i].traffic;
+        append(s, "udp2raw_conv_udp_packets_total{peer=\"%s\",conv=\"%x\",dir=\"in\"} %llu\n", peer, conv_manager.records[i].conv, t.pkts_in);
+        append(s, "udp2raw_conv_udp_packets_total{peer=\"%s\",conv=\"%x\",dir=\"out\"} %llu\n", peer, conv_manager.records[i].conv, t.pkts_out);
+        append(s, "udp2raw_conv_udp_bytes_total{peer=\"%s\",conv=\"%x\",dir=\"in\"} %llu\n", peer, conv_manager.records[i].conv, t.bytes_in);
+        append(s, "udp2raw_conv_udp_bytes_total{peer=\"%s\",conv=\"%x\",dir=\"out\"} %llu\n", peer, conv_manager.records[i].conv, t.bytes_out);
+    }
+}
+struct memory_usage_t {
+    int conn_num;
+    int ready_num;
+    u64_t conv_table_bytes;
+    u64_t anti_replay_bytes;
+    u64_t coalesce_bytes;
+    u64_t fec_bytes;
+    u64_t pacing_bytes;
+    u64_t total()  // including free objects of the pools
+    {
+        return conn_info_pool.bytes() + blob_pool.bytes() + conv_table_bytes + anti_replay_bytes + coalesce_bytes + fec_bytes + pacing_bytes;
+    }
+    u64_t in_use() {
+        return (u64_t)conn_info_pool.used_num * conn_info_pool.obj_size + (u64_t)blob_pool.used_num * blob_pool.obj_size + conv_table_bytes + anti_replay_bytes +
+               coalesce_bytes + fec_bytes + pacing_bytes;
+    }
+};
+static void add_conn_memory(memory_usage_t &m, conn_info_t &conn_info) {
+    m.conn_num++;
+    if (conn_info.blob == 0) return;
+    m.ready_num++;
+    if (program_mode == client_mode)
+        m.conv_table_bytes += conn_info.blob->conv_manager.c.memory_bytes();
+    else
+        m.conv_table_bytes += conn_info.blob->conv_manager.s.memory_bytes();
+    m.anti_replay_bytes += conn_info.blob->anti_replay.word_num * sizeof(u64_t);
+    m.coalesce_bytes += conn_info.blob->coalesce.buf.capacity();
+    m.fec_bytes += conn_info.blob->fec_encoder.parity.capacity() + conn_info.blob->fec_decoder.memory_bytes();
+    m.pacing_bytes += conn_info.blob->pacer.queue.capacity();
+}
+static memory_usage_t get_memory_usage() {
+    memory_usage_t m;
+    memset(&m, 0, sizeof(m));
+    if (program_mode == client_mode) {
+        if (stats_client_conn != 0) add_conn_memory(m, *stats_client_conn);
+    } else {
+        for (auto it = conn_manager.mp.begin(); it != conn_manager.mp.end(); it++) add_conn_memory(m, *it->second);
+    }
+    return m;
+}
+static void memory_text(string &s, int with_help) {
+    memory_usage_t m = get_memory_usage();
+    if (with_help) append(s, "# HELP udp2raw_connections raw connections,ready ones have a blob\n# TYPE udp2raw_connections gauge\n");
+    append(s, "udp2raw_connections{state=\"handshake\"} %d\n", m.conn_num - m.ready_num);
+    append(s, "udp2raw_connections{state=\"ready\"} %d\n", m.ready_num);
+    if (with_help) append(s, "# HELP udp2raw_memory_bytes heap held by connection state,pools count whole chunks\n# TYPE udp2raw_memory_bytes gauge\n");
+    append(s, "udp2raw_memory_bytes{kind=\"conn_info\"} %llu\n", conn_info_pool.bytes());
+    append(s, "udp2raw_memory_bytes{kind=\"blob\"} %llu\n", blob_pool.bytes());
+    append(s, "udp2raw_memory_bytes{kind=\"conv_table\"} %llu\n", m.conv_table_bytes);
+    append(s, "udp2raw_memory_bytes{kind=\"anti_replay\"} %llu\n", m.anti_replay_bytes);
+    append(s, "udp2raw_memory_bytes{kind=\"coalesce\"} %llu\n", m.coalesce_bytes);
+    append(s, "udp2raw_memory_bytes{kind=\"fec\"} %llu\n", m.fec_bytes);
+    append(s, "udp2raw_memory_bytes{kind=\"pacing\"} %llu\n", m.pacing_bytes);
+    if (with_help) append(s, "# HELP udp2raw_pool_objects objects of the slab pools\n# TYPE udp2raw_pool_objects gauge\n");
+    append(s, "udp2raw_pool_objects{pool=\"conn_info\",state=\"used\"} %u\n", conn_info_pool.used_num);
+    append(s, "udp2raw_pool_objects{pool=\"conn_info\",state=\"free\"} %u\n", conn_info_pool.capacity() - conn_info_pool.used_num);
+    append(s, "udp2raw_pool_objects{pool=\"blob\",state=\"used\"} %u\n", blob_pool.used_num);
+    append(s, "udp2raw_pool_objects{pool=\"blob\",state=\"free\"} %u\n", blob_pool.capacity() - blob_pool.used_num);
+    if (with_help) append(s, "# HELP udp2raw_pool_object_bytes size of one object of the slab pools\n# TYPE udp2raw_pool_object_bytes gauge\n");
+    append(s, "udp2raw_pool_object_bytes{pool=\"conn_info\"} %u\n", conn_info_pool.obj_size);
+    append(s, "udp2raw_pool_object_bytes{pool=\"blob\"} %u\n", blob_pool.obj_size);
+}
+static u64_t clock_ns() {
+    timespec tmp_time;
+    clock_gettime(CLOCK_MONOTONIC, &tmp_time);
+    return ((u64_t)tmp_time.tv_sec) * 1000000000llu + tmp_time.tv_nsec;
+}
+static double ns_per_tick()  // the longer it runs the more accurate
+{
+    u64_t ticks = read_tsc() - tsc_base;
+    u64_t ns = clock_ns() - ns_base;
+    if (ticks == 0) return 1.0;
+    return (double)ns / ticks;
+}
+u64_t latency_hist_t::quantile(double q) {
+    if (count == 0) return 0;
+    u64_t rank = (u64_t)(q * count);
+    if (rank >= count - 1) return max;  // the exact value is known for the top one
+    u64_t seen = 0;
+    for (int i = 0; i < bucket_num; i++) {
+        seen += buckets[i];
+        if (seen > rank) return min(value_of(i), max);
+    }
+    return max;
+}
+void latency_start(int sample_rate) {
+    latency_reset();
+    tsc_base = read_tsc();
+    ns_base = clock_ns();
+    usleep(10 * 1000);  // so that ns_per_tick() is sane even for an early dump
+    latency_sample_rate = sample_rate;
+}
+void latency_reset() {
+    for (int i = 0; i < lat_stage_end; i++) {
+        latency_hists[i].clear();
+        latency_countdown[i] = 1;
+    }
+}
+void latency_dump() {
+    if (latency_sample_rate == 0) {
+        mylog(log_info, "latency histograms are disabled,enable them with --latency-hist\n");
+        return;
+    }
+    double k = ns_per_tick();
+    log_bare(log_info, "%-10s %10s %10s %10s %10s %10s %10s   (ns,1 of %d sampled)\n", "stage", "count", "p50", "p90", "p99", "p99.9", "max", latency_sample_rate);
+    for (int i = 0; i < lat_stage_end; i++) {
+        latency_hist_t &h = latency_hists[i];
+        log_bare(log_info, "%-10s %10llu %10.0f %10.0f %10.0f %10.0f %10.0f\n", lat_stage_name[i], h.count, h.quantile(0.5) * k,
+                 h.quantile(0.9) * k, h.quantile(0.99) * k, h.quantile(0.999) * k, h.max * k);
+    }
+}
+static void latency_text(string &s)  // prometheus summary
+{
+    if (latency_sample_rate == 0) return;
+    static const double qs[] = {0.5, 0.9, 0.99, 0.999};
+    double k = ns_per_tick() / 1e9;
+    append(s, "# HELP udp2raw_stage_latency_seconds time spent in a stage of the packet path,sampled\n# TYPE udp2raw_stage_latency_seconds summary\n");
+    for (int i = 0; i < lat_stage_end; i++) {
+        latency_hist_t &h = latency_hists[i];
+        for (int j = 0; j < int(sizeof(qs) / sizeof(qs[0])); j++)
+            append(s, "udp2raw_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", lat_stage_name[i], qs[j], h.quantile(qs[j]) * k);
+        append(s, "udp2raw_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", lat_stage_name[i], h.sum * k);
+        append(s, "udp2raw_stage_latency_seconds_count{stage=\"%s\"} %llu\n", lat_stage_name[i], h.count);
+    }
+}
+
+static string stats_text(int with_help, int with_convs)  // prometheus text exposition format,samples of one metric must be contiguous
+{
+    static const char *conn_help[5][3] = {
+        {"udp2raw_conn_raw_packets_total", "raw packets of a connection", "counter"},
+        {"udp2raw_conn_raw_bytes_total", "raw bytes of a connection", "counter"},
+        {"udp2raw_conn_convs", "convs of a connection", "gauge"},
+        {"udp2raw_conn_path_mtu", "ip packet size that gets through to the peer,found by --pmtu-probe,0 if unknown", "gauge"},
+        {"udp2raw_conn_max_datagram", "largest udp datagram that fits the path mtu,0 if unknown", "gauge"},
+    };
+    string s;
+    sync_external_stats();
+    for (int i = 0; i < stat_end; i++) {
+        if (stat_desc[i].help == 0) continue;  // printed together with the first one of its metric
+        if (with_help) {
+            append(s, "# HELP %s %s\n", stat_desc[i].metric, stat_desc[i].help);
+            append(s, "# TYPE %s counter\n", stat_desc[i].metric);
+        }
+        for (int j = i; j < stat_end; j++) {
+            if (strcmp(stat_desc[j].metric, stat_desc[i].metric) != 0) continue;
+            if (stat_desc[j].labels[0] == 0)
+                append(s, "%s %llu\n", stat_desc[j].metric, stats[j]);
+            else
+                append(s, "%s{%s} %llu\n", stat_desc[j].metric, stat_desc[j].labels, stats[j]);
+        }
+    }
+
+    for (int m = 0; m < 5; m++) {
+        if (with_help) append(s, "# HELP %s %s\n# TYPE %s %s\n", conn_help[m][0], conn_help[m][1], conn_help[m][0], conn_help[m][2]);
+        if (program_mode == client_mode) {
+            if (stats_client_conn != 0) conn_text(s, m, *stats_client_conn, remote_addr.get_str());
+        } else {
+            for (auto it = conn_manager.mp.begin(); it != conn_manager.mp.end(); it++) {
+                addr_str_t peer(it->first);
+                conn_text(s, m, *it->second, peer.c_str());
+            }
+        }
+    }
+
+    memory_text(s, with_help);
+
+    if (with_help) latency_text(s);  // only for prometheus,the fifo has its own command
+
+    if (with_convs) {  // not exported to prometheus,one series per conv is too many
+        if (program_mode == client_mode) {
+            if (stats_client_conn != 0 && stats_client_conn->blob != 0) convs_text(s, stats_client_conn->blob->conv_manager.c, remote_addr.get_str());
+        } else {
+            for (auto it = conn_manager.mp.begin(); it != conn_manager.mp.end(); it++) {
+                addr_str_t peer(it->first);
+                if (it->second->blob != 0) convs_text(s, it->second->blob->conv_manager.s, peer.c_str());
+            }
+        }
+    }
+    return s;
+}
+
+void stats_dump(int with_convs) {
+    string s = stats_text(0, with_convs);
+    size_t begin = 0, end;
+    while ((end = s.find('\n', begin)) != string::npos) {  // line by line,a log line has a limited length
+        log_bare(log_info, "%s\n", s.substr(begin, end - begin).c_str());
+        begin = end + 1;
+    }
+    memory_usage_t m = get_memory_usage();
+    log_bare(log_info, "memory: %llu bytes held,%llu in use by %d connections (%d ready),%llu bytes per connection\n", m.total(), m.in_use(),
+             m.conn_num, m.ready_num, m.conn_num == 0 ? 0 : m.in_use() / m.conn_num);
+}
+
+#if !defined(__MINGW32__)
+int stats_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        mylog(log_fatal, "metrics socket path too long:%s\n", path);
+        myexit(-1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        mylog(log_fatal, "create metrics socket failed,%s\n", strerror(errno));
+        myexit(-1);
+    }
+    unlink(path);  // left over from last run
+    if (::bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(path, 0600) != 0 || listen(fd, 16) != 0) {  // metrics show peer addresses,owner only
+        mylog(log_fatal, "bind/listen metrics socket %s failed,%s\n", path, strerror(errno));
+        myexit(-1);
+    }
+    setnonblocking(fd);
+    mylog(log_info, "metrics socket listening at %s\n", path);
+    return fd;
+}
+// one metrics client at a time,served a bit on each readiness event of its fd,so a slow client never blocks the event loop.
+// prometheus scrapes one after another,a new client replaces an unfinished one
+static int metrics_client_fd = -1;
+static string metrics_req;
+static string metrics_reply;  // empty while the request is still being read
+static size_t metrics_off;
+
+static void stats_client_close() {
+    if (metrics_client_fd < 0) return;
+    close(metrics_client_fd);
+    metrics_client_fd = -1;
+    metrics_req.clear();
+    metrics_reply.clear();
+    metrics_off = 0;
+}
+
+void stats_serve(int listen_fd)  // called when listen_fd is readable
+{
+    int fd = accept(listen_fd, 0, 0);
+    if (fd < 0) {
+        mylog(log_debug, "accept metrics client failed,%s\n", strerror(errno));
+        return;
+    }
+    if (metrics_client_fd >= 0) {
+        mylog(log_debug, "metrics client too slow,dropped for a new one\n");
+        stats_client_close();
+    }
+    setnonblocking(fd);
+    metrics_client_fd = fd;
+    stats_client_io();  // the request is often there already
+}
+
+int stats_client_fd(int *want_write)  // -1 if there is no client,otherwise the fd to watch and in which direction
+{
+    *want_write = !metrics_reply.empty();
+    return metrics_client_fd;
+}
+
+void stats_client_io()  // whatever the request is,reply with the metrics
+{
+    if (metrics_client_fd < 0) return;
+    char buf[1000];
+    while (metrics_reply.empty()) {  // consume the request,closing with unread data resets the connection
+        if (metrics_req.find("\r\n\r\n") == string::npos && metrics_req.size() < 8000) {
+            int ret = recv(metrics_client_fd, buf, sizeof(buf), 0);
+            if (ret > 0) {
+                metrics_req.append(buf, ret);
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;  // wait for more
+            // peer closed its side or error,reply anyway
+        }
+        string body = stats_text(1, 0);
+        append(metrics_reply, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", (int)body.size());
+        metrics_reply += body;
+        metrics_off = 0;
+    }
+
+    while (metrics_off < metrics_reply.size()) {
+        int ret = send(metrics_client_fd, metrics_reply.c_str() + metrics_off, metrics_reply.size() - metrics_off, MSG_NOSIGNAL);
+        if (ret > 0) {
+            metrics_off += ret;
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;  // wait for the client to read
+        mylog(log_debug, "write to metrics client failed,%s\n", strerror(errno));
+        break;
+    }
+    stats_client_close();
+}
+#else
+int stats_listen(const char *path) {
+    mylog(log_fatal, "--metrics-sock not supported on this platform\n");
+    myexit(-1);
+    return -1;
+}
+void stats_serve(int listen_fd) {
+}
+int stats_client_fd(int *want_write) {
+    *want_write = 0;
+    return -1;
+}
+void stats_client_io() {
+}
+#endif
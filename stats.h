@@ -0,0 +1,157 @@
+/*
+ * stats.h
+ *
+ *  counters of the packet path. everything runs in the event loop thread,so they are plain integers
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "common.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum stat_id_t {
+    stat_raw_pkts_in = 0,  // raw packets received,before any check
+    stat_raw_bytes_in,
+    stat_raw_pkts_out,  // raw packets handed to the kernel successfully
+    stat_raw_bytes_out,
+    stat_udp_pkts_in,  // datagrams read from the udp side
+    stat_udp_bytes_in,
+    stat_udp_pkts_out,  // datagrams written to the udp side
+    stat_udp_bytes_out,
+    stat_handshake_ok,
+    stat_handshake_rejected,  // max_handshake_conn_num or max_ready_conn_num reached
+    stat_handshake_invalid,   // malformed or unexpected handshake packet
+    stat_handshake_resumed,   // a returning client showed its ticket and skipped the handshake
+    stat_decrypt_fail,
+    stat_id_mismatch,
+    stat_replay_reject,
+    stat_raw_send_error,
+    stat_udp_send_error,
+    stat_drop_huge_packet,
+    stat_drop_max_conv,
+    stat_drop_unknown_conv,
+    stat_drop_pool_exhausted,
+    stat_drop_pcap_ring_full,  // filled in from pcap_ring when dumped
+    stat_drop_pacing,          // pacing queue of a connection full,--pacing-rate
+    stat_coalesce_frames,      // 'm' frames sent,--coalesce
+    stat_coalesce_datagrams,   // datagrams carried by them
+    stat_fec_repair_out,       // 'r' frames sent,--fec
+    stat_fec_recovered,        // lost frames rebuilt from 'r' frames
+    stat_pmtu_oversize,        // datagrams larger than the probed path mtu allows
+    stat_end
+};
+
+extern u64_t stats[stat_end];
+
+inline void stat_add(stat_id_t id, u64_t n = 1) {
+    stats[id] += n;
+}
+
+struct traffic_stats_t  // per connection (raw side) and per conv (udp side)
+{
+    u64_t pkts_in;
+    u64_t bytes_in;
+    u64_t pkts_out;
+    u64_t bytes_out;
+    traffic_stats_t() {
+        clear();
+    }
+    void clear() {
+        pkts_in = bytes_in = pkts_out = bytes_out = 0;
+    }
+    void add_in(int len) {
+        pkts_in++;
+        bytes_in += len;
+    }
+    void add_out(int len) {
+        pkts_out++;
+        bytes_out += len;
+    }
+};
+
+enum lat_stage_t {
+    lat_raw_recv = 0,  // recvfrom() of raw socket
+    lat_raw_parse,     // recv_raw0(),header parse of the raw packet
+    lat_decrypt,       // my_decrypt()
+    lat_dispatch,      // server_on_raw_recv_ready() or client_on_raw_recv_hs2_or_ready(),includes udp_send
+    lat_udp_send,      // send()/sendto()/sendmmsg() to the udp side
+    lat_udp_recv,      // recv()/recvmmsg() from the udp side
+    lat_encrypt,       // my_encrypt()
+    lat_raw_send,      // send_raw0(),header build and sendto(),or queueing while a batch is open
+    lat_timer,         // one timer_wheel.advance() of server
+    lat_stage_end
+};
+
+struct latency_hist_t  // log-linear buckets as in HdrHistogram,values are in ticks of read_tsc()
+{
+    static const int sub_bits = 3;  // 8 sub buckets per power of 2,relative error < 12.5%
+    static const int sub_num = 1 << sub_bits;
+    static const int bucket_num = (64 - sub_bits + 1) << sub_bits;
+
+    u64_t buckets[bucket_num];
+    u64_t count;
+    u64_t sum;
+    u64_t max;
+    void clear() {
+        memset(buckets, 0, sizeof(buckets));
+        count = sum = max = 0;
+    }
+    static int bucket_of(u64_t v) {
+        if (v < (u64_t)sub_num) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - sub_bits;
+        return ((shift + 1) << sub_bits) + (int)((v >> shift) & (sub_num - 1));
+    }
+    static u64_t value_of(int bucket)  // middle of the bucket
+    {
+        if (bucket < sub_num) return bucket;
+        int shift = (bucket >> sub_bits) - 1;
+        return ((u64_t)(sub_num + (bucket & (sub_num - 1))) << shift) + ((1llu << shift) >> 1);
+    }
+    void add(u64_t v) {
+        buckets[bucket_of(v)]++;
+        count++;
+        sum += v;
+        if (v > max) max = v;
+    }
+    u64_t quantile(double q);
+};
+
+extern int latency_sample_rate;  // --latency-hist,0 means disabled,otherwise record one of every n measurements of a stage
+extern int latency_countdown[lat_stage_end];
+extern latency_hist_t latency_hists[lat_stage_end];
+
+inline u64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec tmp_time;
+    clock_gettime(CLOCK_MONOTONIC, &tmp_time);
+    return ((u64_t)tmp_time.tv_sec) * 1000000000llu + tmp_time.tv_nsec;
+#endif
+}
+inline u64_t lat_begin(lat_stage_t stage)  // returns 0 if this measurement is not sampled
+{
+    if (latency_sample_rate == 0 || --latency_countdown[stage] > 0) return 0;
+    latency_countdown[stage] = latency_sample_rate;
+    return read_tsc();
+}
+inline void lat_record(lat_stage_t stage, u64_t begin) {
+    if (begin != 0) latency_hists[stage].add(read_tsc() - begin);
+}
+
+struct conn_info_t;
+extern conn_info_t *stats_client_conn;
+
+void latency_start(int sample_rate);
+void latency_dump();   // percentiles of every stage with mylog,for the fifo command "latency"
+void latency_reset();  // for the fifo command "latency reset"
+void stats_dump(int with_convs);  // print everything with mylog,for the fifo command "stats"
+int stats_listen(const char *path);  // unix socket for prometheus,returns fd
+void stats_serve(int listen_fd);     // accept a client,the exchange goes on in stats_client_io()
+int stats_client_fd(int *want_write);  // fd of the client being served or -1,the event loop watches it
+void stats_client_io();                // on readiness of stats_client_fd()
+
+#endif /* STATS_H_ */
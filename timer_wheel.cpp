@@ -0,0 +1,188 @@
+/*
+ * timer_wheel.cpp
+ *
+ *  hierarchical timing wheel, 4 levels of 64 slots. level 0 has one slot per tick,
+ *  each higher level slot covers a whole lap of the level below and is cascaded down
+ *  when the lower level wraps. add/del are O(1),advance is O(due timers + ticks passed).
+ *  timer_heap_t is a plain binary heap,each timer remembers its index so it can be moved or removed in place.
+ */
+
+#include "timer_wheel.h"
+#include "log.h"
+
+timer_wheel_t::timer_wheel_t() {
+    for (int i = 0; i < level_num; i++)
+        for (int j = 0; j < slot_num; j++) {
+            heads[i][j].prev = heads[i][j].next = &heads[i][j];
+        }
+    tick_ms = 10;
+    current_tick = 0;
+    earliest_added = u64_t(-1);
+    count = 0;
+    running = 0;
+}
+void timer_wheel_t::init(u64_t now_ms, u64_t tick_ms0) {
+    assert(count == 0);
+    assert(tick_ms0 > 0);
+    tick_ms = tick_ms0;
+    current_tick = now_ms / tick_ms;
+}
+void timer_wheel_t::link(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+void timer_wheel_t::unlink(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = 0;
+}
+void timer_wheel_t::place(wheel_timer_t *timer) {
+    if (timer->expire_tick < current_tick) timer->expire_tick = current_tick;
+
+    u64_t delta = timer->expire_tick - current_tick;
+    for (int level = 0; level < level_num; level++) {
+        if (delta < (1llu << (slot_bits * (level + 1)))) {
+            int slot = (timer->expire_tick >> (slot_bits * level)) & slot_mask;
+            link(&heads[level][slot], timer);
+            return;
+        }
+    }
+    // too far away,clamp to the end of last level. it will be re-placed when cascaded
+    timer->expire_tick = current_tick + (1llu << (slot_bits * level_num)) - 1;
+    int slot = (timer->expire_tick >> (slot_bits * (level_num - 1))) & slot_mask;
+    link(&heads[level_num - 1][slot], timer);
+}
+void timer_wheel_t::cascade(int level) {
+    int slot = (current_tick >> (slot_bits * level)) & slot_mask;
+    wheel_timer_t &head = heads[level][slot];
+    if (head.next == &head) return;
+
+    wheel_timer_t tmp;  // detach first,a re-placed timer may go back to the same slot
+    tmp.next = head.next;
+    tmp.prev = head.prev;
+    tmp.next->prev = &tmp;
+    tmp.prev->next = &tmp;
+    head.prev = head.next = &head;
+
+    while (tmp.next != &tmp) {
+        wheel_timer_t *timer = tmp.next;
+        unlink(timer);
+        place(timer);
+    }
+}
+void timer_wheel_t::add(wheel_timer_t *timer, u64_t expire_ms) {
+    assert(timer->cb != 0);
+    if (timer->is_pending()) {
+        unlink(timer);
+        count--;
+    }
+    timer->expire_tick = (expire_ms + tick_ms - 1) / tick_ms;  // round up,never fire early
+    if (running && timer->expire_tick <= current_tick) timer->expire_tick = current_tick + 1;  // dont re-run a timer in the slot being processed
+    place(timer);
+    count++;
+    if (timer->expire_tick * tick_ms < earliest_added) earliest_added = timer->expire_tick * tick_ms;
+}
+void timer_wheel_t::del(wheel_timer_t *timer) {
+    if (!timer->is_pending()) return;
+    unlink(timer);
+    count--;
+}
+int timer_wheel_t::advance(u64_t now_ms) {
+    u64_t now_tick = now_ms / tick_ms;
+    int fired = 0;
+    running = 1;
+    while (current_tick <= now_tick) {
+        if (count == 0) {  // nothing to cascade or fire,just jump
+            current_tick = now_tick + 1;
+            break;
+        }
+        int slot = current_tick & slot_mask;
+        if (slot == 0) {
+            for (int level = 1; level < level_num; level++) {
+                cascade(level);
+                if (((current_tick >> (slot_bits * level)) & slot_mask) != 0) break;
+            }
+        }
+        wheel_timer_t &head = heads[0][slot];
+        while (head.next != &head) {
+            wheel_timer_t *timer = head.next;
+            unlink(timer);
+            count--;
+            timer->cb(timer);  // may re-add itself,or add/del other timers
+            fired++;
+        }
+        current_tick++;
+    }
+    running = 0;
+    return fired;
+}
+u64_t timer_wheel_t::next_expire_ms() {
+    if (count == 0) return 0;
+    for (int i = 0; i < slot_num; i++) {
+        u64_t tick = current_tick + i;
+        if ((tick & slot_mask) == 0) return tick * tick_ms;  // cascade point,higher levels may bring something due
+        if (heads[0][tick & slot_mask].next != &heads[0][tick & slot_mask]) return tick * tick_ms;
+    }
+    assert(0 == 1);  // a lap always contains a cascade point
+    return current_tick * tick_ms;
+}
+int timer_wheel_t::need_rearm(u64_t armed_ms) {
+    int ret = earliest_added < armed_ms;
+    earliest_added = u64_t(-1);
+    return ret;
+}
+
+void timer_heap_t::place(int i, heap_timer_t *timer) {
+    heap[i] = timer;
+    timer->index = i;
+}
+void timer_heap_t::sift_up(int i) {
+    heap_timer_t *timer = heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->deadline <= timer->deadline) break;
+        place(i, heap[parent]);
+        i = parent;
+    }
+    place(i, timer);
+}
+void timer_heap_t::sift_down(int i) {
+    heap_timer_t *timer = heap[i];
+    int n = heap.size();
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && heap[child + 1]->deadline < heap[child]->deadline) child++;
+        if (timer->deadline <= heap[child]->deadline) break;
+        place(i, heap[child]);
+        i = child;
+    }
+    place(i, timer);
+}
+void timer_heap_t::set(heap_timer_t *timer, u64_t deadline) {
+    if (!timer->is_pending()) {
+        timer->deadline = deadline;
+        heap.push_back(timer);
+        sift_up(heap.size() - 1);
+        return;
+    }
+    u64_t old = timer->deadline;
+    timer->deadline = deadline;
+    if (deadline < old)
+        sift_up(timer->index);
+    else
+        sift_down(timer->index);
+}
+void timer_heap_t::del(heap_timer_t *timer) {
+    if (!timer->is_pending()) return;
+    int i = timer->index;
+    heap_timer_t *last = heap.back();
+    heap.pop_back();
+    timer->index = -1;
+    if (last == timer) return;
+    place(i, last);
+    sift_up(i);
+    sift_down(last->index);
+}
@@ -0,0 +1,97 @@
+/*
+ * timer_wheel.h
+ *
+ *  hierarchical timing wheel, one timer fd drives all per-connection timers of server.
+ *  and a min-heap for the short us deadlines of the send path,which are too fine for the wheel's tick
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include "common.h"
+
+struct wheel_timer_t  // embed it into the owner,the wheel never allocates
+{
+    wheel_timer_t *prev;
+    wheel_timer_t *next;
+    u64_t expire_tick;
+    void (*cb)(wheel_timer_t *timer);
+    void *data;
+
+    wheel_timer_t() {
+        prev = next = 0;
+        expire_tick = 0;
+        cb = 0;
+        data = 0;
+    }
+    int is_pending() {
+        return next != 0;
+    }
+};
+
+struct timer_wheel_t : not_copy_able_t {
+    static const int slot_bits = 6;
+    static const int slot_num = 1 << slot_bits;
+    static const int slot_mask = slot_num - 1;
+    static const int level_num = 4;  // 64^4 ticks, about 46 hours with 10ms tick
+
+    void init(u64_t now_ms, u64_t tick_ms);
+    void add(wheel_timer_t *timer, u64_t expire_ms);  // absolute time in ms,re-add is allowed
+    void del(wheel_timer_t *timer);                    // no-op if not pending
+    int advance(u64_t now_ms);                         // run all due timers,returns number of timers fired
+    u64_t next_expire_ms();                            // earliest time worth waking up for,0 if nothing pending
+    int need_rearm(u64_t armed_ms);                    // a timer earlier than armed_ms was added since last call
+    int size() {
+        return count;
+    }
+    timer_wheel_t();
+
+   private:
+    u64_t tick_ms;
+    u64_t current_tick;  // next tick to be processed
+    u64_t earliest_added;
+    int count;
+    int running;  // inside advance()
+    wheel_timer_t heads[level_num][slot_num];  // list sentinels
+    void place(wheel_timer_t *timer);
+    void cascade(int level);
+    void link(wheel_timer_t *head, wheel_timer_t *timer);
+    void unlink(wheel_timer_t *timer);
+};
+
+extern timer_wheel_t timer_wheel;
+
+struct heap_timer_t  // embed it into the owner,like wheel_timer_t. no callback,the owner of the heap knows what is due
+{
+    u64_t deadline;
+    int index;  // position in the heap,-1 if not pending
+    void *data;
+
+    heap_timer_t() {
+        deadline = 0;
+        index = -1;
+        data = 0;
+    }
+    int is_pending() {
+        return index >= 0;
+    }
+};
+
+struct timer_heap_t : not_copy_able_t {  // binary min-heap on deadline,set/del are O(log n),top is O(1)
+    void set(heap_timer_t *timer, u64_t deadline);  // add,or move a pending timer
+    void del(heap_timer_t *timer);                  // no-op if not pending
+    heap_timer_t *top() {                           // earliest,0 if empty
+        return heap.empty() ? 0 : heap[0];
+    }
+    int size() {
+        return heap.size();
+    }
+
+   private:
+    vector<heap_timer_t *> heap;
+    void place(int i, heap_timer_t *timer);
+    void sift_up(int i);
+    void sift_down(int i);
+};
+
+#endif /* TIMER_WHEEL_H_ */